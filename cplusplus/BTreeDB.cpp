@@ -2,11 +2,16 @@
 
 #include "stdafx.h"
 #include "btreedb.h"
+#include <windows.h>
 
 using namespace std;
 
 namespace Database
 {
+	// How many times an optimistic get starts again from the root
+	// before it takes the lock instead.
+	static const size_t OPTIMISTIC_TRIES = 8;
+
 	// The constructor simply sets up the different data members, and if
 	// the caller doesn't provide a compare function of their own, specifies
 	// the default comparison function.
@@ -18,7 +23,33 @@ namespace Database
 		, _minDegree(minDegree)
 		, _dataFile(0)
 		, _nodeSize((size_t)-1)
+		, _valueThreshold(0)
+		, _valueGen(0)
+		, _compressPages(false)
+		, _bloomKeys(0)
+		, _useHashIndex(false)
+		, _countRecords(false)
+		, _scanThreads(0)
+		, _dirtyPercent(0)
+		, _maxDirtyAge(1000)
+		, _checkpointInterval(10000)
+		, _stopping(false)
+		, _rootMoved(false)
+		, _copyOnWrite(false)
+		, _txnId(0)
+		, _optimistic(false)
+		, _rootNode((TreeNode*)0)
+		, _epoch(1)
+		, _bufferSize(0)
+		, _messageCount(0)
+		, _batching(false)
+		, _lazyPending(0)
+		, _lazyFill(0)
 	{
+		for (size_t ctr = 0; ctr < READER_SLOTS; ctr++)
+		{
+			_readers[ctr].epoch = 0;
+		}
 		if (!_compFunc)
 		{
 			_compFunc = _defaultCompare;
@@ -36,8 +67,32 @@ namespace Database
 	// We also have to close the file.
 	BTreeDB::~BTreeDB(void)
 	{
+		_stopFlusher();
+		if (_dataFile != 0)
+		{
+			_drainMessages();
+		}
+		if (!_dirty.empty() || _rootMoved)
+		{
+			_writeBack(true, true);
+		}
 		_root->unload();
 		_root = (TreeNode*)0;
+		_rootNode = (TreeNode*)0;
+		for (size_t ctr = 0; ctr < _retiredNodes.size(); ctr++)
+		{
+			if ((TreeNode*)_retiredNodes[ctr].node != 0)
+			{
+				_retiredNodes[ctr].node->unload();
+			}
+		}
+		_retiredNodes.clear();
+		_valueLog = (ValueLog*)0;
+		_store = (PageStore*)0;
+		_bloom = (BloomFilter*)0;
+		_hashIndex = (HashIndex*)0;
+		_cache = (RecordCache*)0;
+		_pool = (ThreadPool*)0;
 		if (_dataFile != 0)
 		{
 			fclose(_dataFile);
@@ -45,12 +100,17 @@ namespace Database
 		}
 	}
 
-	// This is the static default comparator. It just
-	// compares the contents of the two DbObj's being
-	// compared using memcmp.
-	int BTreeDB::_defaultCompare(const DbObjPtr& obj1, const DbObjPtr& obj2)
+	// This is the static default comparator. It compares the two
+	// keys using memcmp, and if one is the start of the other, the
+	// shorter one comes first.
+	int BTreeDB::_defaultCompare(const void* key1, size_t size1, const void* key2, size_t size2)
 	{
-		return memcmp(obj1->getData(), obj2->getData(), min(obj1->getSize(), obj2->getSize()));
+		int ret = memcmp(key1, key2, min(size1, size2));
+		if (ret == 0 && size1 != size2)
+		{
+			ret = (size1 < size2) ? -1 : 1;
+		}
+		return ret;
 	}
 
 	// Allocate a new node for this tree. This method
@@ -59,11 +119,9 @@ namespace Database
 	// added to the file.
 	TreeNodePtr BTreeDB::_allocateNode()
 	{
-		TreeNodePtr newNode = new TreeNode;
-		int fh = _fileno(_dataFile);
-		newNode->fpos = _filelength(fh);
-		newNode->loaded = true;
-		_chsize(fh, (long)(newNode->fpos + _nodeSize));
+		TreeNodePtr newNode = new TreeNode(&_layout);
+		newNode->fpos = _allocatePage();
+		newNode->allocate();
 		return newNode;
 	}
 
@@ -71,7 +129,7 @@ namespace Database
 	// a reference to the node containing the key, and the offset of the key within
 	// the node. If not found, the resulting pair will have a null tree node pointer
 	// and a location of -1.
-	NodeKeyLocn BTreeDB::_search(const TreeNodePtr& node, const DbObjPtr& key, compareFn cfn)
+	NodeKeyLocn BTreeDB::_search(const TreeNodePtr& start, const DbObjPtr& key, compareFn cfn)
 	{
 		NodeKeyLocn ret(TreeNodePtr(), (size_t)-1);
 		if (cfn == 0)
@@ -79,11 +137,15 @@ namespace Database
 			cfn = _compFunc;
 		}
 
-		OBJECTPOS op = node->findPos(key, cfn);
-		if (op.first != (size_t)-1)
+		// Go down by raw pointers, as each node is held by its parent's
+		// reference to it. Only a child that isn't swizzled, or has been
+		// unloaded, goes through loadChild.
+		TreeNode* node = start;
+		for (;;)
 		{
-			TreeNodePtr child;
-			switch (op.second)
+			OBJECTPOS op = node->findPos(key, cfn);
+			size_t childNo = 0;
+			switch (op.first == (size_t)-1 ? ECP_NONE : op.second)
 			{
 			case ECP_INTHIS:
 				// If the key is present in the tested node,
@@ -91,144 +153,168 @@ namespace Database
 				// node and the position within the node.
 				ret.first = node;
 				ret.second = op.first;
-				break;
+				return ret;
 
 			case ECP_INLEFT:
 				// If the key is present in a child to the
-				// left of the tested node, recurse in to the
+				// left of the tested node, go down to the
 				// child on the left.
-				child = node->loadChild(op.first, _dataFile, _recSize);
-				ret = _search(child, key);
+				childNo = op.first;
 				break;
 
 			case ECP_INRIGHT:
 				// If the key is present in a child to the
-				// right of the tested node, recurse in to the
+				// right of the tested node, go down to the
 				// child on the right.
-				child = node->loadChild(op.first + 1, _dataFile, _recSize);
-				ret = _search(child, key);
+				childNo = op.first + 1;
 				break;
 
 			default:
-				break;
+				return ret;
+			}
+			TreeNode* child = node->children[childNo].node();
+			if (child == 0 || !child->loaded)
+			{
+				child = node->loadChild(childNo, _store);
 			}
+			node = child;
 		}
-		return ret;
 	}
 
 	// Splits a child node, creating a new node. The median value from the
 	// full child is moved into the *non-full* parent. The keys above the
-	// median are moved from the full child to the new child.
+	// median are moved from the full child to the new child. The median
+	// is picked by bytes rather than by count (see TreeNode::splitPoint).
 	void BTreeDB::_split(TreeNodePtr& parent, size_t childNum, TreeNodePtr& child)
 	{
+		_latch(parent);
+		_latch(child);
 		size_t ctr = 0;
-		DbObjPtr saveObj;
+		size_t median = child->splitPoint();
+		size_t highCount = child->objCount - median - 1;
 		TreeNodePtr newChild = _allocateNode();
 		newChild->isLeaf = child->isLeaf;
-		newChild->setCount(_minDegree - 1);
+		newChild->setCount(highCount);
 
-		// Put the high values in the new child, then shrink the existing child.
-		for (ctr = 0; ctr < _minDegree - 1; ctr++)
-		{
-			newChild->objects[ctr] = child->objects[_minDegree + ctr];
-		}
+		// Put the high values in the new child.
+		newChild->copyRecords(0, child, median + 1, highCount);
 		if (!child->isLeaf)
 		{
-			for (ctr = 0; ctr < _minDegree; ctr++)
+			for (ctr = 0; ctr <= highCount; ctr++)
 			{
-				TreeNodePtr mover = child->children[_minDegree + ctr];
-				newChild->children[ctr] = mover;
-				mover->childNo = ctr;
-				mover->parent = newChild;
+				newChild->moveChild(ctr, child, median + 1 + ctr);
 			}
 		}
-		saveObj = child->objects[_minDegree - 1];
-		child->setCount(_minDegree - 1);
 
-		// Move the child pointers above childNum up in the parent
+		// Move the child pointers and the objects above childNum up in the parent
 		parent->setCount(parent->objCount + 1);
 		for (ctr = parent->objCount; ctr > childNum + 1; ctr--)
 		{
-			parent->children[ctr] = parent->children[ctr - 1];
-			parent->children[ctr]->childNo = ctr;
+			parent->moveChild(ctr, parent, ctr - 1);
 		}
 		parent->children[childNum + 1] = newChild;
 		newChild->childNo = childNum + 1;
 		newChild->parent = parent;
-		for (ctr = parent->objCount - 1; ctr > childNum; ctr--)
-		{
-			parent->objects[ctr] = parent->objects[ctr - 1];
-		}
-		parent->objects[childNum] = saveObj;
+		parent->copyRecords(childNum + 1, parent, childNum, parent->objCount - childNum - 1);
+
+		// The median goes up into the parent, then shrink the existing child.
+		parent->copyRecord(childNum, child, median);
+		child->setCount(median);
+		_splitMessages(parent, childNum, child, newChild);
+		_recount(parent);
 //problem?
-		child->write(_dataFile);
-		newChild->write(_dataFile);
-		parent->write(_dataFile);
+		_write(child);
+		_write(newChild);
+		_write(parent);
+		_indexRecords(newChild, 0, highCount);
+		_indexRecords(parent, childNum, 1);
 	}
 
 	// Merges two child nodes, removing one node from the parent and
 	// putting it into the new merged node. This is the inverse of the
 	// _split method above. Only the object number is given, since the
 	// children to be merged can be derived from that.
-	// The assumption here is that both c1 and c2 have _minDegree - 1
-	// keys.
+	// The assumption here is that neither c1 nor c2 is safe to delete
+	// from, so that together they fit in a node with room to spare.
 	TreeNodePtr BTreeDB::_merge(TreeNodePtr& parent, size_t objNo)
 	{
 		size_t ctr = 0;
-		TreeNodePtr c1 = parent->children[objNo];
-		TreeNodePtr c2 = parent->children[objNo + 1];
-
-		// Make the two child nodes into a single node
-		c1->objects.resize(2 * _minDegree - 1);
-		for (ctr = 0; ctr < _minDegree - 1; ctr++)
-		{
-			c1->objects[_minDegree + ctr] = c2->objects[ctr];
-		}
+		TreeNodePtr c1 = parent->loadChild(objNo, _store);
+		TreeNodePtr c2 = parent->loadChild(objNo + 1, _store);
+		_latch(parent);
+		_latch(c1);
+		_latch(c2);
+		size_t c1Count = c1->objCount;
+		size_t c2Count = c2->objCount;
+
+		// Make the two child nodes into a single node, with the
+		// object from the parent in the middle.
+		c1->setCount(c1Count + c2Count + 1);
+		c1->copyRecord(c1Count, parent, objNo);
+		c1->copyRecords(c1Count + 1, c2, 0, c2Count);
 		if (!c2->isLeaf)
 		{
-			c1->children.resize(2 * _minDegree);
-			for (ctr = 0; ctr < _minDegree; ctr++)
+			for (ctr = 0; ctr <= c2Count; ctr++)
 			{
-				size_t newPos = _minDegree + ctr;
-				c1->children[newPos] = c2->children[ctr];
-				c1->children[newPos]->childNo = newPos; // Thanks steradrian
+				c1->moveChild(c1Count + 1 + ctr, c2, ctr); // Thanks steradrian
 			}
 		}
-
-		// Put the parent into the middle
-		c1->objects[_minDegree - 1] = parent->objects[objNo];
-		c1->objCount = 2 * _minDegree - 1;
+		while (c2->messages != 0)
+		{
+			_moveMessage(c2, c2->messages->begin(), c1, true);
+		}
 
 		// Reshuffle the parent (it has one less object/child)
+		parent->copyRecords(objNo, parent, objNo + 1, parent->objCount - objNo - 1);
 		for (ctr = objNo + 1; ctr < parent->objCount; ctr++)
 		{
-			parent->objects[ctr - 1] = parent->objects[ctr];
-			parent->children[ctr] = parent->children[ctr + 1];
-			parent->children[ctr]->childNo = ctr;
+			parent->moveChild(ctr, parent, ctr + 1);
 		}
-		--parent->objCount;
-		parent->objects.resize(parent->objCount);
-		parent->children.resize(parent->objCount + 1);
+		parent->setCount(parent->objCount - 1);
 
 		// Write the two affected nodes to the disk. Note that
 		// c2 just goes away. The node will be deallocated because
 		// of the smart pointers, and the node's location on
 		// disk will become inaccessible. This will have to be
 		// fixed by the judicious use of the compact() method.
-		c1->write(_dataFile);
-		parent->write(_dataFile);
+		// If there is a hash index, the page is emptied first, so that
+		// the index can't find the records that were in it. If that
+		// leaves it waiting for the flusher, it stays loaded until then.
+		// A copy-on-write file just lets go of the page. With optimistic
+		// reads, a get may still be in c2, so it is retired instead.
+		c2->children.clear();
+		if (_copyOnWrite)
+		{
+			_freePage(c2->fpos);
+		}
+		else if ((HashIndex*)_hashIndex != 0)
+		{
+			c2->setCount(0);
+			_write(c2);
+		}
+		if (_optimistic)
+		{
+			_retire(c2);
+		}
+		else if (_dirty.find(c2->fpos) == _dirty.end())
+		{
+			c2->unload();
+		}
+		_recount(parent);
+		_write(c1);
+		_write(parent);
+		_indexRecords(c1, c1Count, c2Count + 1);
 
 		// Return a pointer to the new child.
 		return c1;
 	}
 
-	// Insert a new key into the btree. If the root has
-	// (2t - 1) keys, the tree is full, and should therefore
-	// grow. Otherwise, we're inserting into a node that
-	// is not full.
-	void BTreeDB::_insert(const DbObjPtr& key)
+	// Insert a new key into the btree. If the root is
+	// full, the tree should grow. Otherwise, we're inserting
+	// into a node that is not full.
+	void BTreeDB::_insert(const DbObjPtr& key, unsigned short flags)
 	{
-		if (_root->objCount == (_minDegree * 2) - 1)
+		if (_root->isFull())
 		{
 			// Growing the tree happens by creating a new
 			// node as the new root, and splitting the
@@ -241,67 +327,47 @@ namespace Database
 			oldRoot->childNo = 0;
 			oldRoot->parent = _root;
 			_split(_root, 0, oldRoot);
-			_insertNonFull(_root, key);
-			fseek(_dataFile, 0, SEEK_SET);
-			fwrite(&_root->fpos, sizeof(_root->fpos), 1, _dataFile);
+			_insertNonFull(_root, key, flags);
+			_writeRoot();
 		}
 		else
 		{
-			_insertNonFull(_root, key);
+			_insertNonFull(_root, key, flags);
 		}
 	}
 
 	// Insert a key into a non-full node.
-	void BTreeDB::_insertNonFull(TreeNodePtr& node, const DbObjPtr& key)
+	void BTreeDB::_insertNonFull(TreeNodePtr& node, const DbObjPtr& key, unsigned short flags)
 	{
-		size_t ctr = node->objCount;
+		const void* keyData = key->getData();
+		size_t keySize = _layout.probeSize(key);
+		int compVal = 0;
+		size_t ctr = node->lowerBound(keyData, keySize, _compFunc, compVal);
 
 		// If the node is a leaf, we just find the location to insert
 		// the new item, and shuffle everything else up.
 		if (node->isLeaf)
 		{
+			_latch(node);
 			node->setCount(node->objCount + 1);
-			for ( ; ctr > 0; ctr--)
-			{
-				DbObjPtr compObj = node->objects[ctr - 1];
-				int compVal = _compFunc(key, compObj);
-				if (compVal < 0)
-				{
-					node->objects[ctr] = node->objects[ctr - 1];
-				}
-				else
-				{
-					break;
-				}
-			}
-			node->objects[ctr] = key;
-			node->write(_dataFile);
+			node->copyRecords(ctr + 1, node, ctr, node->objCount - ctr - 1);
+			node->setRecord(ctr, key, flags);
+			_write(node);
+			_indexRecords(node, ctr, 1);
 		}
 
 		// If the node is an internal node, we need to find
 		// the location to insert the value ...
 		else
 		{
-			while (ctr > 0)
-			{
-				--ctr;
-				int compVal = _compFunc(key, node->objects[ctr]);
-				if (compVal >= 0)
-				{
-					++ctr;
-					break;
-				}
-			}
-
 			// Load the child into which the value will be inserted.
-			TreeNodePtr child = node->loadChild(ctr, _dataFile, _recSize);
+			TreeNodePtr child = node->loadChild(ctr, _store);
 
-			// If the child node is full (2t - 1 objects), then we need
-			// to split the node.
-			if (child->objCount == _minDegree * 2 - 1)
+			// If the child node is full, then we need to split the node.
+			if (child->isFull())
 			{
 				_split(node, ctr, child);
-				int compVal = _compFunc(key, node->objects[ctr]);
+				compVal = node->compareKey(ctr, keyData, keySize, _compFunc);
 				if (compVal > 0)
 				{
 					++ctr;
@@ -311,7 +377,11 @@ namespace Database
 
 			// Insert the key (recursively) into the non-full child
 			// node.
-			_insertNonFull(child, key);
+			_insertNonFull(child, key, flags);
+			if (_recount(node))
+			{
+				_write(node);
+			}
 		}
 	}
 
@@ -324,48 +394,49 @@ namespace Database
 		{
 			if (!node->isLeaf)
 			{
-				TreeNodePtr child = node->loadChild(ctr, _dataFile, _recSize);
+				TreeNodePtr child = node->loadChild(ctr, _store);
 				_traverse(child, ref, cbfn, depth + 1);
 			}
-			shouldContinue = cbfn ? cbfn(node->objects[ctr], ref, depth) : true;
+			shouldContinue = cbfn ? cbfn(_getRecord(node, ctr), ref, depth) : true;
 		}
 		if (shouldContinue && !node->isLeaf)
 		{
-			TreeNodePtr child = node->loadChild(ctr, _dataFile, _recSize);
+			TreeNodePtr child = node->loadChild(ctr, _store);
 			_traverse(child, ref, cbfn, depth + 1);
 		}
 	}
 
-	// Write all nodes in the tree to the file given.
-	bool BTreeDB::_flush(TreeNodePtr& node, FILE* f)
+	// Write all nodes in the tree to the page store given.
+	bool BTreeDB::_flush(TreeNodePtr& node, PageStore* store)
 	{
 		bool ret = false;
 
-		// Bug out if the file is not valid
-		if (!f)
+		// Bug out if the store is not valid
+		if (!store)
 		{
 			return false;
 		}
 
-		// If the node isn't loaded ignore it, but
-		// return true because it's unchanged.
-		if (!node->loaded)
+		// If the node isn't loaded (or has never been visited)
+		// ignore it, but return true because it's unchanged.
+		if ((TreeNode*)node == 0 || !node->loaded)
 		{
 			ret = true;
 		}
 		else
 		{
 			// Write the given node to disk ...
-			ret = node->write(f);
+			ret = node->write(store);
 
 			// ... and if it has children, make
 			// sure they're written too.
 			if (ret && !node->isLeaf)
 			{
-				TREENODEVECTOR::iterator tnvit = node->children.begin();
+				CHILDREFVECTOR::iterator tnvit = node->children.begin();
 				while (ret && tnvit != node->children.end())
 				{
-					ret = _flush((*tnvit), f);
+					TreeNodePtr child = tnvit->node();
+					ret = _flush(child, store);
 					++tnvit;
 				}
 			}
@@ -390,37 +461,72 @@ namespace Database
 		{
 			if (op.second == ECP_INTHIS)	// we've got an exact match
 			{
-				// Case 1: deletion from leaf node.
+				// Case 1: deletion from leaf node. With lazy deletes,
+				// a leaf that wasn't topped up on the way down is
+				// remembered, to be topped up later.
 				if (node->isLeaf)
 				{
+					_latch(node);
+					bool wasShort = (_lazyPending != 0 && node != _root && !node->isSafe());
 					node->delFromLeaf(op.first);
+					if (wasShort)
+					{
+						_shortLeaves[node->fpos] = node->getRecord(0);
+					}
+					_write(node);
 					ret = true;
 				}
 
 				// Case 2: Exact match on internal leaf.
 				else
 				{
+					TreeNodePtr leftChild = node->loadChild(op.first, _store);
+					TreeNodePtr rightChild = node->loadChild(op.first + 1, _store);
+
+					// Every node we go down into must have room to take
+					// a record from below it, so a full child is split
+					// first, and then we start again from this node.
+					bool leftSafe = _canDelete(leftChild);
+					if (leftSafe && leftChild->isFull())
+					{
+						_split(node, op.first, leftChild);
+						return _delete(node, key);
+					}
+					if (!leftSafe && rightChild->isFull())
+					{
+						_split(node, op.first + 1, rightChild);
+						return _delete(node, key);
+					}
+
 					// Case 2a: prior child has enough objects to pull one out.
-					if (node->children[op.first]->objCount >= _minDegree)
+					if (leftSafe)
 					{
-						TreeNodePtr childNode = node->loadChild(op.first, _dataFile, _recSize);
-						NodeKeyLocn locn = _findPred(childNode);
-						DbObjPtr childObj = locn.first->objects[locn.second];
-						ret = _delete(childNode, childObj);
-						node->objects[op.first] = childObj;
+						NodeKeyLocn locn = _findPred(leftChild);
+						DbObjPtr childObj = locn.first->getRecord(locn.second);
+						unsigned short flags = locn.first->slot(locn.second)->flags;
+						ret = _delete(leftChild, childObj);
+						_latch(node);
+						node->setRecord(op.first, childObj, flags);
+						_liftMessages(node, op.first, op.first);
+						_write(node);
+						_indexRecords(node, op.first, 1);
 					}
 
 					// Case 2b: successor child has enough objects to pull one out.
-					else if (node->children[op.first + 1]->objCount >= _minDegree)
+					else if (_canDelete(rightChild))
 					{
-						TreeNodePtr childNode = node->loadChild(op.first + 1, _dataFile, _recSize);
-						NodeKeyLocn locn = _findSucc(childNode);
-						DbObjPtr childObj = locn.first->objects[locn.second];
-						ret = _delete(childNode, childObj);
-						node->objects[op.first] = childObj;
+						NodeKeyLocn locn = _findSucc(rightChild);
+						DbObjPtr childObj = locn.first->getRecord(locn.second);
+						unsigned short flags = locn.first->slot(locn.second)->flags;
+						ret = _delete(rightChild, childObj);
+						_latch(node);
+						node->setRecord(op.first, childObj, flags);
+						_liftMessages(node, op.first, op.first + 1);
+						_write(node);
+						_indexRecords(node, op.first, 1);
 					}
 
-					// Case 2c: both children have only t-1 objects.
+					// Case 2c: neither child has enough objects.
 					// Merge the two children, putting the key into the
 					// new child. Then delete from the new child.
 					else
@@ -439,100 +545,43 @@ namespace Database
 				// has enough objects. If so, we just recurse into
 				// that child.
 				size_t keyChildPos = (op.second == ECP_INLEFT) ? op.first : op.first + 1;
-				TreeNodePtr childNode = node->loadChild(keyChildPos, _dataFile, _recSize);
-				if (childNode->objCount >= _minDegree)
+				TreeNodePtr childNode = node->loadChild(keyChildPos, _store);
+				if (childNode->isFull())
+				{
+					_split(node, keyChildPos, childNode);
+					ret = _delete(node, key);
+				}
+				else if (_canDelete(childNode))
 				{
 					ret = _delete(childNode, key);
 				}
 				else
 				{
 					// Find out if the childNode has an immediate
-					// sibling with _minDegree keys.
+					// sibling that can spare a record.
 					TreeNodePtr leftSib;
 					TreeNodePtr rightSib;
-					size_t leftCount = 0;
-					size_t rightCount = 0;
+					bool leftLends = false;
+					bool rightLends = false;
 					if (keyChildPos > 0)
 					{
-						leftSib = node->loadChild(keyChildPos - 1, _dataFile, _recSize);
-						leftCount = leftSib->objCount;
+						leftSib = node->loadChild(keyChildPos - 1, _store);
+						leftLends = leftSib->canLend();
 					}
 					if (keyChildPos < node->objCount)
 					{
-						rightSib = node->loadChild(keyChildPos + 1, _dataFile, _recSize);
-						rightCount = rightSib->objCount;
+						rightSib = node->loadChild(keyChildPos + 1, _store);
+						rightLends = rightSib->canLend();
 					}
 
-					// Case 3a: There is a sibling with _minDegree or more keys.
-					if (leftCount >= _minDegree || rightCount >= _minDegree)
+					// Case 3a: There is a sibling that can spare a record.
+					if (leftLends || rightLends)
 					{
-						// Part of this process is making sure that the
-						// child node has minDegree objects.
-						childNode->setCount(_minDegree);
-
-						// Bringing the new key from the left sibling
-						if (leftCount >= _minDegree)
-						{
-							// Shuffle the keys and objects up
-							size_t ctr = _minDegree - 1;
-							for ( ; ctr > 0; ctr--)
-							{
-								childNode->objects[ctr] = childNode->objects[ctr - 1];
-								childNode->children[ctr + 1] = childNode->children[ctr];
-								childNode->childNo = ctr + 1; // Thanks steradrian
-							}
-							childNode->children[ctr + 1] = childNode->children[ctr];
-
-							// Put the key from the parent into the empty space,
-							// pull the replacement key from the sibling, and
-							// move the appropriate child from the sibling to
-							// the target child.
-							childNode->objects[0] = node->objects[keyChildPos - 1];
-							node->objects[keyChildPos - 1] = leftSib->objects[leftSib->objCount - 1];
-							leftSib->objects.resize(leftSib->objCount - 1);
-							if (!leftSib->isLeaf)
-							{
-								childNode->children[0] = leftSib->children[leftSib->objCount];
-								leftSib->children.resize(leftSib->objCount);
-							}
-							--leftSib->objCount;
-						}
-
-						// Bringing a new key in from the right sibling
-						else
-						{
-							// Put the key from the parent into the child,
-							// put the key from the sibling into the parent,
-							// and move the appropriate child from the
-							// sibling to the target child node.
-							childNode->objects[childNode->objCount - 1] = node->objects[op.first];
-							node->objects[op.first] = rightSib->objects[0];
-							if (!rightSib->isLeaf)
-							{
-								childNode->children[childNode->objCount] = rightSib->children[0];
-							}
-
-							// Now clean up the right node, shuffling keys
-							// and objects to the left and resizing.
-							size_t ctr = 0;
-							for ( ; ctr < rightSib->objCount - 1; ctr++)
-							{
-								rightSib->objects[ctr] = rightSib->objects[ctr + 1];
-								if (!rightSib->isLeaf)
-								{
-									rightSib->children[ctr] = rightSib->children[ctr + 1];
-								}
-							}
-							if (!rightSib->isLeaf)
-							{
-								rightSib->children[ctr] = rightSib->children[ctr + 1];
-							}
-							rightSib->setCount(rightSib->objCount - 1);
-						}
+						_lend(node, keyChildPos, leftLends);
 						ret = _delete(childNode, key);
 					}
 
-					// Case 3b: All siblings have _minDegree - 1 keys
+					// Case 3b: No sibling can spare a record
 					else
 					{
 						TreeNodePtr mergedChild = _merge(node, op.first);
@@ -541,9 +590,98 @@ namespace Database
 				}
 			}
 		}
+
+		// Whichever children were changed on the way down, the counts
+		// of the records under them are brought up to date on the way
+		// back up.
+		if (_recount(node))
+		{
+			_write(node);
+		}
 		return ret;
 	}
 
+	// A child that isn't safe takes a record from a sibling that can
+	// spare one: the parent's record between them comes down into the
+	// child, and the sibling's nearest record goes up in its place,
+	// bringing the sibling's nearest child over with it.
+	void BTreeDB::_lend(TreeNodePtr& node, size_t childNo, bool fromLeft)
+	{
+		TreeNodePtr childNode = node->loadChild(childNo, _store);
+		TreeNodePtr sibling = node->loadChild(fromLeft ? childNo - 1 : childNo + 1, _store);
+
+		// Part of this process is making sure that the
+		// child node has one more object.
+		size_t childCount = childNode->objCount;
+		_latch(node);
+		_latch(childNode);
+		_latch(sibling);
+		childNode->setCount(childCount + 1);
+
+		// Bringing the new key from the left sibling
+		if (fromLeft)
+		{
+			// Shuffle the keys and objects up
+			childNode->copyRecords(1, childNode, 0, childCount);
+			if (!childNode->isLeaf)
+			{
+				for (size_t ctr = childCount + 1; ctr > 0; ctr--)
+				{
+					childNode->moveChild(ctr, childNode, ctr - 1); // Thanks steradrian
+				}
+			}
+
+			// Put the key from the parent into the empty space,
+			// pull the replacement key from the sibling, and
+			// move the appropriate child from the sibling to
+			// the target child.
+			childNode->copyRecord(0, node, childNo - 1);
+			node->copyRecord(childNo - 1, sibling, sibling->objCount - 1);
+			if (!sibling->isLeaf)
+			{
+				childNode->moveChild(0, sibling, sibling->objCount);
+			}
+			sibling->setCount(sibling->objCount - 1);
+			_lendMessages(node, childNo - 1, sibling, childNode, true);
+			_write(sibling);
+			_indexRecords(childNode, 0, 1);
+			_indexRecords(node, childNo - 1, 1);
+		}
+
+		// Bringing a new key in from the right sibling
+		else
+		{
+			// Put the key from the parent into the child,
+			// put the key from the sibling into the parent,
+			// and move the appropriate child from the
+			// sibling to the target child node.
+			childNode->copyRecord(childCount, node, childNo);
+			node->copyRecord(childNo, sibling, 0);
+			if (!sibling->isLeaf)
+			{
+				childNode->moveChild(childCount + 1, sibling, 0);
+			}
+
+			// Now clean up the right node, shuffling keys
+			// and objects to the left and resizing.
+			sibling->copyRecords(0, sibling, 1, sibling->objCount - 1);
+			if (!sibling->isLeaf)
+			{
+				for (size_t ctr = 0; ctr < sibling->objCount; ctr++)
+				{
+					sibling->moveChild(ctr, sibling, ctr + 1);
+				}
+			}
+			sibling->setCount(sibling->objCount - 1);
+			_lendMessages(node, childNo, sibling, childNode, false);
+			_write(sibling);
+			_indexRecords(childNode, childCount, 1);
+			_indexRecords(node, childNo, 1);
+		}
+		_write(childNode);
+		_write(node);
+	}
+
 	// Finds the location of the predecessor of this key, given
 	// the root of the subtree to search. The predecessor is going
 	// to be the right-most object in the right-most leaf node.
@@ -553,7 +691,7 @@ namespace Database
 		TreeNodePtr child = node;
 		while (!child->isLeaf)
 		{
-			child = child->loadChild(child->objCount, _dataFile, _recSize);
+			child = child->loadChild(child->objCount, _store);
 		}
 		ret.first = child;
 		ret.second = child->objCount - 1;
@@ -569,18 +707,324 @@ namespace Database
 		TreeNodePtr child = node;
 		while (!child->isLeaf)
 		{
-			child = child->loadChild(0, _dataFile, _recSize);
+			child = child->loadChild(0, _store);
 		}
 		ret.first = child;
 		ret.second = 0;
 		return ret;
 	}
 
+	// Build a record to hand back to the caller, fetching the
+	// payload from the value log if it was put there.
+	DbObjPtr BTreeDB::_getRecord(const TreeNodePtr& node, size_t objNo)
+	{
+		if (!(node->slot(objNo)->flags & ESF_VALUEPTR) || (ValueLog*)_valueLog == 0)
+		{
+			return node->getRecord(objNo);
+		}
+		SValuePtr vp;
+		std::vector<byte> key(node->keySize(objNo) + 1);
+		std::vector<byte> value;
+		memcpy(&vp, node->value(objNo), sizeof(vp));
+		node->getKey(objNo, &key[0]);
+		_valueLog->read(vp, value);
+		return new DbObj(&key[0], node->keySize(objNo), value.empty() ? 0 : &value[0], value.size());
+	}
+
+	// Tell the value log that a record's payload is no longer used.
+	void BTreeDB::_releaseValue(const TreeNodePtr& node, size_t objNo)
+	{
+		if (node->slot(objNo)->flags & ESF_VALUEPTR)
+		{
+			SValuePtr vp;
+			memcpy(&vp, node->value(objNo), sizeof(vp));
+			_valueLog->release(vp);
+		}
+	}
+
+	// Copy the payloads that the records in a subtree use into the new
+	// log, pointing the records at their new homes as we go.
+	bool BTreeDB::_collect(TreeNodePtr& node, ValueLogPtr& newLog)
+	{
+		bool ret = true;
+		bool changed = false;
+		std::vector<byte> value;
+		for (size_t ctr = 0; ret && ctr < node->objCount; ctr++)
+		{
+			if (node->slot(ctr)->flags & ESF_VALUEPTR)
+			{
+				SValuePtr vp;
+				memcpy(&vp, node->value(ctr), sizeof(vp));
+				ret = _valueLog->read(vp, value) && newLog->append(value.empty() ? 0 : &value[0], value.size(), vp);
+				_latch(node);
+				memcpy(node->value(ctr), &vp, sizeof(vp));
+				changed = true;
+			}
+		}
+		if (ret && changed)
+		{
+			ret = _write(node);
+		}
+		for (size_t ctr = 0; ret && !node->isLeaf && ctr <= node->objCount; ctr++)
+		{
+			TreeNodePtr child = node->loadChild(ctr, _store);
+			ret = _collect(child, newLog);
+		}
+		return ret;
+	}
+
+	// Garbage collect the value log. The payloads still in use are
+	// copied to a new log of the next generation, which goes all the way
+	// to the disk before the tree that points into it is flushed (or
+	// committed) along with the new generation. Only then is the new log
+	// moved over the old one, in one step; if a crash comes first,
+	// open() either finishes the move or throws the new log away,
+	// going by the generation the tree on the disk has.
+	// Not while there are snapshots open, as they may still read the
+	// payloads that the tree no longer uses. Messages go down first:
+	// the puts among them would otherwise add their payloads to the
+	// old log after the copy, when the flush below sends them down.
+	bool BTreeDB::collectValues()
+	{
+		SChangeGuard guard(this);
+		if ((ValueLog*)_valueLog == 0)
+		{
+			return true;
+		}
+		_drainMessages();
+		{
+			std::lock_guard<std::mutex> snapshotGuard(_snapshotLock);
+			if (!_snapshots.empty())
+			{
+				return false;
+			}
+		}
+		std::string logName = _valueLog->getFileName();
+		std::string newName = logName + ".new";
+		ValueLogPtr newLog = new ValueLog(newName);
+		if (!newLog->open(true, _valueGen + 1))
+		{
+			return false;
+		}
+		bool ret = _collect(_root, newLog) && newLog->sync();
+		if (ret)
+		{
+			// A commit has to be made even if no record moved, so that
+			// the new generation is in a commit slot.
+			_valueGen = newLog->getGeneration();
+			_rootMoved = _rootMoved || _copyOnWrite;
+			ret = (_copyOnWrite || _store->writeAt((long)offsetof(SFileHeader, valueGen), &_valueGen, sizeof(_valueGen))) && flush();
+		}
+		if (ret)
+		{
+			_valueLog->close();
+			newLog->close();
+			ret = (0 != MoveFileExA(newName.c_str(), logName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+			_retire(_valueLog);
+			_valueLog = new ValueLog(logName);
+			ret = _valueLog->open(false) && ret;
+		}
+		return ret;
+	}
+
+	// Open the value log that the tree points into. A collect that a
+	// crash cut short leaves a new log next to it: if the tree on the
+	// disk already points into the new log, it is moved into place now,
+	// and otherwise it is thrown away.
+	bool BTreeDB::_openValueLog()
+	{
+		std::string logName = _fileName + ".vlog";
+		std::string newName = logName + ".new";
+		ValueLogPtr newLog = new ValueLog(newName);
+		if (newLog->open(false))
+		{
+			bool finished = (newLog->getGeneration() == _valueGen);
+			newLog->close();
+			if (finished && !MoveFileExA(newName.c_str(), logName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+			{
+				return false;
+			}
+		}
+		newLog = (ValueLog*)0;
+		remove(newName.c_str());
+		_valueLog = new ValueLog(logName);
+		return _valueLog->open(false) && _valueLog->getGeneration() == _valueGen;
+	}
+
+	// Whether the value log is worth collecting now.
+	bool BTreeDB::_collectDue()
+	{
+		if ((ValueLog*)_valueLog == 0 || !_valueLog->needsCollect())
+		{
+			return false;
+		}
+		std::lock_guard<std::mutex> snapshotGuard(_snapshotLock);
+		return _snapshots.empty();
+	}
+
+	// Add the keys of every record in a subtree, and of the puts in
+	// its buffers, to the Bloom filter.
+	void BTreeDB::_addKeys(TreeNodePtr& node)
+	{
+		std::vector<byte> key;
+		for (size_t ctr = 0; ctr < node->objCount; ctr++)
+		{
+			key.resize(node->keySize(ctr) + 1);
+			node->getKey(ctr, &key[0]);
+			_bloom->add(&key[0], node->keySize(ctr));
+		}
+		if (node->messages != 0)
+		{
+			for (MESSAGEMAP::iterator it = node->messages->begin(); it != node->messages->end(); ++it)
+			{
+				if ((DbObj*)it->second != 0)
+				{
+					_bloom->add(it->first.data(), it->first.size());
+				}
+			}
+		}
+		for (size_t ctr = 0; !node->isLeaf && ctr <= node->objCount; ctr++)
+		{
+			TreeNodePtr child = node->loadChild(ctr, _store);
+			_addKeys(child);
+		}
+	}
+
+	// Build the Bloom filter again from the keys in the tree, with
+	// room for the tree to double in size.
+	void BTreeDB::_rebuildFilter()
+	{
+		size_t capacity = _bloom->getLiveCount() * 2;
+		_bloom->init((capacity > _bloomKeys) ? capacity : _bloomKeys);
+		_addKeys(_root);
+	}
+
+	// Set the record counts a node keeps for its children from those
+	// children that are loaded (only they can have changed). Says
+	// whether any count changed, and so whether the node needs writing.
+	bool BTreeDB::_recount(TreeNodePtr& node)
+	{
+		bool ret = false;
+		if (!_layout.counted || node->isLeaf)
+		{
+			return ret;
+		}
+		for (size_t ctr = 0; ctr <= node->objCount && ctr < node->children.size(); ctr++)
+		{
+			TreeNodePtr child = node->children[ctr].node();
+			if ((TreeNode*)child != 0 && child->loaded)
+			{
+				long count = (long)child->subtreeCount();
+				if (node->childCounts()[ctr] != count)
+				{
+					node->childCounts()[ctr] = count;
+					ret = true;
+				}
+			}
+		}
+		return ret;
+	}
+
+	// Tell the hash index that some records of a node are in its page.
+	void BTreeDB::_indexRecords(const TreeNodePtr& node, size_t objNo, size_t count)
+	{
+		if ((HashIndex*)_hashIndex == 0)
+		{
+			return;
+		}
+		std::vector<byte> key;
+		for (size_t ctr = objNo; ctr < objNo + count; ctr++)
+		{
+			key.resize(node->keySize(ctr) + 1);
+			node->getKey(ctr, &key[0]);
+			_hashIndex->set(&key[0], node->keySize(ctr), node->fpos);
+		}
+	}
+
+	// Put every record in a subtree into the hash index.
+	void BTreeDB::_indexSubtree(TreeNodePtr& node)
+	{
+		_indexRecords(node, 0, node->objCount);
+		for (size_t ctr = 0; !node->isLeaf && ctr <= node->objCount; ctr++)
+		{
+			TreeNodePtr child = node->loadChild(ctr, _store);
+			_indexSubtree(child);
+		}
+	}
+
+	// Look a key up through the hash index. The page the index gives
+	// is read on its own, outside the tree, and only if the key is in it
+	// is the record returned.
+	bool BTreeDB::_getIndexed(const DbObjPtr& key, DbObjPtr& rec)
+	{
+		long pageId = _hashIndex->find(key->getData(), _layout.probeSize(key));
+		if (pageId == -1)
+		{
+			return false;
+		}
+
+		// A page that the background flusher hasn't written yet is
+		// newer in memory than on the disk.
+		TreeNodePtr node;
+		DIRTYMAP::iterator dit = _dirty.find(pageId);
+		if (dit != _dirty.end())
+		{
+			node = dit->second.node;
+		}
+		else
+		{
+			node = new TreeNode(&_layout);
+			node->fpos = pageId;
+			std::unique_lock<std::mutex> inFlightGuard(_inFlightLock);
+			std::map<long, std::vector<byte> >::iterator fit = _inFlight.find(pageId);
+			bool read = false;
+			if (fit != _inFlight.end())
+			{
+				read = node->read(fit->second);
+			}
+			else
+			{
+				inFlightGuard.unlock();
+				read = node->read(_store);
+			}
+			if (!read)
+			{
+				return false;
+			}
+		}
+		OBJECTPOS op = node->findPos(key, _compFunc);
+		if (op.second != ECP_INTHIS)
+		{
+			return false;
+		}
+		rec = _getRecord(node, op.first);
+		return true;
+	}
+
 	void BTreeDB::close()
 	{
+		// The flusher is stopped first, as it may be waiting for the
+		// tree, and then whatever it hadn't got to is written.
+		_stopFlusher();
+		SChangeGuard guard(this);
 		//flush();
-		fflush(_dataFile);
+		_drainMessages();
+		_writeBack(true, false);
+		_store->flush();
 		fclose( _dataFile);
+		_dataFile = 0;
+		if ((ValueLog*)_valueLog != 0)
+		{
+			_valueLog->close();
+		}
+		if ((BloomFilter*)_bloom != 0)
+		{
+			_bloom->save(_txnId);
+		}
+		if ((HashIndex*)_hashIndex != 0)
+		{
+			_hashIndex->save(_txnId);
+		}
 	}
 
 	// Opening the database means that we check the file
@@ -589,6 +1033,8 @@ namespace Database
 	// memory.
 	bool BTreeDB::open()
 	{
+		TREEGUARD guard(_treeLock);
+
 		// We're creating if the file doesn't exist.
 		SFileHeader sfh;
 		bool creating = (0 != _access(_fileName.c_str(), 06));
@@ -613,14 +1059,26 @@ namespace Database
 			{
 				return false;
 			}
+			_compressPages = _compressPages && !_copyOnWrite;
 			sfh.keySize = _keySize;
 			sfh.recSize = _recSize;
 			sfh.minDegree = _minDegree;
+			sfh.pageSize = NodeLayout::pageSizeFor(_recSize, _minDegree, _countRecords);
+			sfh.valueThreshold = _valueThreshold;
+			sfh.compressed = _compressPages ? 1 : 0;
+			sfh.bloomKeys = _bloomKeys;
+			sfh.hashIndex = _useHashIndex ? 1 : 0;
+			sfh.counted = _countRecords ? 1 : 0;
+			sfh.shadowed = _copyOnWrite ? 1 : 0;
+			sfh.valueGen = 0;
 			sfh.rootPos = sizeof(sfh);
-			_nodeSize = sizeof(size_t);						// object count
-			_nodeSize += (_minDegree * 2 - 1) * _recSize;	// records
-			_nodeSize += _minDegree * 2 * sizeof(long);		// child locations
-			_nodeSize += sizeof(byte);						// is leaf?
+			if (sfh.pageSize == 0)
+			{
+				return false;
+			}
+			_layout.init(_recSize, _keySize, sfh.pageSize, _countRecords);
+			_layout.prefixCompare = (_compFunc == _defaultCompare) ? _compFunc : 0;
+			_nodeSize = _layout.pageSize;
 
 			// when creating, write the node to the disk.
 			// remember that the first four bytes contain
@@ -629,15 +1087,52 @@ namespace Database
 			{
 				return false;
 			}
+			if (_copyOnWrite)
+			{
+				SCommitSlot slots[2];
+				memset(slots, 0, sizeof(slots));
+				if (1 != fwrite(slots, sizeof(slots), 1, _dataFile))
+				{
+					return false;
+				}
+			}
 			fflush(_dataFile);
+			_store = new PageStore(_dataFile, _fileName, _layout.pageSize, _compressPages);
+			_store->open(true);
 
 			// If creating, allocate a node instead of
-			// reading one.
+			// reading one. The root only has an offset
+			// of sizeof(sfh) if pages aren't compressed.
 			_root = _allocateNode();
 			_root->isLeaf = true;
-			_root->loaded = true;
-			_root->write(_dataFile);
-			ret = true;
+			_root->write(_store);
+			fseek(_dataFile, 0, SEEK_SET);
+			fwrite(&_root->fpos, sizeof(_root->fpos), 1, _dataFile);
+			if (_copyOnWrite)
+			{
+				_rootMoved = true;
+				ret = commit();
+			}
+			else
+			{
+				ret = _store->flush();
+			}
+
+			// Large payloads go in a log of their own.
+			if (_valueThreshold != 0)
+			{
+				_valueLog = new ValueLog(_fileName + ".vlog");
+				ret = _valueLog->open(true);
+			}
+			if (_bloomKeys != 0)
+			{
+				_bloom = new BloomFilter(_fileName + ".bloom");
+				_bloom->init(_bloomKeys);
+			}
+			if (_useHashIndex)
+			{
+				_hashIndex = new HashIndex(_fileName + ".hidx");
+			}
 		}
 		else
 		{
@@ -652,101 +1147,1230 @@ namespace Database
 				_keySize = sfh.keySize;
 				_recSize = sfh.recSize;
 				_minDegree = sfh.minDegree;
-				_nodeSize = sizeof(size_t);						// object count
-				_nodeSize += (_minDegree * 2 - 1) * _recSize;	// records
-				_nodeSize += _minDegree * 2 * sizeof(long);		// child locations
-				_nodeSize += sizeof(byte);						// is leaf?
+				_valueThreshold = sfh.valueThreshold;
+				_compressPages = (sfh.compressed != 0);
+				_bloomKeys = sfh.bloomKeys;
+				_useHashIndex = (sfh.hashIndex != 0);
+				_countRecords = (sfh.counted != 0);
+				_copyOnWrite = (sfh.shadowed != 0);
+				_valueGen = sfh.valueGen;
+				_layout.init(_recSize, _keySize, sfh.pageSize, _countRecords);
+				_layout.prefixCompare = (_compFunc == _defaultCompare) ? _compFunc : 0;
+				_nodeSize = _layout.pageSize;
 			}
 
 			// If note creating, just create and read
 			// rather than allocating.
-			_root = new TreeNode;
+			_store = new PageStore(_dataFile, _fileName, _layout.pageSize, _compressPages);
+			if (!_store->open(false))
+			{
+				return false;
+			}
+			if (_copyOnWrite && !_loadCommit(sfh.rootPos))
+			{
+				return false;
+			}
+			_root = new TreeNode(&_layout);
 			_root->fpos = sfh.rootPos;
-			_root->read(_dataFile, _recSize);
-			ret = true;
-		}
-		return ret;
+			ret = _root->read(_store);
+			if (_valueThreshold != 0)
+			{
+				ret = _openValueLog() && ret;
+			}
+
+			// If the filter file has gone, or was saved at another
+			// commit (a crash came after a later one), build it again.
+			if (_bloomKeys != 0)
+			{
+				_bloom = new BloomFilter(_fileName + ".bloom");
+				if (!_bloom->load(_txnId))
+				{
+					_rebuildFilter();
+				}
+			}
+			if (_useHashIndex)
+			{
+				_hashIndex = new HashIndex(_fileName + ".hidx");
+				if (!_hashIndex->load(_txnId))
+				{
+					_indexSubtree(_root);
+				}
+			}
+		}
+		// Message buffers are keyed by the bytes of the keys, so they
+		// need the default comparator, and gets need the lock to look
+		// in them.
+		if (_layout.prefixCompare == 0)
+		{
+			_bufferSize = 0;
+		}
+		_optimistic = _optimistic && _bufferSize == 0;
+		_rootNode = _root;
+		if (ret && _dirtyPercent != 0)
+		{
+			_stopping = false;
+			_flusher = std::thread(&BTreeDB::_flushLoop, this);
+		}
+		return ret;
 	}
 
-	// This is the external delete function.
+	// This is the external delete function. With message buffers,
+	// the del is only left in the root's buffer. The value log is
+	// collected once the tree is done changing.
 	bool BTreeDB::del(const DbObjPtr& key)
+	{
+		SChangeGuard guard(this);
+		bool ret = true;
+		if (_bufferSize == 0)
+		{
+			ret = _del(key);
+		}
+		else
+		{
+			size_t keySize = _layout.probeSize(key);
+			if ((RecordCache*)_cache != 0)
+			{
+				_cache->erase(key->getData(), keySize);
+			}
+			_addMessage(_root, std::string((const char*)key->getData(), keySize), DbObjPtr(), true);
+			if (_root->messageBytes > _bufferSize)
+			{
+				_flushMessages(_root);
+				ret = _writeBatch();
+			}
+		}
+		if (_rebalanceDue())
+		{
+			ret = rebalance() && ret;
+		}
+		if (_collectDue())
+		{
+			ret = collectValues() && ret;
+		}
+		return ret;
+	}
+
+	// Delete a key from the tree itself.
+	bool BTreeDB::_del(const DbObjPtr& key)
 	{
 		// Determine if the root node is empty.
 		bool ret = (_root->objCount != 0);
 
+		// The record's payload in the value log becomes garbage.
+		if (ret && (ValueLog*)_valueLog != 0)
+		{
+			NodeKeyLocn locn = _search(_root, key);
+			if ((TreeNode*)locn.first != 0 && locn.second != (size_t)-1)
+			{
+				_releaseValue(locn.first, locn.second);
+			}
+		}
+
 		// If our root is not empty, call the internal
 		// delete method on it.
 		ret = ret && _delete(_root, key);
+		if (ret && (BloomFilter*)_bloom != 0)
+		{
+			_bloom->noteDelete();
+		}
+		if (ret && (HashIndex*)_hashIndex != 0)
+		{
+			_hashIndex->remove(key->getData(), _layout.probeSize(key));
+		}
+		if ((RecordCache*)_cache != 0)
+		{
+			_cache->erase(key->getData(), _layout.probeSize(key));
+		}
 
-		// If we successfully deleted the key, and there
-		// is nothing left in the root node and the root
-		// node is not a leaf, we need to shrink the tree
-		// by making the root's child (there should only
-		// be one) the new root. Write the location of
-		// the new root to the start of the file so we
-		// know where to look.
-		if (ret && _root->objCount == 0 && !_root->isLeaf)
+		// If there is nothing left in the root node and the root
+		// node is not a leaf, we need to shrink the tree. A merge
+		// on the way down can empty the root even if the key wasn't
+		// found. With buffers, this can happen while messages are
+		// going down, so the flush (which would send them all down)
+		// waits for the next flush(), as it does during a MemTable's
+		// merge.
+		if (_root->objCount == 0 && !_root->isLeaf)
 		{
-			_root = _root->children[0];
-			fseek(_dataFile, 0, SEEK_SET);
-			fwrite(&_root->fpos, sizeof(_root->fpos), 1, _dataFile);
-			ret = flush();
+			_shrinkRoot();
+			ret = (_bufferSize != 0 || _batching || flush()) && ret;
+		}
+		if ((BloomFilter*)_bloom != 0 && _bloom->needsRebuild())
+		{
+			_rebuildFilter();
+		}
+		return ret;
+	}
+
+	// Shrink the tree by making the root's child (there should only
+	// be one, as the root has no records left) the new root. Write
+	// the location of the new root to the start of the file so we
+	// know where to look. The old root's messages are the newest of
+	// all, and go to the new root.
+	void BTreeDB::_shrinkRoot()
+	{
+		TreeNodePtr oldRoot = _root;
+		_root = oldRoot->loadChild(0, _store);
+		_root->parent = (TreeNode*)0;
+		while (oldRoot->messages != 0)
+		{
+			_moveMessage(oldRoot, oldRoot->messages->begin(), _root, true);
+		}
+		_latch(oldRoot);
+		oldRoot->children.clear();
+		if (_optimistic)
+		{
+			_retire(oldRoot);
+		}
+		else
+		{
+			oldRoot->unload();
+		}
+		_freePage(oldRoot->fpos);
+		_writeRoot();
+	}
+
+	// Delete the records with keys from lo up to (but not including)
+	// hi, the same records that count(lo, hi) counts. A null lo or hi
+	// leaves that end of the range open. Rather than going down the
+	// tree once for each record, the range is cut out of the tree in
+	// one walk down its two edges: the subtrees that it covers are cut
+	// off where they hang, and only the nodes along the edges change
+	// (see _cutRange). Then the nodes along the two edges that were
+	// left short are brought back up to size, as _delete would have on
+	// its way down, and last of all the records that were kept to hold
+	// the edges apart are deleted in the usual way. With message
+	// buffers, the messages all go down first.
+	bool BTreeDB::deleteRange(const DbObjPtr& lo, const DbObjPtr& hi)
+	{
+		SChangeGuard guard(this);
+		_drainMessages();
+		bool ret = true;
+		if ((DbObj*)lo != 0 && (DbObj*)hi != 0 &&
+			_compFunc(lo->getData(), _layout.probeSize(lo), hi->getData(), _layout.probeSize(hi)) >= 0)
+		{
+			return ret;
+		}
+		if ((RecordCache*)_cache != 0)
+		{
+			_cache->clear();
+		}
+		size_t level = 0;
+		for (TreeNodePtr node = _root; !node->isLeaf; node = node->loadChild(0, _store))
+		{
+			level++;
+		}
+
+		// With both ends open, the whole tree goes, and an empty leaf
+		// takes the place of the root.
+		bool shrunk = false;
+		DBOBJVECTOR separators;
+		if ((DbObj*)lo == 0 && (DbObj*)hi == 0)
+		{
+			TreeNodePtr oldRoot = _root;
+			_latch(oldRoot);
+			_root = _allocateNode();
+			_write(_root);
+			_writeRoot();
+			_dropSubtree(oldRoot, level);
+			shrunk = true;
+		}
+		else
+		{
+			_cutRange(_root, lo, hi, (DbObj*)lo == 0, (DbObj*)hi == 0, level, separators);
+		}
+
+		// Merging the children of a node on one edge can leave it empty,
+		// so the edges are gone over until neither has an empty node.
+		bool again = true;
+		while (again || (_root->objCount == 0 && !_root->isLeaf))
+		{
+			if (_root->objCount == 0 && !_root->isLeaf)
+			{
+				_shrinkRoot();
+				shrunk = true;
+			}
+			else
+			{
+				again = _repair(_root, lo, false);
+				again = _repair(_root, hi, true) || again;
+			}
+		}
+		if (shrunk)
+		{
+			ret = (_batching || flush()) && ret;
+		}
+		for (size_t ctr = 0; ctr < separators.size(); ctr++)
+		{
+			ret = _del(separators[ctr]) && ret;
+		}
+		if ((BloomFilter*)_bloom != 0 && _bloom->needsRebuild())
+		{
+			_rebuildFilter();
+		}
+		if (_rebalanceDue())
+		{
+			ret = rebalance() && ret;
+		}
+		if (_collectDue())
+		{
+			ret = collectValues() && ret;
+		}
+		return ret;
+	}
+
+	// Delete every record.
+	bool BTreeDB::truncate()
+	{
+		return deleteRange(DbObjPtr(), DbObjPtr());
+	}
+
+	// Take the records from lo up to (but not including) hi out of a
+	// subtree, given its level (0 for a leaf). loIn and hiIn say that
+	// all of the node's keys are at least lo, or below hi, so that end
+	// of the range doesn't cut through it (they can't both be set). In
+	// an internal node, the children that the range covers are cut off
+	// whole, and only the one or two that an end of the range cuts
+	// through are gone into. Where both of those are kept, the last of
+	// the node's records in the range stays between them for now, and
+	// is added to separators to be deleted once the tree is whole
+	// again. Nodes along the edges of the range can be left short of
+	// records, or with none at all.
+	void BTreeDB::_cutRange(TreeNodePtr& node, const DbObjPtr& lo, const DbObjPtr& hi, bool loIn, bool hiIn, size_t level, DBOBJVECTOR& separators)
+	{
+		size_t count = node->objCount;
+		int loComp = 1;
+		int hiComp = 1;
+		size_t first = loIn ? 0 : node->lowerBound(lo->getData(), _layout.probeSize(lo), _compFunc, loComp);
+		size_t last = hiIn ? count : node->lowerBound(hi->getData(), _layout.probeSize(hi), _compFunc, hiComp);
+		if (node->isLeaf)
+		{
+			if (last > first)
+			{
+				_latch(node);
+				_forgetRecords(node, first, last - first);
+				node->copyRecords(first, node, last, count - last);
+				node->setCount(count - (last - first));
+				_write(node);
+			}
+			return;
+		}
+
+		// None of the node's records are in the range, so it all
+		// happens in the one child between them.
+		if (first == last)
+		{
+			TreeNodePtr child = node->loadChild(first, _store);
+			_cutRange(child, lo, hi, loIn, hiIn, level - 1, separators);
+			if (_recount(node))
+			{
+				_write(node);
+			}
+			return;
+		}
+
+		// The child left of the first record in the range is kept unless
+		// lo is at or below all of it, and gone into unless that record
+		// is lo itself (so the child is all below lo). The child right
+		// of the last record in the range is kept and gone into unless
+		// hi is above all of it (or the next record is hi itself, but
+		// only if the child on the left is kept, as one of them must be).
+		bool keepFirst = !loIn;
+		bool intoFirst = keepFirst && !(first < count && loComp == 0);
+		bool keepLast = !hiIn && !(keepFirst && last < count && hiComp == 0);
+		if (intoFirst)
+		{
+			TreeNodePtr child = node->loadChild(first, _store);
+			_cutRange(child, lo, hi, false, true, level - 1, separators);
+		}
+		if (keepLast)
+		{
+			TreeNodePtr child = node->loadChild(last, _store);
+			_cutRange(child, lo, hi, true, false, level - 1, separators);
+		}
+		_latch(node);
+		for (size_t ctr = first; ctr <= last; ctr++)
+		{
+			if ((ctr > first || !keepFirst) && (ctr < last || !keepLast))
+			{
+				_cutChild(node, ctr, level - 1);
+			}
+		}
+
+		// Close up the records and children that are left.
+		size_t kept = first;
+		if (keepFirst && keepLast)
+		{
+			separators.push_back(node->getRecord(last - 1));
+			_forgetRecords(node, first, last - first - 1);
+			node->copyRecord(kept++, node, last - 1);
+		}
+		else
+		{
+			_forgetRecords(node, first, last - first);
+		}
+		node->copyRecords(kept, node, last, count - last);
+		size_t childNo = keepFirst ? first + 1 : first;
+		if (keepLast)
+		{
+			node->moveChild(childNo++, node, last);
+		}
+		for (size_t ctr = last + 1; ctr <= count; ctr++)
+		{
+			node->moveChild(childNo++, node, ctr);
+		}
+		node->setCount(kept + count - last);
+		_recount(node);
+		_write(node);
+	}
+
+	// Cut a child that the range being deleted covers off its parent,
+	// with everything under it, given its level. The subtree is only
+	// read if something has to hear about its records going (the value
+	// log, the hash index or the Bloom filter), or, in a copy-on-write
+	// file, for the pages of the nodes under it; otherwise only the
+	// child's own page is let go of, and the pages under it go with it
+	// (a file that isn't copy-on-write doesn't use pages again anyway,
+	// as with a merge). Nodes that are loaded are always gone through,
+	// to let go of them.
+	void BTreeDB::_cutChild(TreeNodePtr& parent, size_t childNo, size_t level)
+	{
+		TreeNodePtr child = parent->children[childNo].node();
+		bool visit = ((ValueLog*)_valueLog != 0 || (HashIndex*)_hashIndex != 0 ||
+			(BloomFilter*)_bloom != 0 || (_copyOnWrite && level != 0));
+		if (!visit && ((TreeNode*)child == 0 || !child->loaded))
+		{
+			_freePage(parent->childPageId(childNo));
+			return;
+		}
+		child = parent->loadChild(childNo, _store);
+		_dropSubtree(child, level);
+	}
+
+	// Let go of a subtree that is out of the tree: its records, its
+	// nodes (retired, with optimistic reads) and its pages. If it was
+	// waiting for the flusher, it won't be written now.
+	void BTreeDB::_dropSubtree(TreeNodePtr& node, size_t level)
+	{
+		_forgetRecords(node, 0, node->objCount);
+		for (size_t ctr = 0; !node->isLeaf && ctr <= node->objCount; ctr++)
+		{
+			_cutChild(node, ctr, level - 1);
+		}
+		_dirty.erase(node->fpos);
+		_freePage(node->fpos);
+		if (_optimistic)
+		{
+			_retire(node);
+		}
+		else
+		{
+			node->unload();
+		}
+	}
+
+	// Some records are going out of the tree without a _del(): let go of
+	// their payloads in the value log, and tell the hash index and the
+	// Bloom filter that they have gone.
+	void BTreeDB::_forgetRecords(const TreeNodePtr& node, size_t objNo, size_t count)
+	{
+		std::vector<byte> key;
+		for (size_t ctr = objNo; ctr < objNo + count; ctr++)
+		{
+			_releaseValue(node, ctr);
+			if ((HashIndex*)_hashIndex != 0)
+			{
+				key.resize(node->keySize(ctr) + 1);
+				node->getKey(ctr, &key[0]);
+				_hashIndex->remove(&key[0], node->keySize(ctr));
+			}
+			if ((BloomFilter*)_bloom != 0)
+			{
+				_bloom->noteDelete();
+			}
+		}
+	}
+
+	// Bring a child that isn't safe back up to size, as _delete does on
+	// its way down: it takes records from a sibling that can spare them,
+	// and failing that it is merged with a sibling, until it is safe or
+	// is all that its parent has left. A child that has very few records
+	// left (as lazy deletes can leave one) would take several records one
+	// at a time, writing three nodes for each, so if it and a sibling fit
+	// in a node that isn't full, they are merged straight away instead.
+	// Returns the child, which is the merged node if there was a merge.
+	TreeNodePtr BTreeDB::_topUp(TreeNodePtr& node, size_t childNo)
+	{
+		TreeNodePtr child = node->loadChild(childNo, _store);
+		while (!child->isSafe() && node->objCount != 0)
+		{
+			size_t mergeNo = (childNo > 0) ? childNo - 1 : childNo;
+			size_t together = node->loadChild(mergeNo, _store)->logicalSize() + node->loadChild(mergeNo + 1, _store)->logicalSize();
+			if (together + 3 * _layout.maxEntry <= _layout.usable)
+			{
+				childNo = mergeNo;
+				child = _merge(node, childNo);
+			}
+			else if (childNo > 0 && node->loadChild(childNo - 1, _store)->canLend())
+			{
+				_lend(node, childNo, true);
+			}
+			else if (childNo < node->objCount && node->loadChild(childNo + 1, _store)->canLend())
+			{
+				_lend(node, childNo, false);
+			}
+			else
+			{
+				childNo = (childNo > 0) ? childNo - 1 : childNo;
+				child = _merge(node, childNo);
+			}
+		}
+		return child;
+	}
+
+	// Top up each child on the way down to a key (to the first or last
+	// child, as high says, if the key is null) after a range delete, and
+	// bring the counts up to date on the way back up. Says whether a
+	// node below the root is left empty, which merging its children can
+	// do, so that the way down needs going over again.
+	bool BTreeDB::_repair(TreeNodePtr& node, const DbObjPtr& key, bool high)
+	{
+		bool ret = false;
+		if (!node->isLeaf)
+		{
+			size_t childNo = high ? node->objCount : 0;
+			if ((DbObj*)key != 0)
+			{
+				int compVal = 0;
+				childNo = node->lowerBound(key->getData(), _layout.probeSize(key), _compFunc, compVal);
+			}
+			TreeNodePtr child = _topUp(node, childNo);
+			ret = _repair(child, key, high) || child->objCount == 0;
+			if (_recount(node))
+			{
+				_write(node);
+			}
+		}
+		return ret;
+	}
+
+	// Whether a del can go down into a child as it is, without topping
+	// it up first. With lazy deletes, a leaf only has to keep the fill
+	// it was given, and a record besides the one going.
+	bool BTreeDB::_canDelete(const TreeNodePtr& node)
+	{
+		if (node->isSafe())
+		{
+			return true;
+		}
+		return _lazyPending != 0 && node->isLeaf && node->objCount >= 2
+			&& node->logicalSize() * 100 >= _layout.usable * _lazyFill;
+	}
+
+	// Whether enough leaves are short to top them up now.
+	bool BTreeDB::_rebalanceDue()
+	{
+		return _lazyPending != 0 && _shortLeaves.size() >= _lazyPending;
+	}
+
+	// Top up the leaves that lazy deletes have left short, going down to
+	// each of them as a range delete goes down its edges (see _repair).
+	// A leaf that has since been merged, or topped up by a del, costs a
+	// walk down the tree and nothing more. Merging can empty the root,
+	// and then the tree shrinks.
+	bool BTreeDB::rebalance()
+	{
+		SChangeGuard guard(this);
+		bool ret = true;
+		std::map<long, DbObjPtr> shortLeaves;
+		shortLeaves.swap(_shortLeaves);
+		for (std::map<long, DbObjPtr>::iterator it = shortLeaves.begin(); it != shortLeaves.end(); ++it)
+		{
+			_repair(_root, it->second, false);
+			if (_root->objCount == 0 && !_root->isLeaf)
+			{
+				_shrinkRoot();
+				ret = (_bufferSize != 0 || _batching || flush()) && ret;
+			}
 		}
 		return ret;
 	}
 
 	// External put method. This will overwrite a key
 	// (allowing no duplicates) or insert a new item.
+	// Records can be any size up to getRecSize(), and the
+	// key is the first getKeySize() bytes unless the record
+	// says otherwise (see the put below).
+	// Payloads bigger than the value threshold are written to
+	// the value log, and the tree just keeps where they went.
+	// With message buffers, a copy of the record is left in the
+	// root's buffer instead.
 	bool BTreeDB::put(const DbObjPtr& rec)
 	{
-		if (rec->getSize() != getRecSize())
+		SChangeGuard guard(this);
+		if (_bufferSize == 0)
+		{
+			if (!_put(rec))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			size_t keySize = 0;
+			bool outOfLine = false;
+			if (!_checkRecord(rec, keySize, outOfLine))
+			{
+				return false;
+			}
+			if ((RecordCache*)_cache != 0)
+			{
+				_cache->erase(rec->getData(), keySize);
+			}
+			_addMessage(_root, std::string((const char*)rec->getData(), keySize), new DbObj(*rec), true);
+			if ((BloomFilter*)_bloom != 0)
+			{
+				_bloom->add(rec->getData(), keySize);
+				if (_bloom->needsRebuild())
+				{
+					_rebuildFilter();
+				}
+			}
+			if (_root->messageBytes > _bufferSize)
+			{
+				_flushMessages(_root);
+				if (!_writeBatch())
+				{
+					return false;
+				}
+			}
+		}
+		if (_rebalanceDue() && !rebalance())
+		{
+			return false;
+		}
+		if (_collectDue())
+		{
+			return collectValues();
+		}
+		return true;
+	}
+
+	// Whether a record can be stored: it needs a key, and has to fit
+	// in a node once its payload has gone to the value log (if it's
+	// big enough to go there).
+	bool BTreeDB::_checkRecord(const DbObjPtr& rec, size_t& keySize, bool& outOfLine)
+	{
+		keySize = _layout.probeSize(rec);
+		if (keySize == 0 || keySize > rec->getSize())
+		{
+			return false;
+		}
+		outOfLine = ((ValueLog*)_valueLog != 0 && rec->getSize() - keySize > _valueThreshold);
+		size_t storedSize = outOfLine ? keySize + sizeof(SValuePtr) : rec->getSize();
+		return storedSize <= getRecSize();
+	}
+
+	// Put a record in the tree itself.
+	bool BTreeDB::_put(const DbObjPtr& rec)
+	{
+		size_t keySize = 0;
+		bool outOfLine = false;
+		if (!_checkRecord(rec, keySize, outOfLine))
 		{
 			return false;
 		}
+		if ((RecordCache*)_cache != 0)
+		{
+			_cache->erase(rec->getData(), keySize);
+		}
+
+		// If we found the key, the record is updated where it is,
+		// as long as the node still fits in its page. A record
+		// that has grown too much is taken out and put back in.
 		NodeKeyLocn locn = _search(_root, rec);
+		bool found = ((TreeNode*)locn.first != 0 && locn.second != (size_t)-1);
+		size_t storedSize = outOfLine ? keySize + sizeof(SValuePtr) : rec->getSize();
+		if (found && locn.first->logicalSize() - locn.first->entrySize(locn.second) + _layout.entrySize(storedSize) > _layout.usable)
+		{
+			_del(rec);
+			found = false;
+		}
+
+		DbObjPtr stored = rec;
+		unsigned short flags = 0;
+		if (outOfLine)
+		{
+			SValuePtr vp;
+			if (!_valueLog->append((byte*)rec->getData() + keySize, rec->getSize() - keySize, vp))
+			{
+				return false;
+			}
+			stored = new DbObj(rec->getData(), keySize, &vp, sizeof(vp));
+			flags = ESF_VALUEPTR;
+		}
 
 		// If we can't find the key, then insert a new
 		// record.
-		if ((TreeNode*)locn.first == 0 || locn.second == (size_t)-1)
+		if (!found)
 		{
-			_insert(rec);
+			_insert(stored, flags);
+			if ((BloomFilter*)_bloom != 0)
+			{
+				_bloom->add(rec->getData(), keySize);
+				if (_bloom->needsRebuild())
+				{
+					_rebuildFilter();
+				}
+			}
 		}
-
-		// If we found the key, update the node with
-		// the record.
 		else
 		{
-			locn.first->objects[locn.second] = rec;
-			locn.first->write(_dataFile);
+			if ((ValueLog*)_valueLog != 0)
+			{
+				_releaseValue(locn.first, locn.second);
+			}
+			_latch(locn.first);
+			locn.first->setRecord(locn.second, stored, flags);
+			_write(locn.first);
 		}
 		return true;
 	}
 
+	// Put a record made up of the key and payload given. The
+	// key can be any length, whatever the tree's key size is.
+	bool BTreeDB::put(const DbObjPtr& key, const DbObjPtr& value)
+	{
+		return put(new DbObj(key->getData(), key->getSize(), value->getData(), value->getSize()));
+	}
+
 	// This method retrieves a record from the database
 	// given its location.
 	bool BTreeDB::get(const NodeKeyLocn& locn, DbObjPtr& rec)
 	{
+		TREEGUARD guard(_treeLock);
 		if ((TreeNode*)locn.first == 0 || locn.second == (size_t)-1)
 		{
 			return false;
 		}
-		rec = locn.first->objects[locn.second];
+		rec = _getRecord(locn.first, locn.second);
 		return true;
 	}
 
 	// This method retrieves a record from the database
 	// given its key.
+	// Records in the record cache are given straight back,
+	// without taking the tree's lock: a change to a record
+	// takes its key out of the cache before it lets go of the
+	// lock, and records only go into the cache under the
+	// lock, so at worst a record found there is one that a
+	// change still going on is replacing.
+	// If the Bloom filter says the key isn't there, we
+	// needn't look. If there is a hash index, the page it
+	// points at is tried before the tree is searched, and a
+	// key found by searching is put back in the index.
+	// With optimistic reads, the tree is searched without the
+	// lock first, and all of that only happens if that fails.
+	// With message buffers, the buffers are looked in on the
+	// way down the tree instead of using the hash index.
 	bool BTreeDB::get(const DbObjPtr& key, DbObjPtr& rec)
 	{
-		NodeKeyLocn locn = _search(_root, key);
-		return get(locn, rec);
-	}
-
+		size_t keySize = _layout.probeSize(key);
+		bool useCache = ((RecordCache*)_cache != 0 && _layout.prefixCompare != 0);
+		if (useCache && _cache->find(key->getData(), keySize, rec))
+		{
+			return true;
+		}
+		bool found = false;
+		if (_optimistic && _layout.prefixCompare != 0 && _getOptimistic(key, rec, found))
+		{
+			return found;
+		}
+		TREEGUARD guard(_treeLock);
+		if ((BloomFilter*)_bloom != 0 && _layout.prefixCompare != 0 && !_bloom->mayContain(key->getData(), keySize))
+		{
+			return false;
+		}
+		if (_bufferSize != 0)
+		{
+			bool ret = _getBuffered(key, rec);
+			if (ret && useCache)
+			{
+				_cache->insert(key->getData(), keySize, rec);
+			}
+			return ret;
+		}
+		bool ret = ((HashIndex*)_hashIndex != 0 && _getIndexed(key, rec));
+		if (!ret)
+		{
+			NodeKeyLocn locn = _search(_root, key);
+			if ((TreeNode*)locn.first != 0 && locn.second != (size_t)-1)
+			{
+				_indexRecords(locn.first, locn.second, 1);
+			}
+			ret = get(locn, rec);
+		}
+		if (ret && useCache)
+		{
+			_cache->insert(key->getData(), keySize, rec);
+		}
+		return ret;
+	}
+
+	// Search for a key without the tree's lock. Each node's version is
+	// taken before it is searched, and checked before the search is
+	// trusted and again before going down to the child, so that a node
+	// that changed (or was latched) on the way down means starting again
+	// from the root. This gives back false, so that get() takes the lock,
+	// if a node on the way down isn't loaded yet, if the tree keeps
+	// changing, or if there are too many readers to give this one a slot.
+	bool BTreeDB::_getOptimistic(const DbObjPtr& key, DbObjPtr& rec, bool& found)
+	{
+		size_t slotNo = _enterEpoch();
+		if (slotNo == (size_t)-1)
+		{
+			return false;
+		}
+		bool ret = false;
+		bool giveUp = false;
+		for (size_t attempt = 0; !ret && !giveUp && attempt < OPTIMISTIC_TRIES; attempt++)
+		{
+			TreeNode* node = _rootNode.load();
+			unsigned long long v = 0;
+			bool restart = (node == 0 || !node->readVersion(v));
+			while (!ret && !restart && !giveUp)
+			{
+				OBJECTPOS op = node->findPos(key, _compFunc, &v);
+				if (!node->validate(v))
+				{
+					restart = true;
+				}
+				else if (op.second == ECP_INTHIS)
+				{
+					ret = _readOptimistic(node, op.first, v, rec);
+					restart = !ret;
+					found = true;
+				}
+				else if (op.second == ECP_NONE)
+				{
+					ret = true;
+					found = false;
+				}
+				else
+				{
+					size_t childNo = (op.second == ECP_INLEFT) ? op.first : op.first + 1;
+					TreeNode* child = (childNo < node->children.size()) ? (TreeNode*)node->children[childNo] : 0;
+					unsigned long long cv = 0;
+					if (!node->validate(v) || (child != 0 && !child->readVersion(cv)))
+					{
+						restart = true;
+					}
+					else if (child == 0 || !child->loaded)
+					{
+						giveUp = true;
+					}
+					else if (!node->validate(v))
+					{
+						restart = true;
+					}
+					else
+					{
+						node = child;
+						v = cv;
+					}
+				}
+			}
+		}
+		_leaveEpoch(slotNo);
+		return ret;
+	}
+
+	// Copy a record out of a node for _getOptimistic(), fetching the
+	// payload from the value log if need be. False if the node changed.
+	bool BTreeDB::_readOptimistic(TreeNode* node, size_t objNo, unsigned long long v, DbObjPtr& rec)
+	{
+		std::vector<byte> key;
+		std::vector<byte> value;
+		unsigned short flags = 0;
+		if (!node->readRecord(objNo, v, key, value, flags))
+		{
+			return false;
+		}
+		if ((flags & ESF_VALUEPTR) && (ValueLog*)_valueLog != 0)
+		{
+			SValuePtr vp;
+			if (value.size() != sizeof(vp))
+			{
+				return false;
+			}
+			memcpy(&vp, &value[0], sizeof(vp));
+			if (!_valueLog->read(vp, value) || !node->validate(v))
+			{
+				return false;
+			}
+		}
+		rec = new DbObj(&key[0], key.size() - 1, value.empty() ? 0 : &value[0], value.size());
+		return true;
+	}
+
+	// The bytes a message takes in a buffer.
+	static size_t _messageSize(const std::string& key, const DbObjPtr& rec)
+	{
+		return key.size() + (((DbObj*)rec != 0) ? rec->getSize() : 0);
+	}
+
+	// The whole key of a record in a node, as the buffers keep it.
+	std::string BTreeDB::_nodeKey(const TreeNodePtr& node, size_t objNo)
+	{
+		std::string key(node->keySize(objNo) + 1, '\0');
+		node->getKey(objNo, &key[0]);
+		key.resize(node->keySize(objNo));
+		return key;
+	}
+
+	// Put a message in a node's buffer. If the buffer already has one
+	// for the key, the newer of the two is kept.
+	void BTreeDB::_addMessage(TreeNode* node, const std::string& key, const DbObjPtr& rec, bool newer)
+	{
+		if (node->messages == 0)
+		{
+			node->messages = new MESSAGEMAP;
+		}
+		std::pair<MESSAGEMAP::iterator, bool> ins = node->messages->insert(std::make_pair(key, rec));
+		if (ins.second)
+		{
+			node->messageBytes += _messageSize(key, rec);
+			++_messageCount;
+		}
+		else if (newer)
+		{
+			node->messageBytes -= _messageSize(key, ins.first->second);
+			node->messageBytes += _messageSize(key, rec);
+			ins.first->second = rec;
+		}
+	}
+
+	// Take a message out of a node's buffer. The buffer goes once
+	// it is empty.
+	void BTreeDB::_dropMessage(TreeNode* node, MESSAGEMAP::iterator it)
+	{
+		node->messageBytes -= _messageSize(it->first, it->second);
+		--_messageCount;
+		node->messages->erase(it);
+		if (node->messages->empty())
+		{
+			delete node->messages;
+			node->messages = 0;
+		}
+	}
+
+	// Take a message out of a node's buffer and into a batch.
+	void BTreeDB::_takeMessage(TreeNode* node, MESSAGEMAP::iterator it, MESSAGEMAP& into)
+	{
+		into[it->first] = it->second;
+		_dropMessage(node, it);
+	}
+
+	// Move a message from one node's buffer to another's.
+	void BTreeDB::_moveMessage(TreeNode* from, MESSAGEMAP::iterator it, TreeNode* to, bool newer)
+	{
+		std::string key = it->first;
+		DbObjPtr rec = it->second;
+		_dropMessage(from, it);
+		_addMessage(to, key, rec, newer);
+	}
+
+	// A node has been split. The messages for keys above the median go
+	// to the new node with the records, and one for the median follows
+	// it up into the parent, unless the parent has a newer one.
+	void BTreeDB::_splitMessages(TreeNodePtr& parent, size_t objNo, TreeNodePtr& child, TreeNodePtr& newChild)
+	{
+		if (child->messages == 0)
+		{
+			return;
+		}
+		std::string median = _nodeKey(parent, objNo);
+		MESSAGEMAP::iterator it = child->messages->lower_bound(median);
+		if (it != child->messages->end() && it->first == median)
+		{
+			_moveMessage(child, it++, parent, false);
+		}
+		while (child->messages != 0 && it != child->messages->end())
+		{
+			_moveMessage(child, it++, newChild, true);
+		}
+	}
+
+	// A sibling has lent a record, through the parent, to a node that
+	// was short of them. The message for the record that went up into
+	// the parent follows it there, unless the parent has a newer one,
+	// and those for the keys past it (which belong to the child that
+	// moved across, if there is one) go to the node.
+	void BTreeDB::_lendMessages(TreeNodePtr& parent, size_t objNo, TreeNodePtr& sibling, TreeNodePtr& child, bool fromLeft)
+	{
+		if (sibling->messages == 0)
+		{
+			return;
+		}
+		std::string lent = _nodeKey(parent, objNo);
+		MESSAGEMAP::iterator it = sibling->messages->lower_bound(lent);
+		if (it != sibling->messages->end() && it->first == lent)
+		{
+			_moveMessage(sibling, it++, parent, false);
+		}
+		while (fromLeft && sibling->messages != 0 && it != sibling->messages->end())
+		{
+			_moveMessage(sibling, it++, child, true);
+		}
+		while (!fromLeft && sibling->messages != 0 && sibling->messages->begin()->first < lent)
+		{
+			_moveMessage(sibling, sibling->messages->begin(), child, true);
+		}
+	}
+
+	// A record has come up into a node from a leaf under one of its
+	// children, to take the place of one that was deleted. That moves
+	// the line between the child and its sibling, so the messages on the
+	// way down to the leaf for keys on the far side of the record (or
+	// for the record itself) follow it up into the node: the highest,
+	// and so newest, first, and none over one the node already has.
+	void BTreeDB::_liftMessages(TreeNodePtr& node, size_t objNo, size_t childNo)
+	{
+		if (_messageCount == 0)
+		{
+			return;
+		}
+		std::string key = _nodeKey(node, objNo);
+		TreeNode* below = node->children[childNo].node();
+		while (below != 0 && below->loaded)
+		{
+			while (childNo == objNo && below->messages != 0 && below->messages->rbegin()->first >= key)
+			{
+				_moveMessage(below, --below->messages->end(), node, false);
+			}
+			while (childNo != objNo && below->messages != 0 && below->messages->begin()->first <= key)
+			{
+				_moveMessage(below, below->messages->begin(), node, false);
+			}
+			if (below->isLeaf)
+			{
+				break;
+			}
+			int compVal = 0;
+			below = below->children[below->lowerBound(key.data(), key.size(), _compFunc, compVal)].node();
+		}
+	}
+
+	// A node's buffer is full. The messages for keys in the node itself
+	// are applied to it, and those for the children that have the most
+	// bytes of them (until the buffer is half empty) go down together:
+	// into each child's buffer, which may fill in turn, or if the child
+	// is a leaf, into its records, so that the leaf is read and written
+	// once for the lot. Messages are moved between buffers before any
+	// are applied, as applying them can split and merge nodes (and the
+	// buffers with them).
+	void BTreeDB::_flushMessages(TreeNodePtr& node)
+	{
+		MESSAGEMAP here;
+		if (node->isLeaf)
+		{
+			while (node->messages != 0)
+			{
+				_takeMessage(node, node->messages->begin(), here);
+			}
+			_applyMessages(here);
+			return;
+		}
+
+		// Find where each message goes, and how much goes to each child.
+		std::vector<size_t> route;
+		std::vector<size_t> bytes(node->objCount + 1, 0);
+		size_t left = node->messageBytes;
+		MESSAGEMAP::iterator it;
+		for (it = node->messages->begin(); it != node->messages->end(); ++it)
+		{
+			int compVal = 0;
+			size_t pos = node->lowerBound(it->first.data(), it->first.size(), _compFunc, compVal);
+			if (pos < node->objCount && compVal == 0)
+			{
+				pos = (size_t)-1;
+				left -= _messageSize(it->first, it->second);
+			}
+			else
+			{
+				bytes[pos] += _messageSize(it->first, it->second);
+			}
+			route.push_back(pos);
+		}
+		std::vector<bool> chosen(node->objCount + 1, false);
+		while (left > _bufferSize / 2)
+		{
+			size_t best = (size_t)-1;
+			for (size_t ctr = 0; ctr <= node->objCount; ctr++)
+			{
+				if (!chosen[ctr] && (best == (size_t)-1 || bytes[ctr] > bytes[best]))
+				{
+					best = ctr;
+				}
+			}
+			chosen[best] = true;
+			left -= bytes[best];
+		}
+		std::vector<MESSAGEMAP> down(node->objCount + 1);
+		it = node->messages->begin();
+		for (size_t ctr = 0; ctr < route.size(); ctr++)
+		{
+			if (route[ctr] == (size_t)-1)
+			{
+				_takeMessage(node, it++, here);
+			}
+			else if (chosen[route[ctr]])
+			{
+				_takeMessage(node, it++, down[route[ctr]]);
+			}
+			else
+			{
+				++it;
+			}
+		}
+
+		// A leaf only has messages of its own if the tree has shrunk
+		// under them, and they are older than the ones coming down.
+		MESSAGEMAP leaves;
+		TREENODEVECTOR filled;
+		for (size_t ctr = 0; ctr <= node->objCount; ctr++)
+		{
+			if (down[ctr].empty())
+			{
+				continue;
+			}
+			TreeNodePtr child = node->loadChild(ctr, _store);
+			if (child->isLeaf)
+			{
+				MESSAGEMAP older;
+				while (child->messages != 0)
+				{
+					_takeMessage(child, child->messages->begin(), older);
+				}
+				leaves.insert(down[ctr].begin(), down[ctr].end());
+				leaves.insert(older.begin(), older.end());
+				continue;
+			}
+			for (it = down[ctr].begin(); it != down[ctr].end(); ++it)
+			{
+				_addMessage(child, it->first, it->second, true);
+			}
+			filled.push_back(child);
+		}
+		_applyMessages(here);
+		_applyMessages(leaves);
+		for (size_t ctr = 0; ctr < filled.size(); ctr++)
+		{
+			if (filled[ctr]->messageBytes > _bufferSize)
+			{
+				_flushMessages(filled[ctr]);
+			}
+		}
+	}
+
+	// Put a batch of messages into the tree itself, in key order.
+	void BTreeDB::_applyMessages(MESSAGEMAP& batch)
+	{
+		for (MESSAGEMAP::iterator it = batch.begin(); it != batch.end(); ++it)
+		{
+			if ((DbObj*)it->second != 0)
+			{
+				_put(it->second);
+			}
+			else
+			{
+				_del(new DbObj(it->first.data(), it->first.size(), 0, 0));
+			}
+		}
+	}
+
+	// Take the messages out of every buffer in a subtree. Those higher
+	// up are newer, so they are taken last, over the ones below.
+	void BTreeDB::_takeAllMessages(TreeNode* node, MESSAGEMAP& into)
+	{
+		for (size_t ctr = 0; !node->isLeaf && ctr < node->children.size(); ctr++)
+		{
+			TreeNode* child = node->children[ctr].node();
+			if (child != 0 && child->loaded)
+			{
+				_takeAllMessages(child, into);
+			}
+		}
+		while (node->messages != 0)
+		{
+			_takeMessage(node, node->messages->begin(), into);
+		}
+	}
+
+	// Send every message all the way down, before something that
+	// walks the records themselves.
+	void BTreeDB::_drainMessages()
+	{
+		if (_messageCount != 0)
+		{
+			MESSAGEMAP batch;
+			_takeAllMessages(_root, batch);
+			_applyMessages(batch);
+			_writeBatch();
+		}
+	}
+
+	// Write the nodes that a batch of messages changed, each of them
+	// once, unless the flusher or a commit is going to.
+	bool BTreeDB::_writeBatch()
+	{
+		return _copyOnWrite || _flusher.joinable() || _writeBack(true, false);
+	}
+
+	// Look for a key with message buffers. The first message for the
+	// key on the way down is the newest thing there is about it, so
+	// it is the answer; otherwise the record is, if there is one.
+	bool BTreeDB::_getBuffered(const DbObjPtr& key, DbObjPtr& rec)
+	{
+		size_t keySize = _layout.probeSize(key);
+		std::string probe((const char*)key->getData(), keySize);
+		TreeNodePtr node = _root;
+		while (true)
+		{
+			if (node->messages != 0)
+			{
+				MESSAGEMAP::iterator it = node->messages->find(probe);
+				if (it != node->messages->end())
+				{
+					if ((DbObj*)it->second == 0)
+					{
+						return false;
+					}
+					rec = new DbObj(*it->second);
+					return true;
+				}
+			}
+			int compVal = 0;
+			size_t pos = node->lowerBound(key->getData(), keySize, _compFunc, compVal);
+			if (pos < node->objCount && compVal == 0)
+			{
+				rec = _getRecord(node, pos);
+				return true;
+			}
+			if (node->isLeaf)
+			{
+				return false;
+			}
+			node = node->loadChild(pos, _store);
+		}
+	}
+
 	// Visit every record in the tree, calling the callback
 	// function with the current record, the reference object,
 	// and the recursion depth as parameters.
 	void BTreeDB::traverse(const DbObjPtr& ref, BTreeDB::traverseCallback cbfn)
 	{
+		SChangeGuard guard(this);
+		_drainMessages();
 		_traverse(_root, ref, cbfn);
 	}
 
@@ -755,9 +2379,315 @@ namespace Database
 	// function used to do the comparison.
 	NodeKeyLocn BTreeDB::search(const DbObjPtr& key, compareFn cfn)
 	{
+		SChangeGuard guard(this);
+		_drainMessages();
 		return _search(_root, key, cfn);
 	}
 
+	// Visit every record in the tree using the threads of a pool.
+	// The tree is cut into subtrees (splitting a level at a time
+	// until there are a few for each thread), and each subtree is
+	// read by one thread, through a file handle of its own.
+	// Unordered, the callback is called from the pool's threads
+	// as records are found, so it has to be thread safe, and only
+	// the records of each subtree come in order. Ordered, the
+	// callback is called on this thread, in key order, and the
+	// threads queue the records of subtrees that it hasn't got to
+	// yet. Either way, the scan stops once the callback returns
+	// false, and the tree mustn't be changed until the scan is over.
+	// Returns false if a page couldn't be read.
+	bool BTreeDB::parallelScan(scanCallback cbfn, void* context, bool ordered)
+	{
+		// The subtrees are read from the disk, so any messages go
+		// down and anything dirty goes there first, and the flusher
+		// is kept off it until we're done.
+		SChangeGuard guard(this);
+		_drainMessages();
+		_writeBack(true, false);
+		std::lock_guard<std::mutex> flushGuard(_flushLock);
+		if ((ThreadPool*)_pool == 0)
+		{
+			_pool = new ThreadPool(_scanThreads);
+		}
+
+		// Cut the tree up.
+		typedef std::vector<std::pair<TreeNodePtr, DbObjPtr> > PIECEVECTOR;
+		PIECEVECTOR pieces(1, std::make_pair(_root, DbObjPtr()));
+		size_t target = _pool->getThreadCount() * 4;
+		size_t subtrees = 1;
+		bool deeper = !_root->isLeaf;
+		while (deeper && subtrees < target)
+		{
+			PIECEVECTOR next;
+			subtrees = 0;
+			deeper = false;
+			for (size_t ctr = 0; ctr < pieces.size(); ctr++)
+			{
+				TreeNodePtr node = pieces[ctr].first;
+				if ((TreeNode*)node == 0 || node->isLeaf)
+				{
+					next.push_back(pieces[ctr]);
+					subtrees += ((TreeNode*)node != 0) ? 1 : 0;
+					continue;
+				}
+				for (size_t childNo = 0; childNo <= node->objCount; childNo++)
+				{
+					TreeNodePtr child = node->loadChild(childNo, _store);
+					next.push_back(std::make_pair(child, DbObjPtr()));
+					++subtrees;
+					deeper = deeper || !child->isLeaf;
+					if (childNo < node->objCount)
+					{
+						next.push_back(std::make_pair(TreeNodePtr(), _getRecord(node, childNo)));
+					}
+				}
+			}
+			pieces.swap(next);
+		}
+
+		// Hand the subtrees to the pool. Their file handles only see
+		// what has got past this one's buffer.
+		fflush(_dataFile);
+		SScanState state;
+		state.db = this;
+		state.cbfn = cbfn;
+		state.context = context;
+		state.ordered = ordered;
+		state.stop = false;
+		std::vector<SScanPart*> parts(pieces.size());
+		std::vector<SScanTask> tasks(pieces.size());
+		for (size_t ctr = 0; ctr < pieces.size(); ctr++)
+		{
+			SScanPart* part = new SScanPart;
+			part->pageId = ((TreeNode*)pieces[ctr].first != 0) ? pieces[ctr].first->fpos : -1;
+			part->rec = pieces[ctr].second;
+			part->done = (part->pageId == -1);
+			part->failed = false;
+			parts[ctr] = part;
+			tasks[ctr].state = &state;
+			tasks[ctr].part = part;
+			if (!part->done)
+			{
+				_pool->submit(_scanTask, &tasks[ctr]);
+			}
+		}
+
+		// Hand the records from above the subtrees (and in an ordered
+		// scan, all of the records) to the callback.
+		for (size_t ctr = 0; ctr < parts.size() && !state.stop; ctr++)
+		{
+			SScanPart* part = parts[ctr];
+			if (part->pageId == -1)
+			{
+				// Unordered, a thread may have stopped the scan while
+				// this record was being handed over, so don't undo it.
+				if (!cbfn(part->rec, context))
+				{
+					state.stop = true;
+				}
+				continue;
+			}
+			while (ordered && !state.stop)
+			{
+				std::deque<DbObjPtr> records;
+				bool done = false;
+				{
+					std::unique_lock<std::mutex> guard(part->lock);
+					while (part->records.empty() && !part->done)
+					{
+						part->ready.wait(guard);
+					}
+					records.swap(part->records);
+					done = part->done;
+				}
+				for (size_t recNo = 0; recNo < records.size() && !state.stop; recNo++)
+				{
+					state.stop = !cbfn(records[recNo], context);
+				}
+				if (done)
+				{
+					break;
+				}
+			}
+		}
+		if (ordered)
+		{
+			state.stop = true;
+		}
+		_pool->wait();
+
+		bool ret = true;
+		for (size_t ctr = 0; ctr < parts.size(); ctr++)
+		{
+			ret = ret && !parts[ctr]->failed;
+			delete parts[ctr];
+		}
+		return ret;
+	}
+
+	// Run by the pool: read one subtree of a parallel scan.
+	void BTreeDB::_scanTask(void* arg)
+	{
+		SScanTask* task = (SScanTask*)arg;
+		SScanPart& part = *task->part;
+		PageReader reader(task->state->db->_store);
+		bool ret = reader.isOpen() && task->state->db->_scanPages(reader, part.pageId, *task->state, part);
+		std::lock_guard<std::mutex> guard(part.lock);
+		part.done = true;
+		part.failed = !ret;
+		part.ready.notify_one();
+	}
+
+	// In-order walk of a subtree, read a page at a time through the
+	// reader. The nodes read here aren't part of the tree in memory.
+	bool BTreeDB::_scanPages(PageReader& reader, long pageId, SScanState& state, SScanPart& part)
+	{
+		TreeNodePtr node = new TreeNode(&_layout);
+		node->fpos = pageId;
+		if (!node->read(&reader))
+		{
+			return false;
+		}
+		for (size_t ctr = 0; ctr <= node->objCount && !state.stop; ctr++)
+		{
+			if (!node->isLeaf && !_scanPages(reader, node->childPos()[ctr], state, part))
+			{
+				return false;
+			}
+			if (ctr < node->objCount && !state.stop)
+			{
+				DbObjPtr rec = _getRecord(node, ctr);
+				_scanRecord(state, part, rec);
+			}
+		}
+		return true;
+	}
+
+	// Pass a record on. A queued record is moved into the queue, so
+	// its count isn't touched on the way.
+	void BTreeDB::_scanRecord(SScanState& state, SScanPart& part, DbObjPtr& rec)
+	{
+		if (state.ordered)
+		{
+			std::lock_guard<std::mutex> guard(part.lock);
+			part.records.push_back(std::move(rec));
+			part.ready.notify_one();
+		}
+		else if (!state.cbfn(rec, state.context))
+		{
+			state.stop = true;
+		}
+	}
+
+	// The number of records in the tree, or -1 if the tree
+	// doesn't count records.
+	size_t BTreeDB::count()
+	{
+		SChangeGuard guard(this);
+		_drainMessages();
+		return _layout.counted ? _root->subtreeCount() : (size_t)-1;
+	}
+
+	// The number of records with keys from lo up to (but not
+	// including) hi, or -1 if the tree doesn't count records. A
+	// null lo or hi leaves that end of the range open.
+	size_t BTreeDB::count(const DbObjPtr& lo, const DbObjPtr& hi)
+	{
+		TREEGUARD guard(_treeLock);
+		if (!_layout.counted)
+		{
+			return (size_t)-1;
+		}
+		size_t loRank = ((DbObj*)lo != 0) ? rank(lo) : 0;
+		size_t hiRank = ((DbObj*)hi != 0) ? rank(hi) : count();
+		return (hiRank > loRank) ? hiRank - loRank : 0;
+	}
+
+	// The number of records with keys less than the key given,
+	// which is the position that the key has (or would have)
+	// in the tree. Each node passed on the way down adds the
+	// records to the left of the path, using the counts kept
+	// for its children. Returns -1 if the tree doesn't count
+	// records.
+	size_t BTreeDB::rank(const DbObjPtr& key)
+	{
+		SChangeGuard guard(this);
+		if (!_layout.counted)
+		{
+			return (size_t)-1;
+		}
+		_drainMessages();
+		size_t ret = 0;
+		size_t keySize = _layout.probeSize(key);
+		TreeNodePtr node = _root;
+		while (true)
+		{
+			int compVal = 0;
+			size_t pos = node->lowerBound(key->getData(), keySize, _compFunc, compVal);
+			ret += pos;
+			if (node->isLeaf)
+			{
+				break;
+			}
+			for (size_t ctr = 0; ctr < pos; ctr++)
+			{
+				ret += node->childCounts()[ctr];
+			}
+			if (pos < node->objCount && compVal == 0)
+			{
+				ret += node->childCounts()[pos];
+				break;
+			}
+			node = node->loadChild(pos, _store);
+		}
+		return ret;
+	}
+
+	// Find the location of the record at a given position in
+	// key order (the first record is at 0). The location can be
+	// passed to get(), or to seq() to carry on from there. If the
+	// position is past the end, or the tree doesn't count records,
+	// the location has a null tree node pointer.
+	NodeKeyLocn BTreeDB::select(size_t index)
+	{
+		SChangeGuard guard(this);
+		NodeKeyLocn ret(TreeNodePtr(), (size_t)-1);
+		if (!_layout.counted)
+		{
+			return ret;
+		}
+		_drainMessages();
+		if (index >= _root->subtreeCount())
+		{
+			return ret;
+		}
+		TreeNodePtr node = _root;
+		while (!node->isLeaf)
+		{
+			size_t ctr = 0;
+			for ( ; ctr < node->objCount; ctr++)
+			{
+				size_t below = node->childCounts()[ctr];
+				if (index < below)
+				{
+					break;
+				}
+				index -= below;
+				if (index == 0)
+				{
+					ret.first = node;
+					ret.second = ctr;
+					return ret;
+				}
+				--index;
+			}
+			node = node->loadChild(ctr, _store);
+		}
+		ret.first = node;
+		ret.second = index;
+		return ret;
+	}
+
 	// Structure and methods used for searching the database.
 	struct SearchData
 	{
@@ -797,6 +2727,8 @@ namespace Database
 	// "ABC%", f'rinstance.
 	void BTreeDB::findAll(const DbObjPtr& key, DBOBJVECTOR& results)
 	{
+		SChangeGuard guard(this);
+		_drainMessages();
 		results.clear();
 		SearchData sd = { false, 0, key, &results };
 		DbObjPtr pRef = new DbObj(&sd, sizeof(sd));
@@ -809,6 +2741,8 @@ namespace Database
 	// The direction can be either forward or backward.
 	bool BTreeDB::seq(NodeKeyLocn& locn, DbObjPtr& rec, ESeqDirection sdir)
 	{
+		SChangeGuard guard(this);
+		_drainMessages();
 		switch (sdir)
 		{
 		case ESD_FORWARD:
@@ -840,13 +2774,13 @@ namespace Database
 			node = _root;
 			while ((TreeNode*)node != 0 && !node->isLeaf)
 			{
-				node = node->loadChild(0, _dataFile, _recSize);
+				node = node->loadChild(0, _store);
 			}
-			if ((TreeNode*)node == 0)
+			if ((TreeNode*)node == 0 || node->objCount == 0)
 			{
 				return false;
 			}
-			rec = node->objects[0];
+			rec = _getRecord(node, 0);
 			locn.first = node;
 			locn.second = 0;
 			return true;
@@ -862,7 +2796,7 @@ namespace Database
 			// didn't visit the last node last time.
 			if (lastPos < node->objCount - 1)
 			{
-				rec = node->objects[lastPos + 1];
+				rec = _getRecord(node, lastPos + 1);
 				locn.second = lastPos + 1;
 				return true;
 			}
@@ -873,16 +2807,16 @@ namespace Database
 		// into child nodes.
 		else
 		{
-			node = node->loadChild(lastPos + 1, _dataFile, _recSize);
+			node = node->loadChild(lastPos + 1, _store);
 			while ((TreeNode*)node != 0 && !node->isLeaf)
 			{
-				node = node->loadChild(0, _dataFile, _recSize);
+				node = node->loadChild(0, _store);
 			}
 			if ((TreeNode*)node == 0)
 			{
 				return false;
 			}
-			rec = node->objects[0];
+			rec = _getRecord(node, 0);
 			locn.first = node;
 			locn.second = 0;
 			return true;
@@ -904,7 +2838,7 @@ namespace Database
 				locn.first = node;
 				locn.second = childNo;
 				ret = true;
-				rec = node->objects[childNo];
+				rec = _getRecord(node, childNo);
 			}
 		}
 		return ret;
@@ -929,15 +2863,15 @@ namespace Database
 			node = _root;
 			while ((TreeNode*)node != 0 && !node->isLeaf)
 			{
-				node = node->loadChild(node->objCount, _dataFile, _recSize);
+				node = node->loadChild(node->objCount, _store);
 			}
-			if ((TreeNode*)node == 0)
+			if ((TreeNode*)node == 0 || node->objCount == 0)
 			{
 				return false;
 			}
 			locn.first = node;
 			locn.second = node->objCount - 1;
-			rec = node->objects[locn.second];
+			rec = _getRecord(node, locn.second);
 			return true;
 		}
 
@@ -952,7 +2886,7 @@ namespace Database
 			if (lastPos > 0)
 			{
 				locn.second = lastPos - 1;
-				rec = node->objects[locn.second];
+				rec = _getRecord(node, locn.second);
 				return true;
 			}
 			goUp = (lastPos == 0);
@@ -962,10 +2896,10 @@ namespace Database
 		// into child nodes.
 		else
 		{
-			node = node->loadChild(lastPos, _dataFile, _recSize);
+			node = node->loadChild(lastPos, _store);
 			while ((TreeNode*)node != 0 && !node->isLeaf)
 			{
-				node = node->loadChild(node->objCount, _dataFile, _recSize);
+				node = node->loadChild(node->objCount, _store);
 			}
 			if ((TreeNode*)node == 0)
 			{
@@ -973,7 +2907,7 @@ namespace Database
 			}
 			locn.first = node;
 			locn.second = node->objCount - 1;
-			rec = node->objects[locn.second];
+			rec = _getRecord(node, locn.second);
 			return true;
 		}
 
@@ -983,7 +2917,7 @@ namespace Database
 		{
 			size_t childNo = node->childNo;
 			node = node->parent;
-			while ((TreeNode*)node != 0 && childNo >= node->objCount)
+			while ((TreeNode*)node != 0 && childNo == 0)
 			{
 				childNo = node->childNo;
 				node = node->parent;
@@ -992,7 +2926,7 @@ namespace Database
 			{
 				locn.first = node;
 				locn.second = childNo - 1;
-				rec = node->objects[locn.second];
+				rec = _getRecord(node, locn.second);
 				ret = true;
 			}
 		}
@@ -1005,23 +2939,630 @@ namespace Database
 	// allocated.
 	bool BTreeDB::flush()
 	{
-		bool ret = _flush(_root, _dataFile);
-		if (ret)
+		SChangeGuard guard(this);
+		_drainMessages();
+		bool ret = true;
+		if (_copyOnWrite)
 		{
-			fflush(_dataFile);
+			ret = commit();
+		}
+		else
+		{
+			std::lock_guard<std::mutex> flushGuard(_flushLock);
+			for (DIRTYMAP::iterator dit = _dirty.begin(); dit != _dirty.end(); ++dit)
+			{
+				ret = dit->second.node->write(_store) && ret;
+			}
+			_dirty.clear();
+			ret = _flush(_root, _store) && ret;
+			if (_rootMoved)
+			{
+				_rootMoved = false;
+				ret = _store->writeAt(0, &_root->fpos, sizeof(_root->fpos)) && ret;
+			}
+			if (ret)
+			{
+				ret = _store->flush();
+			}
+		}
+		if ((ValueLog*)_valueLog != 0)
+		{
+			ret = _valueLog->flush() && ret;
+		}
+		if ((BloomFilter*)_bloom != 0)
+		{
+			ret = _bloom->save(_txnId) && ret;
+		}
+		if ((HashIndex*)_hashIndex != 0)
+		{
+			ret = _hashIndex->save(_txnId) && ret;
 		}
 
 		// Unload each of the root's childrent. If we
 		// unload the root itself, we lose the use of
 		// the tree.
-		for (size_t ctr = 0; _root->isLeaf && ctr < _root->objCount; ctr++)
+		for (size_t ctr = 0; !_root->isLeaf && ctr < _root->children.size(); ctr++)
+		{
+			TreeNodePtr pChild = _root->children[ctr].node();
+			if ((TreeNode*)pChild != 0 && _optimistic)
+			{
+				_dropChild(_root, ctr);
+			}
+			else if ((TreeNode*)pChild != 0)
+			{
+				pChild->unload();
+				_root->children[ctr].unswizzle(pChild->fpos);
+			}
+		}
+		return ret;
+	}
+
+	// A node has changed. Without the background flusher it is written
+	// there and then; with it, it is only marked dirty, and the flusher
+	// is woken if too much of the file is dirty. With message buffers it
+	// is marked dirty too, and written once the batch of messages that
+	// changed it is done (see _writeBatch), as it is while a MemTable
+	// merges.
+	bool BTreeDB::_write(const TreeNodePtr& node)
+	{
+		if (!_copyOnWrite && !_flusher.joinable() && _bufferSize == 0 && !_batching)
+		{
+			return node->write(_store);
+		}
+		DIRTYMAP::iterator dit = _dirty.find(node->fpos);
+		if (dit == _dirty.end())
+		{
+			SDirtyPage dirty = { node, CLOCK::now() };
+			_dirty.insert(std::make_pair(node->fpos, dirty));
+		}
+		else
+		{
+			dit->second.node = node;
+		}
+		if (_flusher.joinable() && _dirty.size() * 100 > _store->getPageCount() * _dirtyPercent)
+		{
+			_flushWake.notify_one();
+		}
+		return true;
+	}
+
+	// The root has moved, so write where it is at the start of the file,
+	// or leave it to the flusher to write once the root's page is out (or
+	// to the next commit). Optimistic readers start from the new root
+	// straight away.
+	void BTreeDB::_writeRoot()
+	{
+		_rootNode = _root;
+		if (_copyOnWrite || _flusher.joinable() || _bufferSize != 0 || _batching)
+		{
+			_rootMoved = true;
+			return;
+		}
+		_store->writeAt(0, &_root->fpos, sizeof(_root->fpos));
+	}
+
+	// Write every dirty page, and the page map, without stopping
+	// puts and dels for longer than it takes to copy the pages.
+	bool BTreeDB::checkpoint()
+	{
+		if (_bufferSize != 0)
+		{
+			SChangeGuard guard(this);
+			_drainMessages();
+		}
+		return _writeBack(true, true);
+	}
+
+	// Write dirty pages out, in page order: all of them, or else those
+	// that have been dirty for too long (unless too much of the file is
+	// dirty, when it's all of them anyway). The pages are copied with the
+	// tree locked and written with it unlocked, so the tree can carry on
+	// changing while the disk is busy. A page that changes again after it
+	// has been copied is simply dirty again. Until they are written, the
+	// copies are kept where _getIndexed() can find them. A checkpoint also
+	// pushes the page map and the file to the disk; it's fuzzy, in that
+	// the pages are as they were when they were copied, not all as of one
+	// moment.
+	bool BTreeDB::_writeBack(bool all, bool checkpoint)
+	{
+		std::map<long, std::vector<byte> > batch;
+		std::unique_lock<std::mutex> flushGuard(_flushLock, std::defer_lock);
+		long rootPos = -1;
+		{
+			TREEGUARD guard(_treeLock);
+			if ((PageStore*)_store == 0)
+			{
+				return false;
+			}
+			all = all || checkpoint || _dirty.size() * 100 > _store->getPageCount() * _dirtyPercent;
+			CLOCK::time_point cutoff = CLOCK::now() - std::chrono::milliseconds(_maxDirtyAge);
+
+			// In a copy-on-write file, pages only go to the disk as part
+			// of a commit, so anything that is due means a commit.
+			if (_copyOnWrite)
+			{
+				for (DIRTYMAP::iterator dit = _dirty.begin(); !all && dit != _dirty.end(); ++dit)
+				{
+					all = (dit->second.since <= cutoff);
+				}
+				return !all || commit();
+			}
+			DIRTYMAP::iterator dit = _dirty.begin();
+			while (dit != _dirty.end())
+			{
+				if (all || dit->second.since <= cutoff)
+				{
+					if (!dit->second.node->copyPage(_store, batch[dit->first]))
+					{
+						batch.erase(dit->first);
+					}
+					_dirty.erase(dit++);
+				}
+				else
+				{
+					++dit;
+				}
+			}
+			if (_rootMoved && _dirty.find(_root->fpos) == _dirty.end())
+			{
+				rootPos = _root->fpos;
+				_rootMoved = false;
+			}
+			flushGuard.lock();
+			std::lock_guard<std::mutex> inFlightGuard(_inFlightLock);
+			_inFlight.swap(batch);
+		}
+
+		bool ret = true;
+		std::map<long, std::vector<byte> >::iterator fit = _inFlight.begin();
+		for ( ; fit != _inFlight.end(); ++fit)
+		{
+			ret = _store->write(fit->first, &fit->second[0]) && ret;
+		}
+		if (rootPos != -1)
+		{
+			ret = _store->writeAt(0, &rootPos, sizeof(rootPos)) && ret;
+		}
+		if (checkpoint)
+		{
+			ret = _store->flush() && ret;
+		}
+		std::lock_guard<std::mutex> inFlightGuard(_inFlightLock);
+		_inFlight.clear();
+		return ret;
+	}
+
+	// The background flusher. It looks for old pages a few times in each
+	// dirty age, or sooner if woken because too much is dirty, and makes
+	// a checkpoint every so often. With lazy deletes, it tops up the
+	// leaves that are short first, so that their pages go out with the
+	// rest.
+	void BTreeDB::_flushLoop()
+	{
+		CLOCK::time_point lastCheckpoint = CLOCK::now();
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> guard(_wakeLock);
+				if (!_stopping)
+				{
+					_flushWake.wait_for(guard, std::chrono::milliseconds(_maxDirtyAge / 4 + 1));
+				}
+				if (_stopping)
+				{
+					return;
+				}
+			}
+			bool checkpoint = (CLOCK::now() - lastCheckpoint >= std::chrono::milliseconds(_checkpointInterval));
+			if (_lazyPending != 0)
+			{
+				rebalance();
+			}
+			_writeBack(false, checkpoint);
+			if (checkpoint)
+			{
+				lastCheckpoint = CLOCK::now();
+			}
+		}
+	}
+
+	void BTreeDB::_stopFlusher()
+	{
+		if (_flusher.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> guard(_wakeLock);
+				_stopping = true;
+			}
+			_flushWake.notify_one();
+			_flusher.join();
+		}
+	}
+
+	// A checksum for the commit slots, so that a slot that was only
+	// partly written can be told from a good one.
+	static unsigned int _checksum(const void* data, size_t size)
+	{
+		const unsigned char* p = (const unsigned char*)data;
+		unsigned int h = 2166136261U;
+		for (size_t ctr = 0; ctr < size; ctr++)
+		{
+			h ^= p[ctr];
+			h *= 16777619U;
+		}
+		return h;
+	}
+
+	// Find a page for a new node. A copy-on-write file uses a free page
+	// if it has one, and remembers that the page is new since the last
+	// commit, so it can be written over until the next one.
+	long BTreeDB::_allocatePage()
+	{
+		if (!_copyOnWrite)
+		{
+			return _store->allocate();
+		}
+		long pageId = -1;
+		if (_freePages.empty())
+		{
+			_reclaimPages();
+		}
+		if (!_freePages.empty())
+		{
+			pageId = _freePages.back();
+			_freePages.pop_back();
+		}
+		else
+		{
+			pageId = _store->allocate();
+		}
+		_fresh.insert(pageId);
+		return pageId;
+	}
+
+	// A page has dropped out of the tree. In a copy-on-write file, a page
+	// that the last commit uses is only free once the next commit is on
+	// the disk, but one that is new since then is free straight away.
+	void BTreeDB::_freePage(long pageId)
+	{
+		if (!_copyOnWrite)
+		{
+			return;
+		}
+		_dirty.erase(pageId);
+		if (_fresh.erase(pageId) != 0)
+		{
+			_freePages.push_back(pageId);
+		}
+		else
+		{
+			_pendingFree.push_back(pageId);
+		}
+	}
+
+	// Make everything since the last commit permanent. Each changed node,
+	// and every node above it (as the positions of their children have
+	// changed), is written to a page that the last commit doesn't use.
+	// Then the free list is written, the file and the value log are
+	// synced, and the commit slot that the last commit didn't use is
+	// written to point at the new root. Until that slot is on the disk,
+	// the last commit is untouched. The Bloom filter and hash index are
+	// only saved by flush() and close(), stamped with the commit they go
+	// with, and open() builds them again if they were saved at any other.
+	// Without copy-on-write, this is just a flush().
+	bool BTreeDB::commit()
+	{
+		SChangeGuard guard(this);
+		if (!_copyOnWrite)
+		{
+			return flush();
+		}
+		_drainMessages();
+		std::lock_guard<std::mutex> flushGuard(_flushLock);
+		if (_dirty.empty() && !_rootMoved && _pendingFree.empty())
+		{
+			return true;
+		}
+
+		std::vector<TreeNodePtr> moving;
+		std::set<TreeNode*> seen;
+		for (DIRTYMAP::iterator dit = _dirty.begin(); dit != _dirty.end(); ++dit)
+		{
+			for (TreeNode* node = dit->second.node; node != 0 && seen.insert(node).second; node = node->parent)
+			{
+				if (node->loaded)
+				{
+					moving.push_back(node);
+				}
+			}
+		}
+		_dirty.clear();
+		for (size_t ctr = 0; ctr < moving.size(); ctr++)
+		{
+			TreeNodePtr& node = moving[ctr];
+			if (_fresh.find(node->fpos) == _fresh.end())
+			{
+				_pendingFree.push_back(node->fpos);
+				node->fpos = _allocatePage();
+			}
+		}
+
+		// The children have all moved before any of the parents are
+		// written, as writing a node brings its child positions up to date.
+		bool ret = true;
+		for (size_t ctr = 0; ctr < moving.size(); ctr++)
+		{
+			ret = moving[ctr]->write(_store) && ret;
+			_indexRecords(moving[ctr], 0, moving[ctr]->objCount);
+		}
+
+		// The free list is everything that will be free once this commit
+		// is on the disk, including the pages of the last free list. It is
+		// kept in a chain of pages (taken from the free pages themselves),
+		// each with the next page's position and a count ahead of the ids.
+		size_t perPage = (_layout.pageSize - sizeof(long) - sizeof(size_t)) / sizeof(long);
+		size_t total = _freePages.size() + _retired.size() + _pendingFree.size() + _listPages.size();
+		std::vector<long> listPages;
+		while (listPages.size() < (total + perPage - 1) / perPage)
 		{
-			TreeNodePtr pChild = _root->children[ctr];
-			if ((TreeNode*)pChild != 0)
+			if (!_freePages.empty())
 			{
-				_root->children[ctr]->unload();
+				listPages.push_back(_freePages.back());
+				_freePages.pop_back();
 			}
+			else
+			{
+				listPages.push_back(_store->allocate());
+			}
+		}
+		std::vector<long> freeList(_freePages);
+		for (size_t ctr = 0; ctr < _retired.size(); ctr++)
+		{
+			freeList.push_back(_retired[ctr].second);
+		}
+		freeList.insert(freeList.end(), _pendingFree.begin(), _pendingFree.end());
+		freeList.insert(freeList.end(), _listPages.begin(), _listPages.end());
+		std::vector<byte> page(_layout.pageSize);
+		for (size_t ctr = 0; ret && ctr < listPages.size(); ctr++)
+		{
+			long next = (ctr + 1 < listPages.size()) ? listPages[ctr + 1] : -1;
+			size_t first = ctr * perPage;
+			size_t count = (freeList.size() - first < perPage) ? freeList.size() - first : perPage;
+			memset(&page[0], 0, page.size());
+			memcpy(&page[0], &next, sizeof(next));
+			memcpy(&page[sizeof(long)], &count, sizeof(count));
+			memcpy(&page[sizeof(long) + sizeof(size_t)], &freeList[first], count * sizeof(long));
+			ret = _store->write(listPages[ctr], &page[0]);
+		}
+		if ((ValueLog*)_valueLog != 0)
+		{
+			ret = ret && _valueLog->sync();
+		}
+		ret = ret && _store->sync();
+
+		SCommitSlot slot;
+		memset(&slot, 0, sizeof(slot));
+		slot.txnId = _txnId + 1;
+		slot.rootPos = _root->fpos;
+		slot.freePos = listPages.empty() ? -1 : listPages[0];
+		slot.freeCount = freeList.size();
+		slot.valueGen = _valueGen;
+		slot.checksum = _checksum(&slot, sizeof(slot));
+		long slotPos = (long)(sizeof(SFileHeader) + (slot.txnId % 2) * sizeof(SCommitSlot));
+		ret = ret && _store->writeAt(slotPos, &slot, sizeof(slot)) && _store->sync();
+		if (ret)
+		{
+			_txnId = slot.txnId;
+			_freePages.insert(_freePages.end(), _listPages.begin(), _listPages.end());
+			for (size_t ctr = 0; ctr < _pendingFree.size(); ctr++)
+			{
+				_retired.push_back(std::make_pair(_txnId, _pendingFree[ctr]));
+			}
+			_listPages.swap(listPages);
+			_pendingFree.clear();
+			_fresh.clear();
+			_rootMoved = false;
+			_reclaimPages();
 		}
 		return ret;
 	}
-}
\ No newline at end of file
+
+	// Put the retired pages that no open snapshot can read back on the
+	// free list. A page let go of by a commit is only read by snapshots
+	// of earlier commits.
+	void BTreeDB::_reclaimPages()
+	{
+		std::lock_guard<std::mutex> snapshotGuard(_snapshotLock);
+		while (!_retired.empty() && (_snapshots.empty() || _retired.front().first <= *_snapshots.begin()))
+		{
+			_freePages.push_back(_retired.front().second);
+			_retired.pop_front();
+		}
+	}
+
+	// Commit, and open a snapshot of the tree as it is now. Only a
+	// copy-on-write tree has snapshots; otherwise this gives back null,
+	// as it does if the commit fails.
+	SnapshotPtr BTreeDB::beginSnapshot()
+	{
+		TREEGUARD guard(_treeLock);
+		if (!_copyOnWrite || _dataFile == 0 || !commit())
+		{
+			return (Snapshot*)0;
+		}
+		{
+			std::lock_guard<std::mutex> snapshotGuard(_snapshotLock);
+			_snapshots.insert(_txnId);
+		}
+		SnapshotPtr snapshot = new Snapshot(this, _txnId, _root->fpos);
+		if ((TreeNode*)snapshot->_root == 0)
+		{
+			return (Snapshot*)0;
+		}
+		return snapshot;
+	}
+
+	// A snapshot has been let go of. Its pages are reclaimed by the
+	// next commit or allocation that wants them, under the tree's lock.
+	void BTreeDB::_endSnapshot(unsigned long long txnId)
+	{
+		std::lock_guard<std::mutex> snapshotGuard(_snapshotLock);
+		std::multiset<unsigned long long>::iterator it = _snapshots.find(txnId);
+		if (it != _snapshots.end())
+		{
+			_snapshots.erase(it);
+		}
+	}
+
+	// Find the last good commit in a copy-on-write file, and load its
+	// free list.
+	bool BTreeDB::_loadCommit(long& rootPos)
+	{
+		SCommitSlot slots[2];
+		fseek(_dataFile, sizeof(SFileHeader), SEEK_SET);
+		if (1 != fread(slots, sizeof(slots), 1, _dataFile))
+		{
+			return false;
+		}
+		SCommitSlot* best = 0;
+		for (size_t ctr = 0; ctr < 2; ctr++)
+		{
+			unsigned int checksum = slots[ctr].checksum;
+			slots[ctr].checksum = 0;
+			if (slots[ctr].txnId != 0 && checksum == _checksum(&slots[ctr], sizeof(SCommitSlot)) && (best == 0 || slots[ctr].txnId > best->txnId))
+			{
+				best = &slots[ctr];
+			}
+		}
+		if (best == 0)
+		{
+			return false;
+		}
+
+		_txnId = best->txnId;
+		_valueGen = best->valueGen;
+		rootPos = best->rootPos;
+		_freePages.clear();
+		_listPages.clear();
+		_retired.clear();
+		std::vector<byte> page(_layout.pageSize);
+		for (long pos = best->freePos; pos != -1; )
+		{
+			size_t count = 0;
+			if (!_store->read(pos, &page[0]))
+			{
+				return false;
+			}
+			_listPages.push_back(pos);
+			memcpy(&count, &page[sizeof(long)], sizeof(count));
+			const long* ids = (const long*)&page[sizeof(long) + sizeof(size_t)];
+			_freePages.insert(_freePages.end(), ids, ids + count);
+			memcpy(&pos, &page[0], sizeof(pos));
+		}
+		return _freePages.size() == best->freeCount;
+	}
+
+	// Latch a node that is about to change, if there are optimistic
+	// readers to keep out of it, until the change is done.
+	void BTreeDB::_latch(const TreeNodePtr& node)
+	{
+		if (_optimistic && !node->isLatched())
+		{
+			node->latch();
+			_latched.push_back(node);
+		}
+	}
+
+	// A change is done: take the latches off, and let go of whatever
+	// no reader can be looking at any more.
+	void BTreeDB::_unlatch()
+	{
+		for (size_t ctr = 0; ctr < _latched.size(); ctr++)
+		{
+			_latched[ctr]->unlatch();
+		}
+		_latched.clear();
+		if (!_retiredNodes.empty())
+		{
+			_reclaimNodes();
+		}
+	}
+
+	// A node has dropped out of the tree. A reader that started before
+	// now may still be in it, so it is kept until they have all finished.
+	void BTreeDB::_retire(const TreeNodePtr& node)
+	{
+		SRetiredNode retired = { _epoch.fetch_add(1), node, ValueLogPtr() };
+		_retiredNodes.push_back(retired);
+	}
+
+	// The same, for a value log that has been collected.
+	void BTreeDB::_retire(const ValueLogPtr& log)
+	{
+		if (_optimistic)
+		{
+			SRetiredNode retired = { _epoch.fetch_add(1), TreeNodePtr(), log };
+			_retiredNodes.push_back(retired);
+		}
+	}
+
+	// Unswizzle a loaded child, as if it had never been visited, so
+	// that its subtree can be let go of without pulling it out from
+	// under a reader.
+	void BTreeDB::_dropChild(TreeNodePtr& parent, size_t childNo)
+	{
+		TreeNodePtr child = parent->children[childNo].node();
+		_latch(parent);
+		parent->children[childNo].unswizzle(child->fpos);
+		_retire(child);
+	}
+
+	// Let go of the retired nodes that every reader in a slot started
+	// after. A node is unloaded first (parents and children point at
+	// each other) unless the flusher still has to write it.
+	void BTreeDB::_reclaimNodes()
+	{
+		unsigned long long oldest = _epoch.load();
+		for (size_t ctr = 0; ctr < READER_SLOTS; ctr++)
+		{
+			unsigned long long epoch = _readers[ctr].epoch.load();
+			if (epoch != 0 && epoch < oldest)
+			{
+				oldest = epoch;
+			}
+		}
+		while (!_retiredNodes.empty() && _retiredNodes.front().epoch < oldest)
+		{
+			TreeNodePtr node = _retiredNodes.front().node;
+			if ((TreeNode*)node != 0 && _dirty.find(node->fpos) == _dirty.end())
+			{
+				node->unload();
+			}
+			_retiredNodes.pop_front();
+		}
+	}
+
+	// Note the epoch a reader starts in, in the first free slot from
+	// one picked by its thread, so that readers on different threads
+	// don't usually share a cache line. Gives back the slot, or -1 if
+	// every slot is in use.
+	size_t BTreeDB::_enterEpoch()
+	{
+		size_t first = std::hash<std::thread::id>()(std::this_thread::get_id());
+		for (size_t ctr = 0; ctr < READER_SLOTS; ctr++)
+		{
+			size_t slotNo = (first + ctr) % READER_SLOTS;
+			unsigned long long idle = 0;
+			if (_readers[slotNo].epoch.load(std::memory_order_relaxed) == 0 && _readers[slotNo].epoch.compare_exchange_strong(idle, _epoch.load()))
+			{
+				return slotNo;
+			}
+		}
+		return (size_t)-1;
+	}
+
+	void BTreeDB::_leaveEpoch(size_t slotNo)
+	{
+		_readers[slotNo].epoch.store(0, std::memory_order_release);
+	}
+}
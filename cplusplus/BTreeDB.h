@@ -5,14 +5,26 @@
 
 #include "DbObj.h"
 #include "TreeNode.h"
+#include "ValueLog.h"
+#include "BloomFilter.h"
+#include "HashIndex.h"
+#include "RecordCache.h"
+#include "ThreadPool.h"
+#include "Snapshot.h"
 #include"stdafx.h"
 
 namespace Database
 {
 	class BTreeDB : public Database::RefCount
 	{
+		friend class BulkLoader;
+		friend class Snapshot;
+		friend class FrozenTable;
+		friend class MemTable;
+
 	public:
 		typedef bool (*traverseCallback)(const DbObjPtr&, const DbObjPtr&, int depth);
+		typedef bool (*scanCallback)(const DbObjPtr& rec, void* context);
 		enum ESeqPos
 		{
 			ESP_START = 0,	// start iterating through the entire tree
@@ -30,41 +42,265 @@ namespace Database
 		~BTreeDB(void);
 
 	private:
-		size_t _recSize;		// size of the records to be stored
-		size_t _keySize;		// number of bytes that comprise the key
+		size_t _recSize;		// size of the largest record to be stored
+		size_t _keySize;		// number of bytes that comprise the key (0 if records say)
 		std::string _fileName;		// name of the database file
 		compareFn _compFunc;
 		size_t _minDegree;
 		TreeNodePtr _root;
 		FILE* _dataFile;
 		size_t _nodeSize;
+		NodeLayout _layout;		// where things live in a node's page
+		size_t _valueThreshold;		// payloads bigger than this go in the value log (0 for none)
+		ValueLogPtr _valueLog;
+		unsigned long long _valueGen;	// the generation of the value log the tree points into
+		bool _compressPages;		// whether pages are compressed on the disk
+		PageStorePtr _store;		// reads, writes and allocates the pages
+		size_t _bloomKeys;		// keys the Bloom filter is sized for (0 for none)
+		BloomFilterPtr _bloom;
+		bool _useHashIndex;		// whether exact keys are looked up through a hash index
+		HashIndexPtr _hashIndex;
+		RecordCachePtr _cache;		// recently read records, or null
+		bool _countRecords;		// whether nodes keep the number of records under each child
+		size_t _scanThreads;		// threads for parallel scans (0 for one per core)
+		ThreadPoolPtr _pool;
+
+		// With the background flusher, changed nodes are only marked dirty,
+		// and a thread of our own writes them out later.
+		size_t _dirtyPercent;		// write everything once this much of the file is dirty (0 for no flusher)
+		unsigned _maxDirtyAge;		// otherwise write pages dirty for this many milliseconds
+		unsigned _checkpointInterval;	// milliseconds between checkpoints
+		std::recursive_mutex _treeLock;	// held by every operation on the tree
+		std::mutex _flushLock;		// held while pages are being written out
+		std::thread _flusher;
+		std::mutex _wakeLock;
+		std::condition_variable _flushWake;
+		bool _stopping;
+		bool _rootMoved;		// the root's position needs writing
+		std::map<long, std::vector<byte> > _inFlight;	// pages on their way to the disk
+		std::mutex _inFlightLock;
+
+		// In a copy-on-write file, changed nodes are moved to new pages
+		// when they are committed, and pages are only used again once
+		// the commit that let go of them is on the disk.
+		bool _copyOnWrite;
+		unsigned long long _txnId;	// the last commit
+		std::vector<long> _freePages;	// free as of the last commit
+		std::vector<long> _pendingFree;	// let go of since the last commit
+		std::vector<long> _listPages;	// pages holding the last commit's free list
+		std::set<long> _fresh;		// pages first used since the last commit
+
+		// Pages let go of by a commit may still be read by snapshots of
+		// earlier commits, so they are retired, with the id of the commit
+		// that let go of them, and only go back on the free list once
+		// every snapshot open is of that commit or a later one.
+		std::deque<std::pair<unsigned long long, long> > _retired;
+		std::multiset<unsigned long long> _snapshots;	// the commit each open snapshot reads
+		std::mutex _snapshotLock;
+
+		// With optimistic reads, get() doesn't take the tree's lock: it
+		// goes down the tree checking the versions of the nodes instead
+		// (see TreeNode::readVersion), and each change latches the nodes
+		// it changes until it is done. As readers hold no lock, a node that
+		// drops out of the tree is retired, not let go of, until every
+		// reader that might still be in it has finished. Each reader notes
+		// the epoch it started in, in a slot of its own.
+		static const size_t READER_SLOTS = 64;
+		struct SReaderSlot
+		{
+			std::atomic<unsigned long long> epoch;	// 0 when not in use
+			byte pad[56];		// one slot to a cache line
+		};
+		struct SRetiredNode
+		{
+			unsigned long long epoch;
+			TreeNodePtr node;
+			ValueLogPtr log;
+		};
+		bool _optimistic;
+		std::atomic<TreeNode*> _rootNode;	// the root, for readers without the lock
+		std::vector<TreeNodePtr> _latched;	// latched by the change being made
+		std::atomic<unsigned long long> _epoch;
+		SReaderSlot _readers[READER_SLOTS];
+		std::deque<SRetiredNode> _retiredNodes;
+
+		// With message buffers, a put or del is only left in the root's
+		// buffer, and the messages go down the tree a batch at a time as
+		// the buffers fill, so that one read of a child serves many of
+		// them. Messages higher up the tree are always newer than those
+		// below, and than the records they are above.
+		size_t _bufferSize;		// bytes of messages a node holds before some go down (0 for none)
+		size_t _messageCount;		// messages in all of the buffers
+
+		// While a MemTable merges into the tree, changed nodes are only
+		// marked dirty, and written once for each batch it puts.
+		bool _batching;
+
+		// With lazy deletes, a del goes down into a leaf that is short of
+		// records without topping it up first. The leaves it leaves short
+		// are remembered, with a key in each, and topped up together later
+		// (see rebalance).
+		size_t _lazyPending;		// short leaves that start a rebalance (0 for eager deletes)
+		size_t _lazyFill;		// percent of a page that a leaf can drop to
+		std::map<long, DbObjPtr> _shortLeaves;	// by page id
 
 	private:
+		typedef std::lock_guard<std::recursive_mutex> TREEGUARD;
+
+		// Takes the tree's lock for a change, and takes the latches off
+		// the nodes that the change latched once it is done.
+		struct SChangeGuard
+		{
+			SChangeGuard(BTreeDB* db) : _db(db), _guard(db->_treeLock) {}
+			~SChangeGuard() { _db->_unlatch(); }
+			BTreeDB* _db;
+			TREEGUARD _guard;
+		};
+		typedef std::chrono::steady_clock CLOCK;
+		struct SDirtyPage
+		{
+			TreeNodePtr node;
+			CLOCK::time_point since;
+		};
+		typedef std::map<long, SDirtyPage> DIRTYMAP;
+		DIRTYMAP _dirty;		// nodes not written since they changed, by page id
+
 		struct SFileHeader
 		{
 			long rootPos;
 			size_t recSize;
 			size_t keySize;
 			size_t minDegree;
+			size_t pageSize;
+			size_t valueThreshold;
+			size_t compressed;
+			size_t bloomKeys;
+			size_t hashIndex;
+			size_t counted;
+			size_t shadowed;
+			unsigned long long valueGen;	// the value log the tree points into
+		};
+
+		// Two of these follow the file header in a copy-on-write file. A
+		// commit writes the one that the commit before didn't, so that
+		// one of them is always whole; the good one with the higher
+		// transaction id is the one that counts.
+		struct SCommitSlot
+		{
+			unsigned long long txnId;
+			long rootPos;
+			long freePos;		// first page of the free list, or -1
+			size_t freeCount;
+			unsigned long long valueGen;	// the value log the commit points into
+			unsigned int checksum;
+		};
+
+		// One piece of a parallel scan: either a subtree, which is read by
+		// one of the pool's threads, or a single record from above the
+		// subtrees. In an ordered scan the records of a subtree are queued
+		// here until the calling thread gets to them.
+		struct SScanPart
+		{
+			long pageId;		// root of the subtree, or -1 for a single record
+			DbObjPtr rec;
+			std::deque<DbObjPtr> records;
+			bool done;
+			bool failed;
+			std::mutex lock;
+			std::condition_variable ready;
+		};
+		struct SScanState
+		{
+			BTreeDB* db;
+			scanCallback cbfn;
+			void* context;
+			bool ordered;
+			std::atomic<bool> stop;
+		};
+		struct SScanTask
+		{
+			SScanState* state;
+			SScanPart* part;
 		};
 
 	private:	// internal data manipulation functions (see Cormen, Leiserson, Rivest).
-		static int _defaultCompare(const DbObjPtr& obj1, const DbObjPtr& obj2);
-		static int _searchCompare(const DbObjPtr& obj1, const DbObjPtr& obj2);
+		static int _defaultCompare(const void* key1, size_t size1, const void* key2, size_t size2);
+		static int _searchCompare(const void* key1, size_t size1, const void* key2, size_t size2);
 		static bool _searchCallback(const DbObjPtr& obj, const DbObjPtr& ref, int depth);
 		TreeNodePtr _allocateNode();
 		void _split(TreeNodePtr& parent, size_t childNum, TreeNodePtr& child);
 		TreeNodePtr _merge(TreeNodePtr& parent, size_t objNo);
-		void _insert(const DbObjPtr& key);
-		void _insertNonFull(TreeNodePtr& node, const DbObjPtr& key);
+		void _insert(const DbObjPtr& key, unsigned short flags = 0);
+		void _insertNonFull(TreeNodePtr& node, const DbObjPtr& key, unsigned short flags);
 		void _traverse(const TreeNodePtr& node, const DbObjPtr& ref, traverseCallback cbfn, int depth=0);
-		NodeKeyLocn _search(const TreeNodePtr& node, const DbObjPtr& key, compareFn cfn = 0);
+		NodeKeyLocn _search(const TreeNodePtr& start, const DbObjPtr& key, compareFn cfn = 0);
 		bool _seqNext(NodeKeyLocn& locn, DbObjPtr& rec);
 		bool _seqPrev(NodeKeyLocn& locn, DbObjPtr& rec);
-		bool _flush(TreeNodePtr& node, FILE* f);
+		bool _flush(TreeNodePtr& node, PageStore* store);
 		bool _delete(TreeNodePtr& node, const DbObjPtr& key);
+		void _lend(TreeNodePtr& node, size_t childNo, bool fromLeft);
 		NodeKeyLocn _findPred(TreeNodePtr& node);
 		NodeKeyLocn _findSucc(TreeNodePtr& node);
+		DbObjPtr _getRecord(const TreeNodePtr& node, size_t objNo);
+		void _releaseValue(const TreeNodePtr& node, size_t objNo);
+		bool _collect(TreeNodePtr& node, ValueLogPtr& newLog);
+		bool _openValueLog();
+		void _addKeys(TreeNodePtr& node);
+		void _rebuildFilter();
+		void _indexRecords(const TreeNodePtr& node, size_t objNo, size_t count);
+		void _indexSubtree(TreeNodePtr& node);
+		bool _getIndexed(const DbObjPtr& key, DbObjPtr& rec);
+		bool _recount(TreeNodePtr& node);
+		static void _scanTask(void* arg);
+		bool _scanPages(PageReader& reader, long pageId, SScanState& state, SScanPart& part);
+		void _scanRecord(SScanState& state, SScanPart& part, DbObjPtr& rec);
+		bool _write(const TreeNodePtr& node);
+		void _writeRoot();
+		bool _writeBack(bool all, bool checkpoint);
+		void _flushLoop();
+		void _stopFlusher();
+		long _allocatePage();
+		void _freePage(long pageId);
+		bool _loadCommit(long& rootPos);
+		void _reclaimPages();
+		void _endSnapshot(unsigned long long txnId);
+		bool _collectDue();
+		void _latch(const TreeNodePtr& node);
+		void _unlatch();
+		void _retire(const TreeNodePtr& node);
+		void _retire(const ValueLogPtr& log);
+		void _dropChild(TreeNodePtr& parent, size_t childNo);
+		void _reclaimNodes();
+		size_t _enterEpoch();
+		void _leaveEpoch(size_t slotNo);
+		bool _getOptimistic(const DbObjPtr& key, DbObjPtr& rec, bool& found);
+		bool _readOptimistic(TreeNode* node, size_t objNo, unsigned long long v, DbObjPtr& rec);
+		bool _checkRecord(const DbObjPtr& rec, size_t& keySize, bool& outOfLine);
+		bool _put(const DbObjPtr& rec);
+		bool _del(const DbObjPtr& key);
+		void _shrinkRoot();
+		void _cutRange(TreeNodePtr& node, const DbObjPtr& lo, const DbObjPtr& hi, bool loIn, bool hiIn, size_t level, DBOBJVECTOR& separators);
+		void _cutChild(TreeNodePtr& parent, size_t childNo, size_t level);
+		void _dropSubtree(TreeNodePtr& node, size_t level);
+		void _forgetRecords(const TreeNodePtr& node, size_t objNo, size_t count);
+		TreeNodePtr _topUp(TreeNodePtr& node, size_t childNo);
+		bool _repair(TreeNodePtr& node, const DbObjPtr& key, bool high);
+		bool _canDelete(const TreeNodePtr& node);
+		bool _rebalanceDue();
+		std::string _nodeKey(const TreeNodePtr& node, size_t objNo);
+		void _addMessage(TreeNode* node, const std::string& key, const DbObjPtr& rec, bool newer);
+		void _dropMessage(TreeNode* node, MESSAGEMAP::iterator it);
+		void _takeMessage(TreeNode* node, MESSAGEMAP::iterator it, MESSAGEMAP& into);
+		void _moveMessage(TreeNode* from, MESSAGEMAP::iterator it, TreeNode* to, bool newer);
+		void _splitMessages(TreeNodePtr& parent, size_t objNo, TreeNodePtr& child, TreeNodePtr& newChild);
+		void _lendMessages(TreeNodePtr& parent, size_t objNo, TreeNodePtr& sibling, TreeNodePtr& child, bool fromLeft);
+		void _liftMessages(TreeNodePtr& node, size_t objNo, size_t childNo);
+		void _flushMessages(TreeNodePtr& node);
+		void _applyMessages(MESSAGEMAP& batch);
+		void _takeAllMessages(TreeNode* node, MESSAGEMAP& into);
+		void _drainMessages();
+		bool _writeBatch();
+		bool _getBuffered(const DbObjPtr& key, DbObjPtr& rec);
 
 		
 	public:
@@ -72,14 +308,120 @@ namespace Database
 
 		bool open();
 		bool del(const DbObjPtr& key);
+		bool deleteRange(const DbObjPtr& lo, const DbObjPtr& hi);
+		bool truncate();
 		bool put(const DbObjPtr& rec);
+		bool put(const DbObjPtr& key, const DbObjPtr& value);
 		bool get(const NodeKeyLocn& locn, DbObjPtr& rec);
 		bool get(const DbObjPtr& key, DbObjPtr& rec);
 		void traverse(const DbObjPtr& ref = 0, traverseCallback cbfn = 0);
+		bool parallelScan(scanCallback cbfn, void* context = 0, bool ordered = false);
 		void findAll(const DbObjPtr& key, DBOBJVECTOR& results);
 		NodeKeyLocn search(const DbObjPtr& key, compareFn cfn = 0);
 		bool seq(NodeKeyLocn& locn, DbObjPtr& rec, ESeqDirection sdir = ESD_FORWARD);
+		size_t count();
+		size_t count(const DbObjPtr& lo, const DbObjPtr& hi);
+		size_t rank(const DbObjPtr& key);
+		NodeKeyLocn select(size_t index);
 		bool flush();
+		bool checkpoint();
+		bool commit();
+		bool collectValues();
+		bool rebalance();
+		SnapshotPtr beginSnapshot();
+
+		// Payloads bigger than this many bytes are kept in a separate
+		// value log. Must be set before open() creates the database.
+		void setValueThreshold(size_t bytes) { _valueThreshold = bytes; }
+
+		// Compress each page as it is written. Must be set before
+		// open() creates the database.
+		void setCompression(bool compress) { _compressPages = compress; }
+		const SPageStats& getPageStats() const { return _store->getStats(); }
+
+		// Keep a Bloom filter of the keys, sized for this many to start
+		// with, so that gets for missing keys rarely read any pages.
+		// Must be set before open() creates the database.
+		void setBloomFilter(size_t expectedKeys) { _bloomKeys = expectedKeys; }
+
+		// Keep a hash index from keys to the pages they are in, so that
+		// a get usually reads one page. Ordered scans still use the tree.
+		// Must be set before open() creates the database.
+		void setHashIndex(bool useIndex) { _useHashIndex = useIndex; }
+
+		// Cache up to this many records in memory (0 for no cache). Only
+		// used with the default comparator, where equal keys have the
+		// same bytes.
+		void setRecordCache(size_t records) { _cache = records ? new RecordCache(records) : (RecordCache*)0; }
+		const RecordCachePtr& getRecordCache() const { return _cache; }
+
+		// Keep the number of records under each child in the internal
+		// nodes, so that count(), rank() and select() take one walk
+		// down the tree. Must be set before open() creates the database.
+		void setRecordCounts(bool countRecords) { _countRecords = countRecords; }
+
+		// The number of threads that parallelScan() uses (0 for one
+		// per core).
+		void setScanThreads(size_t threads) { _scanThreads = threads; _pool = (ThreadPool*)0; }
+
+		// Never write over a page that the last commit uses: changed nodes
+		// go to new pages, and commit() switches to them all at once. A
+		// crash leaves the tree as it was at the last commit. Pages aren't
+		// compressed. Must be set before open() creates the database.
+		void setCopyOnWrite(bool shadow) { _copyOnWrite = shadow; }
+
+		// Let get() look keys up without locking the tree, so that gets
+		// on many threads don't queue up behind each other or a put. A
+		// get that finds a node that isn't loaded yet, or that keeps
+		// meeting changes, takes the lock after all. Lookups this way
+		// don't go through the record cache, Bloom filter or hash index,
+		// and only the default comparator is supported. Nodes that drop
+		// out of the tree are kept in memory until no get can be using
+		// them. Must be set before open().
+		void setOptimisticReads(bool optimistic) { _optimistic = optimistic; }
+
+		// Write-optimized mode, as in a B-epsilon tree: each node keeps a
+		// buffer of up to this many bytes of puts and dels that haven't
+		// got to where their records are yet. A put or del goes in the
+		// root's buffer; when a buffer fills, the messages for the child
+		// that has the most of them go down to it together, so random
+		// puts read and write a leaf once per batch instead of once each
+		// (the nodes a batch changes are written when it is done). A get
+		// looks in the buffers on its way down. Anything that walks the
+		// records (seq, search, counts, scans, flush and commit) first
+		// sends every message all the way down. A del can't tell whether
+		// the key was there, so it always succeeds. Buffers are only kept
+		// in memory, and only with the default comparator; gets don't use
+		// the hash index, and reads aren't optimistic. Must be set before
+		// open(); 0 turns them off.
+		void setMessageBuffers(size_t bytes) { _bufferSize = bytes; }
+
+		// Lazy deletes: a del goes down into a leaf without first topping
+		// it up from a sibling (or merging it with one), which reads and
+		// writes up to three nodes, as long as the leaf keeps minFillPercent
+		// of a page and has a record to spare. Leaves that are left short
+		// are remembered, and rebalance() tops them up together; it runs
+		// once maxPending of them are waiting, and with the background
+		// flusher, each time the flusher wakes. Leaves still short when the
+		// tree is closed are left as they are, and are topped up by dels
+		// as usual. 0 turns lazy deletes off.
+		void setLazyDeletes(size_t maxPending, size_t minFillPercent = 0)
+		{
+			_lazyPending = maxPending;
+			_lazyFill = minFillPercent;
+		}
+
+		// Write changed pages on a background thread instead of as they
+		// change. Pages are written once they have been dirty for maxAgeMs,
+		// or all at once if more than dirtyPercent of the file is dirty,
+		// and there is a checkpoint every checkpointMs. Must be set before
+		// open(); 0 turns the flusher off.
+		void setBackgroundFlush(size_t dirtyPercent, unsigned maxAgeMs = 1000, unsigned checkpointMs = 10000)
+		{
+			_dirtyPercent = dirtyPercent;
+			_maxDirtyAge = maxAgeMs;
+			_checkpointInterval = checkpointMs;
+		}
 
 		size_t getRecSize() const { return _recSize; }
 		size_t getKeySize() const { return _keySize; }
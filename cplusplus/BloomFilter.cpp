@@ -0,0 +1,124 @@
+
+
+#include "stdafx.h"
+#include "bloomfilter.h"
+
+namespace Database
+{
+	// About ten bits and seven hashes per key gives a false positive
+	// rate of around one percent.
+	static const size_t BITS_PER_KEY = 10;
+	static const size_t HASHES = 7;
+
+	BloomFilter::BloomFilter(const std::string& fileName)
+		: _fileName(fileName)
+	{
+		init(1);
+	}
+
+	BloomFilter::~BloomFilter()
+	{
+	}
+
+	// Start an empty filter sized for the number of keys given.
+	void BloomFilter::init(size_t capacity)
+	{
+		_header.capacity = capacity ? capacity : 1;
+		_header.bits = (_header.capacity * BITS_PER_KEY + 7) & ~(size_t)7;
+		_header.hashes = HASHES;
+		_header.added = 0;
+		_header.deleted = 0;
+		_header.stamp = 0;
+		_bits.assign(_header.bits / 8, 0);
+	}
+
+	// Read the filter in from its file, as long as it was saved at the
+	// commit given.
+	bool BloomFilter::load(unsigned long long stamp)
+	{
+		FILE* f = fopen(_fileName.c_str(), "rb");
+		if (0 == f)
+		{
+			return false;
+		}
+		bool ret = (1 == fread(&_header, sizeof(_header), 1, f)) && (_header.stamp == stamp);
+		if (ret)
+		{
+			_bits.resize(_header.bits / 8);
+			ret = _bits.empty() || (1 == fread(&_bits[0], _bits.size(), 1, f));
+		}
+		fclose(f);
+		return ret;
+	}
+
+	// Write the filter out to its file, stamped with the commit given.
+	bool BloomFilter::save(unsigned long long stamp)
+	{
+		_header.stamp = stamp;
+		FILE* f = fopen(_fileName.c_str(), "wb");
+		if (0 == f)
+		{
+			return false;
+		}
+		bool ret = (1 == fwrite(&_header, sizeof(_header), 1, f));
+		ret = ret && (_bits.empty() || 1 == fwrite(&_bits[0], _bits.size(), 1, f));
+		return (0 == fclose(f)) && ret;
+	}
+
+	// Two independent hashes of the key (64 bit FNV-1a, and the same
+	// again with the bits stirred), which are combined to give the
+	// positions of the bits for the key.
+	void BloomFilter::_hash(const void* key, size_t size, size_t& h1, size_t& h2)
+	{
+		const unsigned char* p = (const unsigned char*)key;
+		unsigned long long h = 14695981039346656037ULL;
+		for (size_t ctr = 0; ctr < size; ctr++)
+		{
+			h ^= p[ctr];
+			h *= 1099511628211ULL;
+		}
+		unsigned long long g = h;
+		g ^= g >> 33;
+		g *= 0xff51afd7ed558ccdULL;
+		g ^= g >> 33;
+		h1 = (size_t)h;
+		h2 = (size_t)(g | 1);
+	}
+
+	void BloomFilter::add(const void* key, size_t size)
+	{
+		size_t h1 = 0;
+		size_t h2 = 0;
+		_hash(key, size, h1, h2);
+		for (size_t ctr = 0; ctr < _header.hashes; ctr++)
+		{
+			size_t bit = (h1 + ctr * h2) % _header.bits;
+			_bits[bit / 8] |= (unsigned char)(1 << (bit % 8));
+		}
+		++_header.added;
+	}
+
+	bool BloomFilter::mayContain(const void* key, size_t size) const
+	{
+		size_t h1 = 0;
+		size_t h2 = 0;
+		_hash(key, size, h1, h2);
+		for (size_t ctr = 0; ctr < _header.hashes; ctr++)
+		{
+			size_t bit = (h1 + ctr * h2) % _header.bits;
+			if (!(_bits[bit / 8] & (1 << (bit % 8))))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// The filter needs building again when it holds more keys than it was
+	// sized for (so the false positive rate has gone up), or when a good
+	// part of what it holds has been deleted.
+	bool BloomFilter::needsRebuild() const
+	{
+		return _header.added > _header.capacity || _header.deleted * 2 > _header.added + 1024;
+	}
+}
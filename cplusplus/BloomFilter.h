@@ -0,0 +1,56 @@
+
+
+#if !defined(__bloomfilter_h)
+#define __bloomfilter_h
+
+#include "DbObj.h"
+
+namespace Database
+{
+	// A Bloom filter over the keys in a tree, kept in a file next to the
+	// data file. If the filter says a key isn't there then it isn't, so a
+	// lookup for a missing key can usually be answered without reading any
+	// pages. Keys can't be taken out of a Bloom filter, so deletes are only
+	// counted, and once they (or the number of keys added) get too high
+	// the tree builds a new filter from its keys. The file is stamped with
+	// the commit it was saved at, and is only loaded at that commit, as
+	// a filter from before a crash may not have the keys added since.
+	class BloomFilter : public Database::RefCount
+	{
+	public:
+		BloomFilter(const std::string& fileName);
+		~BloomFilter();
+
+	private:
+		struct SBloomHeader
+		{
+			size_t bits;		// number of bits in the filter
+			size_t hashes;		// number of bits set per key
+			size_t capacity;	// keys the filter was sized for
+			size_t added;		// keys added since it was built
+			size_t deleted;		// keys deleted since it was built
+			unsigned long long stamp;	// the commit it was saved at
+		};
+
+		std::string _fileName;
+		SBloomHeader _header;
+		std::vector<unsigned char> _bits;
+
+		static void _hash(const void* key, size_t size, size_t& h1, size_t& h2);
+
+	public:
+		void init(size_t capacity);
+		bool load(unsigned long long stamp);
+		bool save(unsigned long long stamp);
+		void add(const void* key, size_t size);
+		bool mayContain(const void* key, size_t size) const;
+		void noteDelete() { ++_header.deleted; }
+		bool needsRebuild() const;
+
+		size_t getCapacity() const { return _header.capacity; }
+		size_t getLiveCount() const { return _header.added - _header.deleted; }
+	};
+	typedef Database::Ptr<BloomFilter> BloomFilterPtr;
+}
+
+#endif
@@ -0,0 +1,604 @@
+
+
+#include "stdafx.h"
+#include "bulkloader.h"
+
+namespace Database
+{
+	// Merged records are handed to the page writer this many at a
+	// time, with no more than a few batches waiting.
+	static const size_t BATCH_SIZE = 4096;
+	static const size_t MAX_BATCHES = 4;
+
+	// Big buffers for the run files, which are read and written in order.
+	static const size_t RUN_BUFFER = 1 << 20;
+
+	// Where a line's key and payload are in a chunk.
+	struct SLine
+	{
+		size_t keyOff;
+		size_t keyLen;
+		size_t valOff;
+		size_t valLen;
+	};
+
+	// Orders the lines of a chunk by key, with the tree's comparator.
+	struct LineLess
+	{
+		const char* buf;
+		compareFn cfn;
+		bool operator()(const SLine& a, const SLine& b) const
+		{
+			return cfn(buf + a.keyOff, a.keyLen, buf + b.keyOff, b.keyLen) < 0;
+		}
+	};
+
+	// A sorted run being merged, with the record at its head.
+	struct SRunReader
+	{
+		FILE* file;
+		size_t runNo;
+		std::string key;
+		std::string value;
+
+		bool next()
+		{
+			size_t lens[2];
+			if (1 != fread(lens, sizeof(lens), 1, file))
+			{
+				return false;
+			}
+			key.resize(lens[0]);
+			value.resize(lens[1]);
+			return (lens[0] == 0 || 1 == fread(&key[0], lens[0], 1, file))
+				&& (lens[1] == 0 || 1 == fread(&value[0], lens[1], 1, file));
+		}
+	};
+
+	// The merge heap gives the smallest key first, and for equal keys
+	// the one from the earlier run.
+	struct RunGreater
+	{
+		compareFn cfn;
+		bool operator()(const SRunReader* a, const SRunReader* b) const
+		{
+			int ret = cfn(a->key.data(), a->key.size(), b->key.data(), b->key.size());
+			return ret > 0 || (ret == 0 && a->runNo > b->runNo);
+		}
+	};
+
+	BulkLoader::BulkLoader(BTreeDB* db)
+		: _db(db)
+		, _keyFields(1)
+		, _chunkSize(64 << 20)
+		, _fillPercent(90)
+		, _threads(0)
+		, _fillTarget(0)
+		, _rejected(0)
+		, _failed(false)
+		, _loaded(0)
+		, _mergeDone(false)
+	{
+	}
+
+	BulkLoader::~BulkLoader()
+	{
+		while (!_batches.empty())
+		{
+			delete _batches.front();
+			_batches.pop_front();
+		}
+	}
+
+	bool BulkLoader::load(const std::string& fileName)
+	{
+		BTreeDB::TREEGUARD guard(_db->_treeLock);
+		if (!_db->_root->isLeaf || _db->_root->objCount != 0)
+		{
+			return false;
+		}
+		_inputName = fileName;
+		FILE* f = fopen(fileName.c_str(), "rb");
+		if (0 == f)
+		{
+			return false;
+		}
+
+		// Cut the file into chunks that end at the end of a line.
+		_fseeki64(f, 0, SEEK_END);
+		__int64 size = _ftelli64(f);
+		std::vector<__int64> bounds(1, 0);
+		while (bounds.back() < size)
+		{
+			__int64 pos = bounds.back() + (__int64)_chunkSize;
+			if (pos < size)
+			{
+				_fseeki64(f, pos, SEEK_SET);
+				int ch = 0;
+				while ((ch = fgetc(f)) != EOF && ch != '\n')
+				{
+					++pos;
+				}
+				++pos;
+			}
+			bounds.push_back((pos < size) ? pos : size);
+		}
+		fclose(f);
+
+		// Sort the chunks into runs, as many at once as there are threads.
+		ThreadPoolPtr pool = new ThreadPool(_threads);
+		size_t runs = bounds.size() - 1;
+		std::vector<SChunkTask> tasks(runs);
+		_runNames.resize(runs);
+		for (size_t ctr = 0; ctr < runs; ctr++)
+		{
+			char suffix[32];
+			sprintf(suffix, ".run%u", (unsigned)ctr);
+			_runNames[ctr] = _db->_fileName + suffix;
+			tasks[ctr].loader = this;
+			tasks[ctr].runNo = ctr;
+			tasks[ctr].start = bounds[ctr];
+			tasks[ctr].end = bounds[ctr + 1];
+			pool->submit(_chunkTask, &tasks[ctr]);
+		}
+		pool->wait();
+
+		// Merge the runs on one of the pool's threads, and build the tree
+		// on this one as the merged records come through. Nodes are filled
+		// to the target, but never so full that the next put splits them.
+		if (!_failed)
+		{
+			_fillPercent = (_fillPercent < 50) ? 50 : (_fillPercent > 100) ? 100 : _fillPercent;
+			_fillTarget = _db->_layout.usable * _fillPercent / 100;
+			if (_fillTarget + 2 * _db->_layout.maxEntry > _db->_layout.usable)
+			{
+				_fillTarget = _db->_layout.usable - 2 * _db->_layout.maxEntry;
+			}
+			SLevel leaves;
+			leaves.cur = _db->_root;
+			leaves.sepLevel = 0;
+			if (_db->_copyOnWrite)
+			{
+				// The empty root belongs to the last commit, so it can't
+				// be written over.
+				_db->_freePage(_db->_root->fpos);
+				leaves.cur = _newNode(0);
+			}
+			_levels.push_back(leaves);
+
+			_mergeDone = false;
+			pool->submit(_mergeTask, this);
+			while (true)
+			{
+				BULKRECVECTOR* batch = 0;
+				{
+					std::unique_lock<std::mutex> guard(_batchLock);
+					while (_batches.empty() && !_mergeDone)
+					{
+						_batchReady.wait(guard);
+					}
+					if (_batches.empty())
+					{
+						break;
+					}
+					batch = _batches.front();
+					_batches.pop_front();
+				}
+				_batchTaken.notify_one();
+				for (size_t ctr = 0; ctr < batch->size(); ctr++)
+				{
+					_addRecord((*batch)[ctr]);
+				}
+				delete batch;
+			}
+			pool->wait();
+			_finish();
+		}
+
+		for (size_t ctr = 0; ctr < _runNames.size(); ctr++)
+		{
+			remove(_runNames[ctr].c_str());
+		}
+		return !_failed;
+	}
+
+	void BulkLoader::_chunkTask(void* arg)
+	{
+		SChunkTask* task = (SChunkTask*)arg;
+		if (!task->loader->_makeRun(task->runNo, task->start, task->end))
+		{
+			task->loader->_failed = true;
+		}
+	}
+
+	// Parse a chunk of the file, sort it and write it out as a run. Only
+	// the last of the lines with the same key is kept. Lines whose records
+	// are too big for the tree are counted and left out.
+	bool BulkLoader::_makeRun(size_t runNo, __int64 start, __int64 end)
+	{
+		std::vector<char> buf((size_t)(end - start) + 1);
+		FILE* in = fopen(_inputName.c_str(), "rb");
+		if (0 == in)
+		{
+			return false;
+		}
+		bool ret = (0 == _fseeki64(in, start, SEEK_SET)) && (buf.size() == 1 || 1 == fread(&buf[0], buf.size() - 1, 1, in));
+		fclose(in);
+		if (!ret)
+		{
+			return false;
+		}
+
+		size_t length = buf.size() - 1;
+		size_t valueThreshold = ((ValueLog*)_db->_valueLog != 0) ? _db->_valueThreshold : (size_t)-1;
+		std::vector<SLine> lines;
+		size_t pos = 0;
+		while (pos < length)
+		{
+			size_t lineEnd = pos;
+			while (lineEnd < length && buf[lineEnd] != '\n')
+			{
+				++lineEnd;
+			}
+			size_t next = lineEnd + 1;
+			if (lineEnd > pos && buf[lineEnd - 1] == '\r')
+			{
+				--lineEnd;
+			}
+
+			// The key runs up to the tab after the last key field.
+			SLine line = { pos, lineEnd - pos, lineEnd, 0 };
+			size_t fields = 0;
+			for (size_t ctr = pos; ctr < lineEnd; ctr++)
+			{
+				if (buf[ctr] == '\t' && ++fields == _keyFields)
+				{
+					line.keyLen = ctr - pos;
+					line.valOff = ctr + 1;
+					line.valLen = lineEnd - ctr - 1;
+					break;
+				}
+			}
+			size_t stored = line.keyLen + ((line.valLen > valueThreshold) ? sizeof(SValuePtr) : line.valLen);
+			if (lineEnd == pos)
+			{
+				// blank lines are skipped
+			}
+			else if (line.keyLen == 0 || stored > _db->_recSize)
+			{
+				++_rejected;
+			}
+			else
+			{
+				lines.push_back(line);
+			}
+			pos = next;
+		}
+
+		LineLess less = { &buf[0], _db->_compFunc };
+		std::stable_sort(lines.begin(), lines.end(), less);
+
+		FILE* out = fopen(_runNames[runNo].c_str(), "wb");
+		if (0 == out)
+		{
+			return false;
+		}
+		setvbuf(out, 0, _IOFBF, RUN_BUFFER);
+		for (size_t ctr = 0; ret && ctr < lines.size(); ctr++)
+		{
+			const SLine& line = lines[ctr];
+			if (ctr + 1 < lines.size() && !less(line, lines[ctr + 1]))
+			{
+				continue;
+			}
+			size_t lens[2] = { line.keyLen, line.valLen };
+			ret = (1 == fwrite(lens, sizeof(lens), 1, out))
+				&& (1 == fwrite(&buf[line.keyOff], line.keyLen, 1, out))
+				&& (line.valLen == 0 || 1 == fwrite(&buf[line.valOff], line.valLen, 1, out));
+		}
+		return (0 == fclose(out)) && ret;
+	}
+
+	void BulkLoader::_mergeTask(void* arg)
+	{
+		((BulkLoader*)arg)->_merge();
+	}
+
+	// K-way merge of the runs. Where runs have the same key, the later
+	// run (which came from further on in the file) wins.
+	void BulkLoader::_merge()
+	{
+		RunGreater greater = { _db->_compFunc };
+		std::priority_queue<SRunReader*, std::vector<SRunReader*>, RunGreater> heap(greater);
+		std::vector<SRunReader> readers(_runNames.size());
+		for (size_t ctr = 0; ctr < readers.size(); ctr++)
+		{
+			readers[ctr].runNo = ctr;
+			readers[ctr].file = fopen(_runNames[ctr].c_str(), "rb");
+			if (0 == readers[ctr].file)
+			{
+				_failed = true;
+				continue;
+			}
+			setvbuf(readers[ctr].file, 0, _IOFBF, RUN_BUFFER);
+			if (readers[ctr].next())
+			{
+				heap.push(&readers[ctr]);
+			}
+		}
+
+		BULKRECVECTOR* batch = new BULKRECVECTOR;
+		while (!heap.empty() && !_failed)
+		{
+			SRunReader* top = heap.top();
+			heap.pop();
+			batch->push_back(SBulkRec());
+			SBulkRec& rec = batch->back();
+			rec.key.swap(top->key);
+			rec.value.swap(top->value);
+			if (top->next())
+			{
+				heap.push(top);
+			}
+			while (!heap.empty() && 0 == _db->_compFunc(heap.top()->key.data(), heap.top()->key.size(), rec.key.data(), rec.key.size()))
+			{
+				top = heap.top();
+				heap.pop();
+				rec.key.swap(top->key);
+				rec.value.swap(top->value);
+				if (top->next())
+				{
+					heap.push(top);
+				}
+			}
+			if (batch->size() == BATCH_SIZE)
+			{
+				_putBatch(batch);
+				batch = new BULKRECVECTOR;
+			}
+		}
+		_putBatch(batch);
+
+		for (size_t ctr = 0; ctr < readers.size(); ctr++)
+		{
+			if (readers[ctr].file != 0)
+			{
+				fclose(readers[ctr].file);
+			}
+		}
+		std::lock_guard<std::mutex> guard(_batchLock);
+		_mergeDone = true;
+		_batchReady.notify_one();
+	}
+
+	// Hand a batch to the page writer, waiting if it has fallen behind.
+	void BulkLoader::_putBatch(BULKRECVECTOR* batch)
+	{
+		{
+			std::unique_lock<std::mutex> guard(_batchLock);
+			while (_batches.size() >= MAX_BATCHES)
+			{
+				_batchTaken.wait(guard);
+			}
+			_batches.push_back(batch);
+		}
+		_batchReady.notify_one();
+	}
+
+	// Add the next record (in key order) to the tree. It goes in the
+	// current leaf if there is room, and otherwise the leaf is finished
+	// and the record goes up to the level above, to separate that leaf
+	// from the next one.
+	void BulkLoader::_addRecord(const SBulkRec& rec)
+	{
+		DbObjPtr stored;
+		unsigned short flags = 0;
+		if ((ValueLog*)_db->_valueLog != 0 && rec.value.size() > _db->_valueThreshold)
+		{
+			SValuePtr vp;
+			if (!_db->_valueLog->append(rec.value.data(), rec.value.size(), vp))
+			{
+				_failed = true;
+				return;
+			}
+			stored = new DbObj(rec.key.data(), rec.key.size(), &vp, sizeof(vp));
+			flags = ESF_VALUEPTR;
+		}
+		else
+		{
+			stored = new DbObj(rec.key.data(), rec.key.size(), rec.value.data(), rec.value.size());
+		}
+		if ((BloomFilter*)_db->_bloom != 0)
+		{
+			_db->_bloom->add(rec.key.data(), rec.key.size());
+		}
+		++_loaded;
+
+		TreeNodePtr leaf = _levels[0].cur;
+		if (_fits(leaf, stored))
+		{
+			_append(leaf, stored, flags);
+			return;
+		}
+		TreeNodePtr closed = _close(0);
+		_promote(1, 0, stored, flags, closed);
+	}
+
+	bool BulkLoader::_fits(const TreeNodePtr& node, const DbObjPtr& rec) const
+	{
+		return node->objCount == 0 || node->logicalSize() + _db->_layout.entrySize(rec->getSize()) <= _fillTarget;
+	}
+
+	void BulkLoader::_append(TreeNodePtr& node, const DbObjPtr& rec, unsigned short flags)
+	{
+		size_t count = node->objCount;
+		node->setCount(count + 1);
+		node->setRecord(count, rec, flags);
+	}
+
+	// Point a node at a child (which is still in memory, so that its
+	// record count can be taken). The node keeps only the child's
+	// position, as if it had been read from the disk, so that the
+	// finished nodes can be let go of.
+	void BulkLoader::_setChild(TreeNodePtr& node, size_t childNo, const TreeNodePtr& child)
+	{
+		node->children[childNo].unswizzle(child->fpos);
+		node->childPos()[childNo] = child->fpos;
+		if (_db->_layout.counted)
+		{
+			node->childCounts()[childNo] = (long)child->subtreeCount();
+		}
+	}
+
+	TreeNodePtr BulkLoader::_newNode(size_t level)
+	{
+		TreeNodePtr node = _db->_allocateNode();
+		node->isLeaf = (level == 0);
+		node->setCount(0);
+		return node;
+	}
+
+	// Finish the current node of a level, and start another. The node
+	// before it is written out now, as nothing more can happen to it.
+	TreeNodePtr BulkLoader::_close(size_t level)
+	{
+		SLevel& lvl = _levels[level];
+		if ((TreeNode*)lvl.prev != 0)
+		{
+			_write(lvl.prev);
+		}
+		lvl.prev = lvl.cur;
+		lvl.cur = _newNode(level);
+		return lvl.prev;
+	}
+
+	// A node at level - 1 has been finished, and the record given comes
+	// after it. The node becomes the next child of the current node on
+	// this level, followed by the record if it fits; if it doesn't, this
+	// node is finished as well and the record goes up another level.
+	void BulkLoader::_promote(size_t level, size_t from, const DbObjPtr& rec, unsigned short flags, const TreeNodePtr& left)
+	{
+		if (level == _levels.size())
+		{
+			SLevel lvl;
+			lvl.cur = _newNode(level);
+			lvl.sepLevel = 0;
+			_levels.push_back(lvl);
+		}
+		TreeNodePtr node = _levels[level].cur;
+		_setChild(node, node->objCount, left);
+		if (!_fits(node, rec))
+		{
+			TreeNodePtr closed = _close(level);
+			_promote(level + 1, from, rec, flags, closed);
+			return;
+		}
+		_append(node, rec, flags);
+		for (size_t ctr = from; ctr < level; ctr++)
+		{
+			_levels[ctr].sepLevel = level;
+		}
+	}
+
+	// The last node on a level can end up with few records (or none).
+	// It is topped up from the node before it, as a delete would do it:
+	// the record that separates them comes down into it, and the last
+	// record of the node before goes up in its place. The separator is
+	// the last record of the current node on the level it went up to,
+	// and any record counts on the way there are brought down to match.
+	void BulkLoader::_rebalance(size_t level)
+	{
+		TreeNodePtr cur = _levels[level].cur;
+		TreeNodePtr prev = _levels[level].prev;
+		size_t sepLevel = _levels[level].sepLevel;
+		TreeNodePtr sepNode = _levels[sepLevel].cur;
+		size_t sepNo = sepNode->objCount - 1;
+		while (prev->objCount > 1 && (cur->objCount == 0 || (!cur->isSafe() && prev->canLend())))
+		{
+			size_t count = cur->objCount;
+			long moved = 1;
+			cur->setCount(count + 1);
+			cur->copyRecords(1, cur, 0, count);
+			if (!cur->isLeaf)
+			{
+				for (size_t ctr = count + 1; ctr > 0; ctr--)
+				{
+					cur->moveChild(ctr, cur, ctr - 1);
+				}
+			}
+			cur->copyRecord(0, sepNode, sepNo);
+			sepNode->copyRecord(sepNo, prev, prev->objCount - 1);
+			if (!cur->isLeaf)
+			{
+				if (_db->_layout.counted)
+				{
+					moved += prev->childCounts()[prev->objCount];
+				}
+				cur->moveChild(0, prev, prev->objCount);
+			}
+			prev->setCount(prev->objCount - 1);
+			if (_db->_layout.counted)
+			{
+				for (size_t ctr = level + 1; ctr < sepLevel; ctr++)
+				{
+					TreeNodePtr node = _levels[ctr].prev;
+					node->childCounts()[node->objCount] -= moved;
+				}
+				sepNode->childCounts()[sepNo] -= moved;
+			}
+		}
+	}
+
+	void BulkLoader::_write(TreeNodePtr& node)
+	{
+		if (!node->write(_db->_store))
+		{
+			_failed = true;
+		}
+		_db->_indexRecords(node, 0, node->objCount);
+	}
+
+	// Once the records have all been added, finish every level from the
+	// bottom up: top up the last node, make it the last child of the level
+	// above, and write out what's left. The current node of the top level
+	// is the root.
+	void BulkLoader::_finish()
+	{
+		for (size_t level = 0; level < _levels.size(); level++)
+		{
+			SLevel& lvl = _levels[level];
+			if ((TreeNode*)lvl.prev != 0)
+			{
+				_rebalance(level);
+			}
+			if (level + 1 < _levels.size())
+			{
+				TreeNodePtr parent = _levels[level + 1].cur;
+				_setChild(parent, parent->objCount, lvl.cur);
+			}
+			if ((TreeNode*)lvl.prev != 0)
+			{
+				_write(lvl.prev);
+			}
+			_write(lvl.cur);
+		}
+
+		if (_db->_optimistic)
+		{
+			_db->_retire(_db->_root);
+		}
+		_db->_root = _levels.back().cur;
+		_db->_root->parent = (TreeNode*)0;
+		_db->_writeRoot();
+		_levels.clear();
+
+		if ((BloomFilter*)_db->_bloom != 0 && _db->_bloom->needsRebuild())
+		{
+			_db->_rebuildFilter();
+		}
+		if (!_db->flush())
+		{
+			_failed = true;
+		}
+	}
+}
@@ -0,0 +1,113 @@
+
+
+#if !defined(__bulkloader_h)
+#define __bulkloader_h
+
+#include "BTreeDB.h"
+
+namespace Database
+{
+	// Builds a new tree from a tab separated text file, much faster than
+	// putting the records one at a time. The first few fields of each line
+	// are the key and the rest of the line is the payload. If a key is on
+	// more than one line, the last line wins, as it would with put().
+	// The work is done in three overlapping stages:
+	//  - the file is cut into chunks at line ends, and the pool's threads
+	//    each parse a chunk, sort it and write it out as a sorted run;
+	//  - the runs are merged, on a thread of their own;
+	//  - as the merged records come out, the pages of the tree are filled
+	//    from the bottom up, one node per level at a time, and written
+	//    straight to the database file.
+	// The database must have been opened, and be empty.
+	class BulkLoader
+	{
+	public:
+		BulkLoader(BTreeDB* db);
+		~BulkLoader();
+
+	private:
+		// One record, as it is parsed, sorted and merged.
+		struct SBulkRec
+		{
+			std::string key;
+			std::string value;
+		};
+		typedef std::vector<SBulkRec> BULKRECVECTOR;
+
+		// The node being filled at each level of the tree, and the last
+		// one to be finished, which is kept back until the next one is in
+		// case it has to give records to the last node on the level.
+		struct SLevel
+		{
+			TreeNodePtr cur;
+			TreeNodePtr prev;
+			size_t sepLevel;	// level that the record after prev went up to
+		};
+
+		struct SChunkTask
+		{
+			BulkLoader* loader;
+			size_t runNo;
+			__int64 start;
+			__int64 end;
+		};
+
+		BTreeDB* _db;
+		size_t _keyFields;
+		size_t _chunkSize;
+		size_t _fillPercent;
+		size_t _threads;
+		std::string _inputName;
+		std::vector<std::string> _runNames;
+		std::vector<SLevel> _levels;
+		size_t _fillTarget;
+		std::atomic<size_t> _rejected;
+		std::atomic<bool> _failed;
+		size_t _loaded;
+
+		// Merged records on their way from the merge to the page writer.
+		std::deque<BULKRECVECTOR*> _batches;
+		bool _mergeDone;
+		std::mutex _batchLock;
+		std::condition_variable _batchReady;
+		std::condition_variable _batchTaken;
+
+		static void _chunkTask(void* arg);
+		static void _mergeTask(void* arg);
+		bool _makeRun(size_t runNo, __int64 start, __int64 end);
+		void _merge();
+		void _putBatch(BULKRECVECTOR* batch);
+
+		void _addRecord(const SBulkRec& rec);
+		bool _fits(const TreeNodePtr& node, const DbObjPtr& rec) const;
+		void _append(TreeNodePtr& node, const DbObjPtr& rec, unsigned short flags);
+		void _setChild(TreeNodePtr& node, size_t childNo, const TreeNodePtr& child);
+		TreeNodePtr _newNode(size_t level);
+		TreeNodePtr _close(size_t level);
+		void _promote(size_t level, size_t from, const DbObjPtr& rec, unsigned short flags, const TreeNodePtr& left);
+		void _rebalance(size_t level);
+		void _write(TreeNodePtr& node);
+		void _finish();
+
+	public:
+		bool load(const std::string& fileName);
+
+		// How many of the leading tab separated fields are the key.
+		void setKeyFields(size_t fields) { _keyFields = fields; }
+
+		// Bytes of the input that each thread sorts at a time.
+		void setChunkSize(size_t bytes) { _chunkSize = bytes; }
+
+		// How full to make the nodes, as a percentage, leaving room for
+		// records that are put later.
+		void setFillPercent(size_t percent) { _fillPercent = percent; }
+
+		// Threads used to parse and sort (0 for one per core).
+		void setThreads(size_t threads) { _threads = threads; }
+
+		size_t getLoaded() const { return _loaded; }
+		size_t getRejected() const { return _rejected; }
+	};
+}
+
+#endif
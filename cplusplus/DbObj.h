@@ -4,6 +4,7 @@
 #define __dbobj_h_
 
 #include "smartptrs.h"
+#include "SlabPool.h"
 
 #include"stdafx.h"
 
@@ -24,64 +25,96 @@ namespace Database
 		{
 			_data = 0;
 			_size = 0;
+			_keySize = 0;
 		}
 
 		// Constructor taking a pointer and a size. Make a copy of the _data.
 		DbObj(void* pd, size_t sz)
 		{
+			_keySize = 0;
 			_size = sz;
 			if (_size != 0)
 			{
-				_data = new byte[_size];
+				_data = (byte*)SlabPool::allocate(_size);
 				memcpy(_data, pd, _size);
 			}
 		}
 
+		// Constructor taking a key and its payload and joining them
+		// together into one record. The record remembers how much
+		// of it is key.
+		DbObj(const void* pd1, size_t sz1, const void* pd2, size_t sz2)
+		{
+			_keySize = sz1;
+			_size = sz1 + sz2;
+			_data = (byte*)SlabPool::allocate(_size);
+			if (sz1 != 0)
+			{
+				memcpy(_data, pd1, sz1);
+			}
+			if (sz2 != 0)
+			{
+				memcpy(_data + sz1, pd2, sz2);
+			}
+		}
+
 		// Constructor taking a std::string reference.
 		DbObj(const std::string& s)
 		{
+			_keySize = 0;
 			_size = s.length();
-			_data = new byte[_size];
-			memcpy(_data, s.c_str(), _size);
+			_data = (byte*)SlabPool::allocate(_size);
+			if (_size != 0)
+			{
+				memcpy(_data, s.c_str(), _size);
+			}
 		}
 
 		// Constructor taking a (possibly) null terminated string.
 		DbObj(const char* ps, size_t sz = 0)
 		{
+			_keySize = 0;
 			_size = (0 == sz) ? strlen(ps) : sz;
-			_data = new byte[_size];
-			memcpy(_data, ps, _size);
+			_data = (byte*)SlabPool::allocate(_size);
+			if (_size != 0)
+			{
+				memcpy(_data, ps, _size);
+			}
 		}
 
 		// Constructor taking a 32-bit unsigned int
 		DbObj(unsigned long ul)
 		{
+			_keySize = 0;
 			_size = sizeof(unsigned long);
-			_data = new byte[_size];
+			_data = (byte*)SlabPool::allocate(_size);
 			*((unsigned long*)_data) = ul;
 		}
 
 		// Constructor taking a 32-bit int
 		DbObj(long l)
 		{
+			_keySize = 0;
 			_size = sizeof(long);
-			_data = new byte[_size];
+			_data = (byte*)SlabPool::allocate(_size);
 			*((long*)_data) = l;
 		}
 
 		// Constructor taking a 16-bit unsigned int
 		DbObj(unsigned short us)
 		{
+			_keySize = 0;
 			_size = sizeof(unsigned short);
-			_data = new byte[_size];
+			_data = (byte*)SlabPool::allocate(_size);
 			*((unsigned short*)_data) = us;
 		}
 
 		// Constructor taking a 16-bit int
 		DbObj(short s)
 		{
+			_keySize = 0;
 			_size = sizeof(short);
-			_data = new byte[_size];
+			_data = (byte*)SlabPool::allocate(_size);
 			*((short*)_data) = s;
 		}
 
@@ -90,6 +123,7 @@ namespace Database
 		{
 			_data = 0;
 			_size = 0;
+			_keySize = 0;
 			operator=(obj);
 		}
 
@@ -98,7 +132,7 @@ namespace Database
 		{
 			if (_size != 0)
 			{
-				delete[] _data;
+				SlabPool::release(_data, _size);
 				_data = 0;
 				_size = 0;
 			}
@@ -107,36 +141,57 @@ namespace Database
 		// Assignment operator. Make a copy of the other object.
 		DbObj& operator=(DbObj& obj)
 		{
+			if (&obj == this)
+			{
+				return *this;
+			}
 			if (_size != 0)
 			{
-				delete[] _data;
+				SlabPool::release(_data, _size);
 			}
+			_data = 0;
+			_size = 0;
 			if (obj._size > 0)
 			{
 				_size = obj._size;
-				_data = new byte[_size];
+				_data = (byte*)SlabPool::allocate(_size);
 				memcpy(_data, obj._data, _size);
 			}
+			_keySize = obj._keySize;
+			return *this;
 		}
 
 	public:
+		// Objects and their data both come from the slab pool, as a
+		// record is made for every get and seq.
+		static void* operator new(size_t size) { return SlabPool::allocate(size); }
+		static void operator delete(void* p, size_t size) { SlabPool::release(p, size); }
 
 		void* getData()  { return _data; }
 		size_t getSize() const { return _size; }
+
+		// Number of bytes at the start of a record that are its key, or
+		// 0 if the object doesn't say (the tree's key size is used then).
+		size_t getKeySize() const { return _keySize; }
+		void setKeySize(size_t keySize) { _keySize = keySize; }
 		void setData(const void* pd, size_t sz)
 		{
 			if (_size)
 			{
-				delete[] _data;
+				SlabPool::release(_data, _size);
 			}
 			_size = sz;
-			_data = new byte[_size];
-			memcpy(_data, pd, _size);
+			_data = (byte*)SlabPool::allocate(_size);
+			if (_size != 0)
+			{
+				memcpy(_data, pd, _size);
+			}
 		}
 
 	private:
 		byte* _data;
 		size_t _size;
+		size_t _keySize;
 	};
 
 	typedef Database::Ptr<DbObj> DbObjPtr;
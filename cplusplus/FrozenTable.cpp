@@ -0,0 +1,477 @@
+
+
+#include "stdafx.h"
+#include "frozentable.h"
+#include <windows.h>
+#include <xmmintrin.h>
+#include <float.h>
+
+namespace Database
+{
+	static const char FROZEN_MAGIC[8] = { 'F', 'R', 'O', 'Z', 'E', 'N', '0', '1' };
+
+	// The records start after a cache line's worth of header, and the
+	// search array starts on a cache line of its own. Records are kept
+	// four byte aligned, for their lengths.
+	static const size_t HEADER_SIZE = 128;
+	static const size_t INDEX_ALIGN = 64;
+	static const size_t RECORD_ALIGN = 4;
+
+	// The entries below one at k, three levels down, are the eight
+	// from 8k, which fill one cache line.
+	static const size_t PREFETCH_SPAN = 8;
+
+	FrozenTable::FrozenTable(compareFn cfn)
+		: _compFunc(cfn)
+		, _useHeads(false)
+		, _fileHandle(INVALID_HANDLE_VALUE)
+		, _mapHandle(0)
+		, _base(0)
+		, _header(0)
+		, _heads(0)
+		, _offsets(0)
+		, _useLearned(true)
+		, _sortedHeads(0)
+		, _sortedOffsets(0)
+		, _segments(0)
+	{
+	}
+
+	FrozenTable::~FrozenTable()
+	{
+		close();
+	}
+
+	// The first eight bytes of a key after the prefix, big end first and
+	// padded with zeros, so that comparing the heads of two keys that
+	// share the prefix orders them the way memcmp would.
+	unsigned long long FrozenTable::_head(const void* key, size_t size, size_t prefixLen)
+	{
+		unsigned long long head = 0;
+		for (size_t ctr = prefixLen; ctr < prefixLen + sizeof(head); ctr++)
+		{
+			head <<= 8;
+			if (ctr < size)
+			{
+				head |= ((const unsigned char*)key)[ctr];
+			}
+		}
+		return head;
+	}
+
+	// Copy the records of a tree out to a frozen table. If the tree is
+	// copy-on-write, they are read from a snapshot, so that the tree can
+	// still be changed while they are copied.
+	bool FrozenTable::build(BTreeDB* db, const std::string& fileName, size_t maxError)
+	{
+		FILE* f = fopen(fileName.c_str(), "wb");
+		if (0 == f)
+		{
+			return false;
+		}
+		SFrozenHeader hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, FROZEN_MAGIC, sizeof(hdr.magic));
+		hdr.byteOrder = (db->_layout.prefixCompare != 0) ? 1 : 0;
+		hdr.keySize = (unsigned int)db->_layout.keySize;
+		std::vector<byte> padding(HEADER_SIZE, 0);
+		bool ret = (1 == fwrite(&padding[0], HEADER_SIZE, 1, f));
+
+		// Write the records out as they come, keeping the place of each
+		// one, and how much of the first key the others all start with.
+		SnapshotPtr snapshot = db->beginSnapshot();
+		std::vector<SFrozenEntry> sorted;
+		std::vector<byte> firstKey;
+		unsigned long long offset = HEADER_SIZE;
+		NodeKeyLocn locn(TreeNodePtr(), (size_t)-1);
+		DbObjPtr rec;
+		while (ret && ((Snapshot*)snapshot != 0 ? snapshot->seq(locn, rec) : db->seq(locn, rec)))
+		{
+			SFrozenRecord fr;
+			fr.keyLen = (unsigned int)db->_layout.probeSize(rec);
+			fr.valueLen = (unsigned int)(rec->getSize() - fr.keyLen);
+			size_t len = sizeof(fr) + rec->getSize();
+			size_t padded = (len + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+			ret = (1 == fwrite(&fr, sizeof(fr), 1, f))
+				&& (1 == fwrite(rec->getData(), rec->getSize(), 1, f))
+				&& (padded == len || 1 == fwrite(&padding[0], padded - len, 1, f));
+			const byte* key = (const byte*)rec->getData();
+			if (sorted.empty())
+			{
+				firstKey.assign(key, key + fr.keyLen);
+				hdr.prefixLen = fr.keyLen;
+			}
+			while (hdr.prefixLen > fr.keyLen || (hdr.prefixLen != 0 && 0 != memcmp(&firstKey[0], key, (size_t)hdr.prefixLen)))
+			{
+				--hdr.prefixLen;
+			}
+			SFrozenEntry entry = { 0, offset };
+			sorted.push_back(entry);
+			offset += padded;
+		}
+		fflush(f);
+		locn.first = (TreeNode*)0;
+		snapshot = (Snapshot*)0;
+
+		// Then the search array, after the records. The heads are taken
+		// from the records as they were written.
+		FILE* in = ret ? fopen(fileName.c_str(), "rb") : 0;
+		ret = ret && (in != 0);
+		std::vector<byte> key;
+		for (size_t ctr = 0; ret && ctr < sorted.size(); ctr++)
+		{
+			SFrozenRecord fr;
+			ret = (0 == _fseeki64(in, (__int64)sorted[ctr].offset, SEEK_SET)) && (1 == fread(&fr, sizeof(fr), 1, in));
+			key.resize(fr.keyLen + 1);
+			ret = ret && (fr.keyLen == 0 || 1 == fread(&key[0], fr.keyLen, 1, in));
+			sorted[ctr].head = _head(&key[0], fr.keyLen, (size_t)hdr.prefixLen);
+		}
+		if (in != 0)
+		{
+			fclose(in);
+		}
+		hdr.count = sorted.size();
+		hdr.dataEnd = offset;
+		hdr.indexStart = (offset + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+		OFFSETVECTOR heads(sorted.size() + 1);
+		OFFSETVECTOR offsets(sorted.size() + 1);
+		size_t next = 0;
+		_fillIndex(sorted, heads, offsets, next, 1);
+		if (ret && hdr.indexStart != offset)
+		{
+			ret = (1 == fwrite(&padding[0], (size_t)(hdr.indexStart - offset), 1, f));
+		}
+		ret = ret && (1 == fwrite(&heads[0], sizeof(heads[0]) * heads.size(), 1, f))
+			&& (1 == fwrite(&offsets[0], sizeof(offsets[0]) * offsets.size(), 1, f));
+
+		// The learned index goes last, if the heads tell the keys apart.
+		bool distinct = (maxError != 0 && hdr.byteOrder && !sorted.empty());
+		for (size_t ctr = 1; distinct && ctr < sorted.size(); ctr++)
+		{
+			distinct = (sorted[ctr - 1].head < sorted[ctr].head);
+		}
+		if (ret && distinct)
+		{
+			std::vector<SFrozenSegment> segments;
+			_fitSegments(sorted, maxError, segments);
+			unsigned long long end = hdr.indexStart + sizeof(unsigned long long) * (heads.size() + offsets.size());
+			hdr.learnedStart = (end + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+			hdr.segmentCount = segments.size();
+			hdr.maxError = maxError;
+			ret = (hdr.learnedStart == end || 1 == fwrite(&padding[0], (size_t)(hdr.learnedStart - end), 1, f));
+			for (size_t ctr = 0; ret && ctr < sorted.size(); ctr++)
+			{
+				ret = (1 == fwrite(&sorted[ctr].head, sizeof(sorted[ctr].head), 1, f));
+			}
+			for (size_t ctr = 0; ret && ctr < sorted.size(); ctr++)
+			{
+				ret = (1 == fwrite(&sorted[ctr].offset, sizeof(sorted[ctr].offset), 1, f));
+			}
+			ret = ret && (1 == fwrite(&segments[0], sizeof(SFrozenSegment) * segments.size(), 1, f));
+		}
+		ret = ret && (0 == fseek(f, 0, SEEK_SET)) && (1 == fwrite(&hdr, sizeof(hdr), 1, f));
+		ret = (0 == fclose(f)) && ret;
+		return ret;
+	}
+
+	// Put the sorted entries into the search array, in order, by going
+	// through the array in order (left subtree, entry, right subtree).
+	void FrozenTable::_fillIndex(const std::vector<SFrozenEntry>& sorted, OFFSETVECTOR& heads, OFFSETVECTOR& offsets, size_t& next, size_t k)
+	{
+		if (k < heads.size())
+		{
+			_fillIndex(sorted, heads, offsets, next, 2 * k);
+			heads[k] = sorted[next].head;
+			offsets[k] = sorted[next].offset;
+			next++;
+			_fillIndex(sorted, heads, offsets, next, 2 * k + 1);
+		}
+	}
+
+	// Cut the heads into as few segments as a greedy pass can, each a
+	// straight line that guesses where each of its heads is to within
+	// maxError. A segment is grown while there is still a slope that
+	// keeps all of its heads close enough (the slopes that do so for each
+	// head narrow down the ones that can be used).
+	void FrozenTable::_fitSegments(const std::vector<SFrozenEntry>& sorted, size_t maxError, std::vector<SFrozenSegment>& segments)
+	{
+		size_t start = 0;
+		while (start < sorted.size())
+		{
+			double lowSlope = 0;
+			double highSlope = DBL_MAX;
+			size_t ctr = start + 1;
+			for (; ctr < sorted.size(); ctr++)
+			{
+				double dx = (double)(sorted[ctr].head - sorted[start].head);
+				double dy = (double)(ctr - start);
+				double low = (dy - (double)maxError) / dx;
+				double high = (dy + (double)maxError) / dx;
+				if (low > highSlope || high < lowSlope)
+				{
+					break;
+				}
+				lowSlope = (low > lowSlope) ? low : lowSlope;
+				highSlope = (high < highSlope) ? high : highSlope;
+			}
+			SFrozenSegment segment = { sorted[start].head, start, 0 };
+			if (ctr > start + 1)
+			{
+				segment.slope = (lowSlope + highSlope) / 2;
+			}
+			segments.push_back(segment);
+			start = ctr;
+		}
+	}
+
+	// Map a table into memory, and check that it looks whole. A table
+	// whose keys weren't sorted by the default comparison can only be
+	// opened with the comparison function that sorted them.
+	bool FrozenTable::open(const std::string& fileName)
+	{
+		close();
+		_fileHandle = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+		if (_fileHandle == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(_fileHandle, &fileSize) || (unsigned long long)fileSize.QuadPart < HEADER_SIZE)
+		{
+			close();
+			return false;
+		}
+		_mapHandle = CreateFileMappingA(_fileHandle, 0, PAGE_READONLY, 0, 0, 0);
+		_base = (_mapHandle != 0) ? (const byte*)MapViewOfFile(_mapHandle, FILE_MAP_READ, 0, 0, 0) : 0;
+		if (_base == 0)
+		{
+			close();
+			return false;
+		}
+		_header = (const SFrozenHeader*)_base;
+		_heads = (const unsigned long long*)(_base + _header->indexStart);
+		_offsets = _heads + _header->count + 1;
+		unsigned long long size = (unsigned long long)fileSize.QuadPart;
+		if (0 != memcmp(_header->magic, FROZEN_MAGIC, sizeof(_header->magic))
+			|| _header->dataEnd > _header->indexStart
+			|| _header->indexStart + (_header->count + 1) * 2 * sizeof(unsigned long long) > size
+			|| (_compFunc == 0 && !_header->byteOrder)
+			|| (_header->learnedStart != 0 && _header->learnedStart + _header->count * 2 * sizeof(unsigned long long) + _header->segmentCount * sizeof(SFrozenSegment) > size))
+		{
+			close();
+			return false;
+		}
+		if (_header->learnedStart != 0)
+		{
+			_sortedHeads = (const unsigned long long*)(_base + _header->learnedStart);
+			_sortedOffsets = _sortedHeads + _header->count;
+			_segments = (const SFrozenSegment*)(_sortedOffsets + _header->count);
+		}
+		_useHeads = (_compFunc == 0 || _compFunc == BTreeDB::_defaultCompare) && _header->byteOrder;
+		if (_compFunc == 0)
+		{
+			_compFunc = BTreeDB::_defaultCompare;
+		}
+		return true;
+	}
+
+	void FrozenTable::close()
+	{
+		if (_base != 0)
+		{
+			UnmapViewOfFile(_base);
+			_base = 0;
+		}
+		if (_mapHandle != 0)
+		{
+			CloseHandle(_mapHandle);
+			_mapHandle = 0;
+		}
+		if (_fileHandle != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(_fileHandle);
+			_fileHandle = INVALID_HANDLE_VALUE;
+		}
+		_header = 0;
+		_heads = 0;
+		_offsets = 0;
+		_sortedHeads = 0;
+		_sortedOffsets = 0;
+		_segments = 0;
+	}
+
+	unsigned long long FrozenTable::_nextRecord(unsigned long long offset) const
+	{
+		const SFrozenRecord* fr = _record(offset);
+		size_t len = sizeof(SFrozenRecord) + fr->keyLen + fr->valueLen;
+		return offset + (len + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+	}
+
+	// Find the first record whose key isn't less than the one given, and
+	// return where it is (the end of the records if there isn't one). A
+	// key that doesn't start with the prefix comes before all the records
+	// or after them. Otherwise, at each entry the search goes left if the
+	// entry's key isn't less, and right if it is. Where it last went left
+	// from is the answer, and that is found from where it ended up by
+	// undoing the moves to the right after it, and the move to the left.
+	unsigned long long FrozenTable::_lowerBound(const void* key, size_t size) const
+	{
+		size_t count = (size_t)_header->count;
+		size_t prefixLen = (size_t)_header->prefixLen;
+		unsigned long long head = 0;
+		if (_useHeads && count != 0)
+		{
+			const SFrozenRecord* first = _record(HEADER_SIZE);
+			int compVal = memcmp(key, first + 1, (size < prefixLen) ? size : prefixLen);
+			if (compVal < 0 || (compVal == 0 && size < prefixLen))
+			{
+				return HEADER_SIZE;
+			}
+			if (compVal > 0)
+			{
+				return _header->dataEnd;
+			}
+			head = _head(key, size, prefixLen);
+		}
+		if (_useHeads && _useLearned && _segments != 0)
+		{
+			size_t rank = _learnedRank(head);
+			if (rank < count && _sortedHeads[rank] == head)
+			{
+				// The heads are the same, but the key given may go on
+				// further. Only this record can have this head.
+				const SFrozenRecord* fr = _record(_sortedOffsets[rank]);
+				if (_compFunc((const byte*)(fr + 1), fr->keyLen, key, size) < 0)
+				{
+					++rank;
+				}
+			}
+			return (rank < count) ? _sortedOffsets[rank] : _header->dataEnd;
+		}
+		size_t k = 1;
+		while (k <= count)
+		{
+			_mm_prefetch((const char*)(_heads + PREFETCH_SPAN * k), _MM_HINT_T0);
+			unsigned long long entryHead = _heads[k];
+			bool less = false;
+			if (_useHeads && entryHead != head)
+			{
+				less = (entryHead < head);
+			}
+			else
+			{
+				const SFrozenRecord* fr = _record(_offsets[k]);
+				less = (_compFunc((const byte*)(fr + 1), fr->keyLen, key, size) < 0);
+			}
+			k = 2 * k + (less ? 1 : 0);
+		}
+		while ((k & 1) != 0)
+		{
+			k >>= 1;
+		}
+		k >>= 1;
+		return (k == 0) ? _header->dataEnd : _offsets[k];
+	}
+
+	// How much of a key object is the key, as NodeLayout::probeSize().
+	size_t FrozenTable::_probeSize(const DbObjPtr& key) const
+	{
+		if (key->getKeySize() != 0)
+		{
+			return key->getKeySize();
+		}
+		size_t size = key->getSize();
+		return (_header->keySize != 0 && size > _header->keySize) ? _header->keySize : size;
+	}
+
+	// Find the first head that isn't less than the one given, in key
+	// order, from the model's guess. The guess is kept to its segment,
+	// so that a head between two segments is guessed to be at the start
+	// of the next one, and the heads within maxError either side of it
+	// are searched. Were the answer not to be in there, all the heads are.
+	size_t FrozenTable::_learnedRank(unsigned long long head) const
+	{
+		size_t count = (size_t)_header->count;
+		size_t segmentCount = (size_t)_header->segmentCount;
+		size_t low = 0;
+		size_t high = segmentCount;
+		while (high - low > 1)
+		{
+			size_t mid = (low + high) / 2;
+			if (_segments[mid].firstHead <= head)
+			{
+				low = mid;
+			}
+			else
+			{
+				high = mid;
+			}
+		}
+		const SFrozenSegment& segment = _segments[low];
+		if (head <= segment.firstHead)
+		{
+			return (size_t)segment.firstRank;
+		}
+		double guess = (double)segment.firstRank + segment.slope * (double)(head - segment.firstHead);
+		double last = (low + 1 < segmentCount) ? (double)_segments[low + 1].firstRank : (double)count;
+		size_t rank = (size_t)((guess < last) ? guess : last);
+		size_t maxError = (size_t)_header->maxError + 1;
+		size_t from = (rank > maxError) ? rank - maxError : 0;
+		size_t to = (rank + maxError + 1 < count) ? rank + maxError + 1 : count;
+		if ((from > 0 && _sortedHeads[from - 1] >= head) || (to < count && _sortedHeads[to] < head))
+		{
+			from = 0;
+			to = count;
+		}
+		return std::lower_bound(_sortedHeads + from, _sortedHeads + to, head) - _sortedHeads;
+	}
+
+	DbObjPtr FrozenTable::_makeRecord(const SFrozenRecord* fr) const
+	{
+		const byte* key = (const byte*)(fr + 1);
+		return new DbObj(key, fr->keyLen, key + fr->keyLen, fr->valueLen);
+	}
+
+	// Find a record given its key.
+	bool FrozenTable::get(const DbObjPtr& key, DbObjPtr& rec) const
+	{
+		if (!isOpen())
+		{
+			return false;
+		}
+		const void* keyData = ((DbObj*)key)->getData();
+		size_t keySize = _probeSize(key);
+		unsigned long long offset = _lowerBound(keyData, keySize);
+		if (offset >= _header->dataEnd)
+		{
+			return false;
+		}
+		const SFrozenRecord* fr = _record(offset);
+		if (0 != _compFunc((const byte*)(fr + 1), fr->keyLen, keyData, keySize))
+		{
+			return false;
+		}
+		rec = _makeRecord(fr);
+		return true;
+	}
+
+	bool FrozenTable::scan(const DbObjPtr& from, scanCallback cbfn, void* context) const
+	{
+		if (!isOpen())
+		{
+			return false;
+		}
+		unsigned long long offset = HEADER_SIZE;
+		if ((DbObj*)from != 0)
+		{
+			const void* keyData = ((DbObj*)from)->getData();
+			size_t keySize = _probeSize(from);
+			offset = _lowerBound(keyData, keySize);
+		}
+		while (offset < _header->dataEnd && cbfn(_makeRecord(_record(offset)), context))
+		{
+			offset = _nextRecord(offset);
+		}
+		return true;
+	}
+}
@@ -0,0 +1,133 @@
+
+
+#if !defined(__frozentable_h)
+#define __frozentable_h
+
+#include "BTreeDB.h"
+
+namespace Database
+{
+	// A read-only copy of a tree, for reference tables that are rebuilt
+	// now and then (build() makes one from a live tree) and only looked
+	// up in between. The file is used as it is, mapped into memory with
+	// nothing to decode:
+	//  - a header;
+	//  - the records, packed one after another in key order, each as its
+	//    key and payload lengths followed by the key and the payload;
+	//  - a search array of one entry per record, in Eytzinger order (the
+	//    layout of an implicit binary heap, so the two entries below the
+	//    one at k are at 2k and 2k + 1). Each entry is the first eight
+	//    bytes of its key after the prefix that all the keys share, as a
+	//    number;
+	//  - where each entry's record is, in the same order;
+	//  - optionally, a learned index: the heads and the places again, in
+	//    key order, and a piecewise linear model of where each head is
+	//    in them.
+	// A search goes down the array with no branch that depends on the
+	// keys (while the first eight bytes are enough to tell them apart),
+	// fetching the cache line of entries three levels below it as it
+	// goes, and only the record that it ends up at is touched. With a
+	// learned index it is instead one guess from the model, and a binary
+	// search of the few heads around the guess. A scan starts where the
+	// search ends and reads the records in order. Any number of threads
+	// can read at once.
+	class FrozenTable : public Database::RefCount
+	{
+	public:
+		typedef bool (*scanCallback)(const DbObjPtr& rec, void* context);
+
+		// The comparison function must be the one that the tree was
+		// built with (0 for the tree's default).
+		FrozenTable(compareFn cfn = 0);
+		~FrozenTable();
+
+	private:
+		struct SFrozenHeader
+		{
+			char magic[8];
+			unsigned long long count;	// records in the table
+			unsigned long long dataEnd;	// the records are from the header to here
+			unsigned long long indexStart;	// the search array, then the places (count + 1 of each)
+			unsigned int byteOrder;		// keys were sorted by the default comparison
+			unsigned int keySize;		// the tree's key size (0 if records say)
+			unsigned long long prefixLen;	// bytes that every key starts with (those of the first key)
+			unsigned long long learnedStart;	// sorted heads, sorted places and segments (0 for none)
+			unsigned long long segmentCount;
+			unsigned long long maxError;	// most records that a guess can be out by
+		};
+
+		// One piece of the learned model. The heads from firstHead up to
+		// the next segment's are guessed to be at firstRank plus slope
+		// times how far they are past firstHead.
+		struct SFrozenSegment
+		{
+			unsigned long long firstHead;
+			unsigned long long firstRank;
+			double slope;
+		};
+
+		// An entry of the search array, with its place, as it is built.
+		struct SFrozenEntry
+		{
+			unsigned long long head;	// first eight bytes of the key, big end first
+			unsigned long long offset;	// where the record is in the file
+		};
+		typedef std::vector<unsigned long long> OFFSETVECTOR;
+
+		struct SFrozenRecord
+		{
+			unsigned int keyLen;
+			unsigned int valueLen;
+		};
+
+		compareFn _compFunc;
+		bool _useHeads;		// heads can be compared rather than keys
+		void* _fileHandle;
+		void* _mapHandle;
+		const byte* _base;
+		const SFrozenHeader* _header;
+		const unsigned long long* _heads;
+		const unsigned long long* _offsets;
+		bool _useLearned;
+		const unsigned long long* _sortedHeads;
+		const unsigned long long* _sortedOffsets;
+		const SFrozenSegment* _segments;
+
+		static unsigned long long _head(const void* key, size_t size, size_t prefixLen);
+		static void _fillIndex(const std::vector<SFrozenEntry>& sorted, OFFSETVECTOR& heads, OFFSETVECTOR& offsets, size_t& next, size_t k);
+		static void _fitSegments(const std::vector<SFrozenEntry>& sorted, size_t maxError, std::vector<SFrozenSegment>& segments);
+		size_t _learnedRank(unsigned long long head) const;
+		const SFrozenRecord* _record(unsigned long long offset) const { return (const SFrozenRecord*)(_base + offset); }
+		unsigned long long _nextRecord(unsigned long long offset) const;
+		unsigned long long _lowerBound(const void* key, size_t size) const;
+		size_t _probeSize(const DbObjPtr& key) const;
+		DbObjPtr _makeRecord(const SFrozenRecord* fr) const;
+
+	public:
+		// With a maximum error, a learned index is added as well, whose
+		// guesses are never out by more than that many records. It is
+		// only added for a tree with the default comparison, whose keys
+		// have different heads (such as ids that go up by one).
+		static bool build(BTreeDB* db, const std::string& fileName, size_t maxError = 0);
+
+		bool open(const std::string& fileName);
+		void close();
+		bool isOpen() const { return _base != 0; }
+
+		bool get(const DbObjPtr& key, DbObjPtr& rec) const;
+
+		// Hand the records from the first one not less than the key
+		// given (or from the start, for a null key) to the callback,
+		// in key order, until it returns false.
+		bool scan(const DbObjPtr& from, scanCallback cbfn, void* context = 0) const;
+
+		size_t getCount() const { return (_header != 0) ? (size_t)_header->count : 0; }
+
+		// Whether searches use the learned index, if the table has one.
+		void setLearnedIndex(bool use) { _useLearned = use; }
+		size_t getSegmentCount() const { return (_header != 0) ? (size_t)_header->segmentCount : 0; }
+	};
+	typedef Database::Ptr<FrozenTable> FrozenTablePtr;
+}
+
+#endif
@@ -0,0 +1,180 @@
+
+
+#include "stdafx.h"
+#include "hashindex.h"
+
+namespace Database
+{
+	// The table starts with this many buckets, and a bucket is split
+	// whenever there are more than LOAD_FACTOR entries per bucket.
+	static const size_t INITIAL_BUCKETS = 16;
+	static const size_t LOAD_FACTOR = 4;
+
+	HashIndex::HashIndex(const std::string& fileName)
+		: _fileName(fileName)
+	{
+		clear();
+	}
+
+	HashIndex::~HashIndex()
+	{
+	}
+
+	// Start again with an empty table.
+	void HashIndex::clear()
+	{
+		_buckets.clear();
+		_buckets.resize(INITIAL_BUCKETS);
+		_level = 0;
+		_next = 0;
+		_count = 0;
+	}
+
+	// Read the entries in from the file, as long as it was saved at the
+	// commit given. The file is just the stamp and the count followed by
+	// the entries, and the table is built up again from them.
+	bool HashIndex::load(unsigned long long stamp)
+	{
+		FILE* f = fopen(_fileName.c_str(), "rb");
+		if (0 == f)
+		{
+			return false;
+		}
+		clear();
+		unsigned long long fileStamp = 0;
+		size_t count = 0;
+		bool ret = (1 == fread(&fileStamp, sizeof(fileStamp), 1, f)) && (fileStamp == stamp);
+		ret = ret && (1 == fread(&count, sizeof(count), 1, f));
+		for (size_t ctr = 0; ret && ctr < count; ctr++)
+		{
+			SHashEntry entry;
+			ret = (1 == fread(&entry, sizeof(entry), 1, f));
+			if (ret)
+			{
+				_insert(entry);
+			}
+		}
+		fclose(f);
+		return ret;
+	}
+
+	bool HashIndex::save(unsigned long long stamp)
+	{
+		FILE* f = fopen(_fileName.c_str(), "wb");
+		if (0 == f)
+		{
+			return false;
+		}
+		bool ret = (1 == fwrite(&stamp, sizeof(stamp), 1, f));
+		ret = ret && (1 == fwrite(&_count, sizeof(_count), 1, f));
+		for (size_t ctr = 0; ret && ctr < _buckets.size(); ctr++)
+		{
+			const BUCKET& bucket = _buckets[ctr];
+			ret = bucket.empty() || (bucket.size() == fwrite(&bucket[0], sizeof(SHashEntry), bucket.size(), f));
+		}
+		return (0 == fclose(f)) && ret;
+	}
+
+	// 64 bit FNV-1a.
+	unsigned long long HashIndex::_hash(const void* key, size_t size)
+	{
+		const unsigned char* p = (const unsigned char*)key;
+		unsigned long long h = 14695981039346656037ULL;
+		for (size_t ctr = 0; ctr < size; ctr++)
+		{
+			h ^= p[ctr];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	// Buckets before the split pointer have already been split, so
+	// they are addressed with the next level's number of buckets.
+	size_t HashIndex::_bucketFor(unsigned long long hash) const
+	{
+		size_t bucket = (size_t)(hash % (INITIAL_BUCKETS << _level));
+		if (bucket < _next)
+		{
+			bucket = (size_t)(hash % (INITIAL_BUCKETS << (_level + 1)));
+		}
+		return bucket;
+	}
+
+	void HashIndex::_insert(const SHashEntry& entry)
+	{
+		_buckets[_bucketFor(entry.hash)].push_back(entry);
+		if (++_count > _buckets.size() * LOAD_FACTOR)
+		{
+			_splitNext();
+		}
+	}
+
+	// Split the bucket at the split pointer into itself and a new bucket
+	// on the end of the table, and move the pointer on. Once every bucket
+	// of this level has been split, the table has doubled.
+	void HashIndex::_splitNext()
+	{
+		BUCKET old;
+		old.swap(_buckets[_next]);
+		_buckets.push_back(BUCKET());
+		if (++_next == (INITIAL_BUCKETS << _level))
+		{
+			++_level;
+			_next = 0;
+		}
+		for (size_t ctr = 0; ctr < old.size(); ctr++)
+		{
+			_buckets[_bucketFor(old[ctr].hash)].push_back(old[ctr]);
+		}
+	}
+
+	// Say which page a key is in, replacing any entry for it already.
+	void HashIndex::set(const void* key, size_t size, long pageId)
+	{
+		SHashEntry entry;
+		entry.hash = _hash(key, size);
+		entry.pageId = pageId;
+		BUCKET& bucket = _buckets[_bucketFor(entry.hash)];
+		for (size_t ctr = 0; ctr < bucket.size(); ctr++)
+		{
+			if (bucket[ctr].hash == entry.hash)
+			{
+				bucket[ctr].pageId = pageId;
+				return;
+			}
+		}
+		_insert(entry);
+	}
+
+	// The page a key was last seen in, or -1 if it isn't known.
+	long HashIndex::find(const void* key, size_t size) const
+	{
+		unsigned long long hash = _hash(key, size);
+		const BUCKET& bucket = _buckets[_bucketFor(hash)];
+		for (size_t ctr = 0; ctr < bucket.size(); ctr++)
+		{
+			if (bucket[ctr].hash == hash)
+			{
+				return bucket[ctr].pageId;
+			}
+		}
+		return -1;
+	}
+
+	// The table doesn't shrink, so buckets are left as they are.
+	void HashIndex::remove(const void* key, size_t size)
+	{
+		unsigned long long hash = _hash(key, size);
+		BUCKET& bucket = _buckets[_bucketFor(hash)];
+		for (size_t ctr = 0; ctr < bucket.size(); ctr++)
+		{
+			if (bucket[ctr].hash == hash)
+			{
+				bucket[ctr] = bucket.back();
+				bucket.pop_back();
+				--_count;
+				return;
+			}
+		}
+	}
+}
@@ -0,0 +1,58 @@
+
+
+#if !defined(__hashindex_h)
+#define __hashindex_h
+
+#include "DbObj.h"
+
+namespace Database
+{
+	// A linear hash table from the hash of a key to the page that holds
+	// the key's record, kept in a file next to the data file, so that a
+	// get for an exact key reads one page instead of searching down the
+	// tree. Only the hash is kept, not the key, so the page has to be
+	// checked for the key: an entry that is out of date (or belongs to
+	// another key with the same hash) just means that the tree is searched.
+	// The table grows a bucket at a time as keys are added. The file is
+	// stamped with the commit it was saved at, and is only loaded at that
+	// commit, as pages that an older index points at may since have been
+	// used again for older copies of the same keys.
+	class HashIndex : public Database::RefCount
+	{
+	public:
+		HashIndex(const std::string& fileName);
+		~HashIndex();
+
+	private:
+		struct SHashEntry
+		{
+			unsigned long long hash;
+			long pageId;
+		};
+		typedef std::vector<SHashEntry> BUCKET;
+
+		std::string _fileName;
+		std::vector<BUCKET> _buckets;
+		size_t _level;		// the table has (INITIAL_BUCKETS << _level) buckets before any split
+		size_t _next;		// next bucket to be split
+		size_t _count;		// number of entries
+
+		static unsigned long long _hash(const void* key, size_t size);
+		size_t _bucketFor(unsigned long long hash) const;
+		void _insert(const SHashEntry& entry);
+		void _splitNext();
+
+	public:
+		void clear();
+		bool load(unsigned long long stamp);
+		bool save(unsigned long long stamp);
+		void set(const void* key, size_t size, long pageId);
+		long find(const void* key, size_t size) const;
+		void remove(const void* key, size_t size);
+
+		size_t getCount() const { return _count; }
+	};
+	typedef Database::Ptr<HashIndex> HashIndexPtr;
+}
+
+#endif
@@ -0,0 +1,184 @@
+
+
+#include "stdafx.h"
+#include "lzcodec.h"
+
+namespace Database
+{
+	static const size_t MIN_MATCH = 4;
+	static const size_t MAX_OFFSET = 65535;
+	static const size_t HASH_BITS = 12;
+
+	static unsigned int _read32(const byte* p)
+	{
+		unsigned int v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static size_t _hash(unsigned int v)
+	{
+		return (v * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	// Write a length that didn't fit in its nibble as a run of bytes,
+	// each 255 except the last. Returns false if there isn't room.
+	static bool _putLength(byte* out, size_t outCap, size_t& op, size_t len)
+	{
+		while (len >= 255)
+		{
+			if (op >= outCap)
+			{
+				return false;
+			}
+			out[op++] = (byte)255;
+			len -= 255;
+		}
+		if (op >= outCap)
+		{
+			return false;
+		}
+		out[op++] = (byte)len;
+		return true;
+	}
+
+	// Read back a length written by _putLength.
+	static bool _getLength(const byte* in, size_t inLen, size_t& ip, size_t& len)
+	{
+		unsigned char b = 255;
+		while (b == 255)
+		{
+			if (ip >= inLen)
+			{
+				return false;
+			}
+			b = (unsigned char)in[ip++];
+			len += b;
+		}
+		return true;
+	}
+
+	// Write one sequence. A match length of zero means this is the last
+	// sequence, which only has literals.
+	static bool _putSequence(byte* out, size_t outCap, size_t& op, const byte* lit, size_t litLen, size_t offset, size_t matchLen)
+	{
+		size_t matchCode = matchLen ? matchLen - MIN_MATCH : 0;
+		if (op >= outCap)
+		{
+			return false;
+		}
+		out[op++] = (byte)(((litLen < 15 ? litLen : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+		if (litLen >= 15 && !_putLength(out, outCap, op, litLen - 15))
+		{
+			return false;
+		}
+		if (op + litLen > outCap)
+		{
+			return false;
+		}
+		memcpy(out + op, lit, litLen);
+		op += litLen;
+		if (matchLen == 0)
+		{
+			return true;
+		}
+		if (op + 2 > outCap)
+		{
+			return false;
+		}
+		out[op++] = (byte)(offset & 0xff);
+		out[op++] = (byte)(offset >> 8);
+		return (matchCode < 15 || _putLength(out, outCap, op, matchCode - 15));
+	}
+
+	// Compress a block. Returns the compressed size, or 0 if the result
+	// wouldn't fit in outCap bytes (the caller keeps the block as it is).
+	size_t LzCodec::compress(const byte* in, size_t inLen, byte* out, size_t outCap)
+	{
+		std::vector<size_t> table((size_t)1 << HASH_BITS, (size_t)-1);
+		size_t ip = 0;
+		size_t op = 0;
+		size_t anchor = 0;
+		while (ip + MIN_MATCH <= inLen)
+		{
+			unsigned int seq = _read32(in + ip);
+			size_t h = _hash(seq);
+			size_t ref = table[h];
+			table[h] = ip;
+			if (ref != (size_t)-1 && ip - ref <= MAX_OFFSET && _read32(in + ref) == seq)
+			{
+				size_t len = MIN_MATCH;
+				while (ip + len < inLen && in[ref + len] == in[ip + len])
+				{
+					++len;
+				}
+				if (!_putSequence(out, outCap, op, in + anchor, ip - anchor, ip - ref, len))
+				{
+					return 0;
+				}
+				ip += len;
+				anchor = ip;
+			}
+			else
+			{
+				++ip;
+			}
+		}
+		if (!_putSequence(out, outCap, op, in + anchor, inLen - anchor, 0, 0))
+		{
+			return 0;
+		}
+		return op;
+	}
+
+	// Decompress a block. Returns the decompressed size, or 0 if the
+	// data is damaged or wouldn't fit in outCap bytes.
+	size_t LzCodec::decompress(const byte* in, size_t inLen, byte* out, size_t outCap)
+	{
+		size_t ip = 0;
+		size_t op = 0;
+		while (ip < inLen)
+		{
+			unsigned char token = (unsigned char)in[ip++];
+			size_t litLen = token >> 4;
+			if (litLen == 15 && !_getLength(in, inLen, ip, litLen))
+			{
+				return 0;
+			}
+			if (ip + litLen > inLen || op + litLen > outCap)
+			{
+				return 0;
+			}
+			memcpy(out + op, in + ip, litLen);
+			ip += litLen;
+			op += litLen;
+			if (ip == inLen)
+			{
+				break;
+			}
+			if (ip + 2 > inLen)
+			{
+				return 0;
+			}
+			size_t offset = (unsigned char)in[ip] | ((size_t)(unsigned char)in[ip + 1] << 8);
+			ip += 2;
+			size_t matchLen = token & 15;
+			if (matchLen == 15 && !_getLength(in, inLen, ip, matchLen))
+			{
+				return 0;
+			}
+			matchLen += MIN_MATCH;
+			if (offset == 0 || offset > op || op + matchLen > outCap)
+			{
+				return 0;
+			}
+
+			// The match can overlap what it is copying, so go a byte at a time.
+			for (size_t ctr = 0; ctr < matchLen; ctr++, op++)
+			{
+				out[op] = out[op - offset];
+			}
+		}
+		return op;
+	}
+}
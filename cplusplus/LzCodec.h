@@ -0,0 +1,24 @@
+
+
+#if !defined(__lzcodec_h)
+#define __lzcodec_h
+
+#include "DbObj.h"
+
+namespace Database
+{
+	// A small, fast LZ77 compressor for pages, in the style of LZ4.
+	// The compressed data is a run of sequences, each of which is a
+	// token byte (literal count in the high nibble, match length less
+	// four in the low nibble), any extra literal count bytes, the
+	// literals, a two byte offset back to the match and any extra match
+	// length bytes. The last sequence stops after its literals.
+	class LzCodec
+	{
+	public:
+		static size_t compress(const byte* in, size_t inLen, byte* out, size_t outCap);
+		static size_t decompress(const byte* in, size_t inLen, byte* out, size_t outCap);
+	};
+}
+
+#endif
@@ -0,0 +1,449 @@
+
+
+#include "stdafx.h"
+#include "memtable.h"
+
+namespace Database
+{
+	// The value size in the log that marks a del.
+	static const unsigned int DELETED = 0xFFFFFFFF;
+
+	// How many records a merge puts into the tree each time it takes
+	// the tree's lock, so that gets on the tree aren't held up for long.
+	static const size_t MERGE_BATCH = 1024;
+
+	MemTable::MemTable(BTreeDB* db, size_t maxBytes)
+		: _db(db)
+		, _maxBytes(maxBytes)
+		, _syncLog(false)
+		, _logName(db->getFileName() + ".wal")
+		, _oldLogName(db->getFileName() + ".wal.old")
+		, _log(0)
+		, _mergeFailed(false)
+	{
+	}
+
+	MemTable::~MemTable()
+	{
+		close();
+	}
+
+	// A checksum of a log entry, as the commit slots have.
+	unsigned int MemTable::_checksum(const SLogEntry& entry, const void* data, size_t size)
+	{
+		unsigned int h = 2166136261U;
+		const unsigned char* p = (const unsigned char*)&entry.keySize;
+		for (size_t ctr = 0; ctr < sizeof(entry.keySize) + sizeof(entry.valueSize); ctr++)
+		{
+			h ^= p[ctr];
+			h *= 16777619U;
+		}
+		p = (const unsigned char*)data;
+		for (size_t ctr = 0; ctr < size; ctr++)
+		{
+			h ^= p[ctr];
+			h *= 16777619U;
+		}
+		return h;
+	}
+
+	// Replay the log left by the last run. A frozen list that may not
+	// have got all the way into the tree is merged again first (putting
+	// a record twice does no harm); then the live list is filled from
+	// its log, which is cut back to the last whole entry.
+	bool MemTable::open()
+	{
+		std::lock_guard<std::mutex> guard(_writeLock);
+		_active = new SkipList(_db->_compFunc);
+		_mergeFailed = false;
+		if (0 == _access(_oldLogName.c_str(), 0))
+		{
+			SkipListPtr old = new SkipList(_db->_compFunc);
+			if (!_replay(_oldLogName, old, false) || !_merge(old, _oldLogName))
+			{
+				return false;
+			}
+		}
+		bool creating = (0 != _access(_logName.c_str(), 06));
+		if (!creating && !_replay(_logName, _active, true))
+		{
+			return false;
+		}
+		_log = fopen(_logName.c_str(), creating ? "w+b" : "r+b");
+		if (0 == _log)
+		{
+			return false;
+		}
+		fseek(_log, 0, SEEK_END);
+		return true;
+	}
+
+	// Put everything into the tree, and let go of the logs.
+	bool MemTable::close()
+	{
+		std::lock_guard<std::mutex> guard(_writeLock);
+		if (0 == _log)
+		{
+			return true;
+		}
+		if (_merger.joinable())
+		{
+			_merger.join();
+		}
+		bool ret = !_mergeFailed || _merge(_frozen, _oldLogName);
+		fclose(_log);
+		_log = 0;
+		ret = ret && _merge(_active, _logName);
+		std::lock_guard<std::mutex> tableGuard(_tableLock);
+		_active = (SkipList*)0;
+		return ret;
+	}
+
+	// Read the entries of a log into a list, up to the first one that
+	// isn't whole. The live log is cut back to there, so that new
+	// entries follow on from the good ones.
+	bool MemTable::_replay(const std::string& fileName, SkipListPtr& list, bool truncate)
+	{
+		FILE* f = fopen(fileName.c_str(), "r+b");
+		if (0 == f)
+		{
+			return false;
+		}
+		fseek(f, 0, SEEK_END);
+		long length = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		long good = 0;
+		std::vector<byte> data;
+		SLogEntry entry;
+		while (1 == fread(&entry, sizeof(entry), 1, f))
+		{
+			bool deleted = (entry.valueSize == DELETED);
+			size_t size = entry.keySize + (deleted ? 0 : (size_t)entry.valueSize);
+			if (entry.keySize == 0 || size > (size_t)(length - good - sizeof(entry)))
+			{
+				break;
+			}
+			data.resize(size);
+			if (1 != fread(&data[0], size, 1, f) || entry.checksum != _checksum(entry, &data[0], size))
+			{
+				break;
+			}
+			list->insert(new DbObj(&data[0], entry.keySize, &data[0] + entry.keySize, size - entry.keySize), entry.keySize, deleted);
+			good = ftell(f);
+		}
+		bool ret = (!truncate || good == length || 0 == _chsize(_fileno(f), good));
+		fclose(f);
+		return ret;
+	}
+
+	// Write a put or del to the log.
+	bool MemTable::_append(const DbObjPtr& rec, size_t keySize, bool deleted)
+	{
+		SLogEntry entry;
+		size_t size = deleted ? keySize : rec->getSize();
+		entry.keySize = (unsigned int)keySize;
+		entry.valueSize = deleted ? DELETED : (unsigned int)(size - keySize);
+		entry.checksum = _checksum(entry, rec->getData(), size);
+		bool ret = (1 == fwrite(&entry, sizeof(entry), 1, _log))
+			&& (1 == fwrite(rec->getData(), size, 1, _log))
+			&& (0 == fflush(_log));
+		return ret && (!_syncLog || 0 == _commit(_fileno(_log)));
+	}
+
+	// The live list is full, so freeze it and start another, with a
+	// log of its own, and start merging it. If the last one is still
+	// being merged, that has to finish first; if it failed, it is tried
+	// again here.
+	bool MemTable::_freeze()
+	{
+		if (_merger.joinable())
+		{
+			_merger.join();
+		}
+		if (_mergeFailed)
+		{
+			if (!_merge(_frozen, _oldLogName))
+			{
+				return false;
+			}
+			_mergeFailed = false;
+		}
+		fclose(_log);
+		_log = 0;
+		if (0 != rename(_logName.c_str(), _oldLogName.c_str()))
+		{
+			_log = fopen(_logName.c_str(), "r+b");
+			if (0 != _log)
+			{
+				fseek(_log, 0, SEEK_END);
+			}
+			return false;
+		}
+		_log = fopen(_logName.c_str(), "w+b");
+		if (0 == _log)
+		{
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> tableGuard(_tableLock);
+			_frozen = _active;
+			_active = new SkipList(_db->_compFunc);
+		}
+		_merger = std::thread(&MemTable::_mergeTask, this);
+		return true;
+	}
+
+	void MemTable::_mergeTask()
+	{
+		_mergeFailed = !_merge(_frozen, _oldLogName);
+	}
+
+	// Put a list's records into the tree, in key order, a batch at a
+	// time. Each node a batch changes is written once, when the batch is
+	// done. Then the tree is flushed (or committed), and the list's log
+	// is no longer needed.
+	bool MemTable::_merge(const SkipListPtr& list, const std::string& logName)
+	{
+		std::lock_guard<std::mutex> mergeGuard(_mergeLock);
+		bool ret = true;
+		const SkipList::SSkipNode* node = list->first();
+		while (node != 0)
+		{
+			BTreeDB::SChangeGuard guard(_db);
+			_db->_drainMessages();
+			_db->_batching = true;
+			for (size_t ctr = 0; node != 0 && ctr < MERGE_BATCH; ctr++)
+			{
+				if (node->deleted)
+				{
+					_db->_del(node->rec);
+				}
+				else
+				{
+					ret = _db->_put(node->rec) && ret;
+				}
+				node = list->nextKey(node);
+			}
+			if (_db->_rebalanceDue())
+			{
+				ret = _db->rebalance() && ret;
+			}
+			_db->_batching = false;
+			ret = _db->_writeBatch() && ret;
+			if (_db->_collectDue())
+			{
+				ret = _db->collectValues() && ret;
+			}
+		}
+		ret = ret && _db->flush();
+		if (ret)
+		{
+			remove(logName.c_str());
+			std::lock_guard<std::mutex> tableGuard(_tableLock);
+			if (_frozen == list)
+			{
+				_frozen = (SkipList*)0;
+			}
+		}
+		return ret;
+	}
+
+	// Put a record, as BTreeDB::put() would. It is checked against
+	// the tree's limits here, as it only gets to the tree later.
+	bool MemTable::put(const DbObjPtr& rec)
+	{
+		size_t keySize = 0;
+		bool outOfLine = false;
+		{
+			BTreeDB::TREEGUARD treeGuard(_db->_treeLock);
+			if (!_db->_checkRecord(rec, keySize, outOfLine))
+			{
+				return false;
+			}
+		}
+		std::lock_guard<std::mutex> guard(_writeLock);
+		if (0 == _log || (_active->getBytes() >= _maxBytes && !_freeze()))
+		{
+			return false;
+		}
+		DbObjPtr copy = new DbObj(*rec);
+		if (!_append(copy, keySize, false))
+		{
+			return false;
+		}
+		_active->insert(copy, keySize, false);
+		return true;
+	}
+
+	bool MemTable::put(const DbObjPtr& key, const DbObjPtr& value)
+	{
+		return put(new DbObj(key->getData(), key->getSize(), value->getData(), value->getSize()));
+	}
+
+	// A del is a tombstone in the list until it is merged, so it can't
+	// tell whether the key was there, and always succeeds (unless the
+	// log can't be written).
+	bool MemTable::del(const DbObjPtr& key)
+	{
+		size_t keySize = _db->_layout.probeSize(key);
+		if (keySize == 0 || keySize > key->getSize())
+		{
+			return false;
+		}
+		DbObjPtr copy = new DbObj(key->getData(), keySize, 0, 0);
+		std::lock_guard<std::mutex> guard(_writeLock);
+		if (0 == _log || (_active->getBytes() >= _maxBytes && !_freeze()))
+		{
+			return false;
+		}
+		if (!_append(copy, keySize, true))
+		{
+			return false;
+		}
+		_active->insert(copy, keySize, true);
+		return true;
+	}
+
+	// The live list is the newest, then the frozen one, then the tree.
+	// The lists are read without a lock; they are held on to here, so a
+	// merge that finishes meanwhile doesn't let go of one under us.
+	bool MemTable::get(const DbObjPtr& key, DbObjPtr& rec)
+	{
+		SkipListPtr lists[2];
+		{
+			std::lock_guard<std::mutex> tableGuard(_tableLock);
+			lists[0] = _active;
+			lists[1] = _frozen;
+		}
+		size_t keySize = _db->_layout.probeSize(key);
+		for (size_t ctr = 0; ctr < 2; ctr++)
+		{
+			const SkipList::SSkipNode* node = ((SkipList*)lists[ctr] != 0) ? lists[ctr]->find(key->getData(), keySize) : 0;
+			if (node != 0)
+			{
+				if (node->deleted)
+				{
+					return false;
+				}
+				rec = new DbObj(*node->rec);
+				return true;
+			}
+		}
+		return _db->get(key, rec);
+	}
+
+	// Find the first record in the tree that isn't less than a key. It
+	// is the last record on the way down that the key goes to the left
+	// of (or the key's own record).
+	void MemTable::_seekTree(const DbObjPtr& from, NodeKeyLocn& locn, DbObjPtr& rec, bool& more)
+	{
+		if ((DbObj*)from == 0)
+		{
+			more = _db->seq(locn, rec);
+			return;
+		}
+		BTreeDB::SChangeGuard guard(_db);
+		_db->_drainMessages();
+		size_t keySize = _db->_layout.probeSize(from);
+		TreeNodePtr node = _db->_root;
+		while (true)
+		{
+			int compVal = 0;
+			size_t pos = node->lowerBound(from->getData(), keySize, _db->_compFunc, compVal);
+			if (pos < node->objCount)
+			{
+				locn.first = node;
+				locn.second = pos;
+				if (compVal == 0)
+				{
+					break;
+				}
+			}
+			if (node->isLeaf)
+			{
+				break;
+			}
+			node = node->loadChild(pos, _db->_store);
+		}
+		more = ((TreeNode*)locn.first != 0);
+		if (more)
+		{
+			rec = _db->_getRecord(locn.first, locn.second);
+		}
+	}
+
+	// Merge the lists and the tree. Where they have the same key, the
+	// live list wins over the frozen one, and both over the tree, and
+	// keys whose newest entry is a del are left out.
+	bool MemTable::scan(const DbObjPtr& from, scanCallback cbfn, void* context)
+	{
+		std::lock_guard<std::mutex> mergeGuard(_mergeLock);
+		SkipListPtr lists[2];
+		{
+			std::lock_guard<std::mutex> tableGuard(_tableLock);
+			lists[0] = _active;
+			lists[1] = _frozen;
+		}
+		const SkipList::SSkipNode* pos[2] = { 0, 0 };
+		for (size_t ctr = 0; ctr < 2; ctr++)
+		{
+			if ((SkipList*)lists[ctr] != 0)
+			{
+				pos[ctr] = ((DbObj*)from == 0) ? lists[ctr]->first() : lists[ctr]->lowerBound(from->getData(), _db->_layout.probeSize(from));
+			}
+		}
+		NodeKeyLocn locn(TreeNodePtr(), (size_t)-1);
+		DbObjPtr treeRec;
+		bool more = false;
+		_seekTree(from, locn, treeRec, more);
+		while (true)
+		{
+			const SkipList::SSkipNode* next = 0;
+			size_t nextList = 0;
+			for (size_t ctr = 0; ctr < 2; ctr++)
+			{
+				if (pos[ctr] != 0 && (next == 0 || lists[ctr]->compare(pos[ctr], next->rec->getData(), next->keySize) < 0))
+				{
+					next = pos[ctr];
+					nextList = ctr;
+				}
+			}
+			if (next == 0 && !more)
+			{
+				return true;
+			}
+			int compVal = 1;
+			if (next != 0)
+			{
+				compVal = more ? lists[nextList]->compare(next, treeRec->getData(), _db->_layout.probeSize(treeRec)) : -1;
+			}
+			DbObjPtr rec;
+			if (compVal <= 0)
+			{
+				if (!next->deleted)
+				{
+					rec = new DbObj(*next->rec);
+				}
+				for (size_t ctr = 0; ctr < 2; ctr++)
+				{
+					while (pos[ctr] != 0 && lists[ctr]->compare(pos[ctr], next->rec->getData(), next->keySize) == 0)
+					{
+						pos[ctr] = lists[ctr]->nextKey(pos[ctr]);
+					}
+				}
+			}
+			else
+			{
+				rec = treeRec;
+			}
+			if (compVal >= 0)
+			{
+				more = _db->seq(locn, treeRec);
+			}
+			if ((DbObj*)rec != 0 && !cbfn(rec, context))
+			{
+				return true;
+			}
+		}
+	}
+}
@@ -0,0 +1,89 @@
+
+
+#if !defined(__memtable_h)
+#define __memtable_h
+
+#include "BTreeDB.h"
+#include "SkipList.h"
+
+namespace Database
+{
+	// A write buffer in front of a tree. Puts and dels go into a sorted
+	// list in memory (dels as tombstones), and each one is appended to a
+	// log file next to the tree's file first, so that nothing is lost if
+	// the process dies before they get to the tree. Gets look in the list
+	// before the tree, and scans merge the two. Once the list has more
+	// than so many bytes in it, it is frozen and a new one is started;
+	// a thread of ours puts the frozen list's records into the tree, in
+	// key order, a batch at a time, with each node that a batch changes
+	// written once, and then flushes the tree and lets go of the list and
+	// its log. So random puts reach the tree as sorted runs, and the
+	// pages they change are written together. If a list fills before the
+	// last one has been merged, puts wait for it.
+	// The log is replayed when the table is opened. The tree must be open
+	// first, and be changed only through the table while it is open; the
+	// table must be closed (which merges everything) before the tree is.
+	class MemTable : public Database::RefCount
+	{
+	public:
+		typedef bool (*scanCallback)(const DbObjPtr& rec, void* context);
+
+		MemTable(BTreeDB* db, size_t maxBytes = 4 * 1024 * 1024);
+		~MemTable();
+
+	private:
+		// The head of each entry in the log. The checksum covers the rest
+		// of the head and the bytes after it, so that an entry that was
+		// only partly written (the last one, after a crash) is dropped.
+		struct SLogEntry
+		{
+			unsigned int checksum;
+			unsigned int keySize;
+			unsigned int valueSize;		// DELETED for a del
+		};
+
+		BTreeDB* _db;
+		size_t _maxBytes;
+		bool _syncLog;
+		std::string _logName;		// log of the live list
+		std::string _oldLogName;	// log of the frozen list, until it is merged
+		FILE* _log;
+		SkipListPtr _active;		// takes the puts and dels
+		SkipListPtr _frozen;		// being merged into the tree, or null
+		bool _mergeFailed;
+		std::mutex _writeLock;		// held by put and del, one at a time
+		std::mutex _tableLock;		// held to change which lists there are
+		std::mutex _mergeLock;		// held while the tree is being merged into, or scanned
+		std::thread _merger;
+
+		static unsigned int _checksum(const SLogEntry& entry, const void* data, size_t size);
+		bool _append(const DbObjPtr& rec, size_t keySize, bool deleted);
+		bool _replay(const std::string& fileName, SkipListPtr& list, bool truncate);
+		bool _freeze();
+		bool _merge(const SkipListPtr& list, const std::string& logName);
+		void _mergeTask();
+		void _seekTree(const DbObjPtr& from, NodeKeyLocn& locn, DbObjPtr& rec, bool& more);
+
+	public:
+		bool open();
+		bool close();
+		bool put(const DbObjPtr& rec);
+		bool put(const DbObjPtr& key, const DbObjPtr& value);
+		bool del(const DbObjPtr& key);
+		bool get(const DbObjPtr& key, DbObjPtr& rec);
+
+		// Hand the records from the first one not less than the key
+		// given (or from the start, for a null key) to the callback,
+		// in key order, until it returns false. Merges wait until the
+		// scan is over; puts and dels carry on, and may or may not be
+		// seen by it.
+		bool scan(const DbObjPtr& from, scanCallback cbfn, void* context = 0);
+
+		// Push each entry in the log to the disk before the put or del
+		// returns, rather than just to the operating system.
+		void setSyncLog(bool sync) { _syncLog = sync; }
+	};
+	typedef Database::Ptr<MemTable> MemTablePtr;
+}
+
+#endif
@@ -0,0 +1,283 @@
+
+
+#include "stdafx.h"
+#include "pagestore.h"
+#include "lzcodec.h"
+#include <windows.h>
+
+namespace Database
+{
+	// Compressed extents are given a little room to grow, so that
+	// a page that is written again usually stays where it is.
+	static const size_t EXTENT_ALIGN = 128;
+
+	PageStore::PageStore(FILE* f, const std::string& fileName, size_t pageSize, bool compressed)
+		: _file(f)
+		, _fileName(fileName)
+		, _pageSize(pageSize)
+		, _compressed(compressed)
+		, _mapName(fileName + ".pmap")
+		, _end(0)
+	{
+		memset(&_stats, 0, sizeof(_stats));
+		_buffer.resize(pageSize);
+	}
+
+	PageStore::~PageStore()
+	{
+	}
+
+	// Load the page map, if there is one.
+	bool PageStore::open(bool creating)
+	{
+		fseek(_file, 0, SEEK_END);
+		_end = ftell(_file);
+		if (!_compressed || creating)
+		{
+			return true;
+		}
+		FILE* mapFile = fopen(_mapName.c_str(), "rb");
+		if (0 == mapFile)
+		{
+			return false;
+		}
+		size_t count = 0;
+		bool ret = (1 == fread(&count, sizeof(count), 1, mapFile));
+		if (ret && count != 0)
+		{
+			_pageMap.resize(count);
+			ret = (1 == fread(&_pageMap[0], sizeof(SExtent) * count, 1, mapFile));
+		}
+		fclose(mapFile);
+
+		// The room between the extents in use can be used again. The
+		// last extent may not have been filled, but its room is spoken for.
+		std::map<long, unsigned int> inUse;
+		for (size_t ctr = 0; ret && ctr < _pageMap.size(); ctr++)
+		{
+			if (_pageMap[ctr].offset >= 0)
+			{
+				inUse[_pageMap[ctr].offset] = _pageMap[ctr].capacity;
+			}
+		}
+		long prevEnd = -1;
+		for (std::map<long, unsigned int>::iterator it = inUse.begin(); it != inUse.end(); ++it)
+		{
+			if (prevEnd >= 0 && it->first > prevEnd)
+			{
+				_freeExtents.insert(std::make_pair((unsigned int)(it->first - prevEnd), prevEnd));
+			}
+			prevEnd = it->first + (long)it->second;
+		}
+		if (prevEnd > _end)
+		{
+			_end = prevEnd;
+		}
+		return ret;
+	}
+
+	// Find room for a new page. Uncompressed pages go on the end of the
+	// file; compressed ones are just given an id, and get an extent when
+	// they are first written.
+	long PageStore::allocate()
+	{
+		std::lock_guard<std::mutex> guard(_ioLock);
+		if (_compressed)
+		{
+			SExtent ext = { -1, 0, 0 };
+			_pageMap.push_back(ext);
+			return (long)_pageMap.size() - 1;
+		}
+		int fh = _fileno(_file);
+		long pos = _filelength(fh);
+		_chsize(fh, (long)(pos + _pageSize));
+		_end = pos + (long)_pageSize;
+		return pos;
+	}
+
+	// Read a page into memory, decompressing it if need be.
+	bool PageStore::read(long pageId, byte* page)
+	{
+		std::lock_guard<std::mutex> guard(_ioLock);
+		return _read(_file, pageId, page, &_buffer[0]);
+	}
+
+	// Read a page through the file handle given, using the buffer
+	// given to decompress it.
+	bool PageStore::_read(FILE* file, long pageId, byte* page, byte* buffer)
+	{
+		long pos = pageId;
+		size_t length = _pageSize;
+		if (_compressed)
+		{
+			if (pageId < 0 || (size_t)pageId >= _pageMap.size() || _pageMap[pageId].offset < 0)
+			{
+				return false;
+			}
+			pos = _pageMap[pageId].offset;
+			length = _pageMap[pageId].length;
+		}
+		if (0 != fseek(file, pos, SEEK_SET))
+		{
+			return false;
+		}
+		byte* into = (length == _pageSize) ? page : buffer;
+		if (1 != fread(into, length, 1, file))
+		{
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> guard(_statsLock);
+			++_stats.pagesRead;
+			_stats.bytesRead += length;
+		}
+		return (into == page || _pageSize == LzCodec::decompress(into, length, page, _pageSize));
+	}
+
+	// Write a page out. A compressed page is written over its old extent
+	// if it still fits there, and otherwise goes on the end of the file.
+	// Pages that don't compress are kept as they are.
+	bool PageStore::write(long pageId, const byte* page)
+	{
+		std::lock_guard<std::mutex> guard(_ioLock);
+		long pos = pageId;
+		const byte* from = page;
+		size_t length = _pageSize;
+		if (_compressed)
+		{
+			if (pageId < 0 || (size_t)pageId >= _pageMap.size())
+			{
+				return false;
+			}
+			size_t packed = LzCodec::compress(page, _pageSize, &_buffer[0], _pageSize - 1);
+			if (packed != 0)
+			{
+				from = &_buffer[0];
+				length = packed;
+			}
+			SExtent& ext = _pageMap[pageId];
+			if (ext.offset < 0 || length > ext.capacity)
+			{
+				_moveExtent(ext, length);
+			}
+			ext.length = (unsigned int)length;
+			pos = ext.offset;
+		}
+		if (0 != fseek(_file, pos, SEEK_SET))
+		{
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> statsGuard(_statsLock);
+			++_stats.pagesWritten;
+			_stats.bytesWritten += length;
+		}
+		return (1 == fwrite(from, length, 1, _file));
+	}
+
+	// Write something that isn't a page (the root's position at the
+	// start of the file), in turn with the pages.
+	bool PageStore::writeAt(long pos, const void* data, size_t size)
+	{
+		std::lock_guard<std::mutex> guard(_ioLock);
+		return (0 == fseek(_file, pos, SEEK_SET)) && (1 == fwrite(data, size, 1, _file));
+	}
+
+	// Find a new home for a page that has outgrown its extent. The old
+	// extent is held back until the next flush has written a map without
+	// it (the map on the disk may still point at it until then), and the
+	// smallest free extent that is big enough is used, or else a new one
+	// is put on the end of the file.
+	void PageStore::_moveExtent(SExtent& ext, size_t length)
+	{
+		if (ext.offset >= 0)
+		{
+			_pendingExtents.push_back(std::make_pair(ext.capacity, ext.offset));
+		}
+		std::multimap<unsigned int, long>::iterator it = _freeExtents.lower_bound((unsigned int)length);
+		if (it != _freeExtents.end())
+		{
+			ext.capacity = it->first;
+			ext.offset = it->second;
+			_freeExtents.erase(it);
+			return;
+		}
+		ext.capacity = (unsigned int)((length + EXTENT_ALIGN - 1) / EXTENT_ALIGN * EXTENT_ALIGN);
+		if (ext.capacity > _pageSize)
+		{
+			ext.capacity = (unsigned int)_pageSize;
+		}
+		ext.offset = _end;
+		_end += ext.capacity;
+	}
+
+	// Push the data file to the disk, and write the page map out. With
+	// compression, the pages go all the way to the disk before the map
+	// that points at them, and once the map is in place, the extents that
+	// pages have moved out of since the last one can be used again.
+	bool PageStore::flush()
+	{
+		std::lock_guard<std::mutex> guard(_ioLock);
+		bool ret = (0 == fflush(_file));
+		if (_compressed)
+		{
+			ret = ret && (0 == _commit(_fileno(_file))) && _writeMap();
+			if (ret)
+			{
+				_freeExtents.insert(_pendingExtents.begin(), _pendingExtents.end());
+				_pendingExtents.clear();
+			}
+		}
+		return ret;
+	}
+
+	// Write the page map to a file of its own, push it to the disk, and
+	// then put it in the place of the old map in one step, so that there
+	// is always a whole map on the disk.
+	bool PageStore::_writeMap()
+	{
+		std::string tempName = _mapName + ".tmp";
+		FILE* mapFile = fopen(tempName.c_str(), "wb");
+		if (0 == mapFile)
+		{
+			return false;
+		}
+		size_t count = _pageMap.size();
+		bool ret = (1 == fwrite(&count, sizeof(count), 1, mapFile));
+		if (count != 0)
+		{
+			ret = (1 == fwrite(&_pageMap[0], sizeof(SExtent) * count, 1, mapFile)) && ret;
+		}
+		ret = (0 == fflush(mapFile)) && (0 == _commit(_fileno(mapFile))) && ret;
+		ret = (0 == fclose(mapFile)) && ret;
+		return ret && MoveFileExA(tempName.c_str(), _mapName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+	}
+
+	// Push the file all the way to the disk, not just out of our buffer,
+	// so that what comes after can't get there first.
+	bool PageStore::sync()
+	{
+		std::lock_guard<std::mutex> guard(_ioLock);
+		return (0 == fflush(_file)) && (0 == _commit(_fileno(_file)));
+	}
+
+	PageReader::PageReader(PageStore* store)
+		: _store(store)
+		, _file(fopen(store->_fileName.c_str(), "rb"))
+		, _buffer(store->_pageSize)
+	{
+	}
+
+	PageReader::~PageReader()
+	{
+		if (_file != 0)
+		{
+			fclose(_file);
+		}
+	}
+
+	bool PageReader::read(long pageId, byte* page)
+	{
+		return (_file != 0) && _store->_read(_file, pageId, page, &_buffer[0]);
+	}
+}
@@ -0,0 +1,103 @@
+
+
+#if !defined(__pagestore_h)
+#define __pagestore_h
+
+#include "DbObj.h"
+
+namespace Database
+{
+	// Counts kept by the page store, so that the cost of compressing
+	// pages can be measured against the I/O that it saves.
+	struct SPageStats
+	{
+		size_t pagesRead;
+		size_t pagesWritten;
+		size_t bytesRead;
+		size_t bytesWritten;
+	};
+
+	// The layer between the tree's nodes and the data file. Nodes are
+	// read, written and allocated by page id. Normally a page id is the
+	// page's offset in the file and every page takes a whole page on the
+	// disk. With compression on, each page is compressed as it is written
+	// and kept in an extent of its own size, and a page map (kept next to
+	// the data file) says where the extent of each page id is. Pages are
+	// always whole in memory. The map on the disk is only ever replaced
+	// whole, and an extent that a page moves out of isn't used again
+	// until a map that doesn't point at it has replaced the old one, so
+	// a crash leaves the last map written pointing at the pages it did.
+	class PageStore : public Database::RefCount
+	{
+		friend class PageReader;
+
+	public:
+		PageStore(FILE* f, const std::string& fileName, size_t pageSize, bool compressed);
+		~PageStore();
+
+	private:
+		// Where a compressed page lives. A page whose length is the
+		// page size is stored as it is.
+		struct SExtent
+		{
+			long offset;
+			unsigned int length;
+			unsigned int capacity;
+		};
+
+		FILE* _file;
+		std::string _fileName;
+		size_t _pageSize;
+		bool _compressed;
+		std::string _mapName;
+		std::vector<SExtent> _pageMap;
+		long _end;		// where the next new extent (or uncompressed page) goes
+		std::multimap<unsigned int, long> _freeExtents;	// free extents by size
+		std::vector<std::pair<unsigned int, long> > _pendingExtents;	// free once the map is written
+
+		void _moveExtent(SExtent& ext, size_t length);
+		bool _writeMap();
+		bool _read(FILE* file, long pageId, byte* page, byte* buffer);
+		std::vector<byte> _buffer;
+		SPageStats _stats;
+		std::mutex _statsLock;		// readers on other threads count their reads too
+		std::mutex _ioLock;		// the store is used by the background flusher as well
+
+	public:
+		bool open(bool creating);
+		long allocate();
+		bool read(long pageId, byte* page);
+		bool write(long pageId, const byte* page);
+		bool writeAt(long pos, const void* data, size_t size);
+		bool flush();
+		bool sync();
+
+		bool isCompressed() const { return _compressed; }
+		size_t getPageCount() const { return _compressed ? _pageMap.size() : (size_t)_end / _pageSize; }
+		const SPageStats& getStats() const { return _stats; }
+	};
+	typedef Database::Ptr<PageStore> PageStorePtr;
+
+	// A handle of its own on a page store's file, so that pages can be
+	// read on another thread at the same time as the store (or other
+	// readers) are reading. Pages mustn't be written while a reader is
+	// in use.
+	class PageReader : public Database::RefCount
+	{
+	public:
+		PageReader(PageStore* store);
+		~PageReader();
+
+	private:
+		PageStore* _store;
+		FILE* _file;
+		std::vector<byte> _buffer;
+
+	public:
+		bool isOpen() const { return _file != 0; }
+		bool read(long pageId, byte* page);
+	};
+	typedef Database::Ptr<PageReader> PageReaderPtr;
+}
+
+#endif
@@ -0,0 +1,213 @@
+
+
+#include "stdafx.h"
+#include "recordcache.h"
+
+namespace Database
+{
+	// Caches smaller than this aren't worth splitting up.
+	static const size_t SHARDS = 16;
+	static const size_t MIN_SHARD = 64;
+
+	// The window holds about one percent of a shard.
+	static const size_t WINDOW_PERCENT = 1;
+
+	// Counters in the sketch stop at 15, and the sketch is halved
+	// after ten counts per record that the shard can hold.
+	static const size_t SKETCH_ROWS = 4;
+	static const unsigned char MAX_COUNT = 15;
+	static const size_t SAMPLE_FACTOR = 10;
+
+	// Records are copied into and out of the cache.
+	static DbObjPtr _copy(const DbObjPtr& rec)
+	{
+		DbObjPtr ret = new DbObj(rec->getData(), rec->getSize());
+		ret->setKeySize(rec->getKeySize());
+		return ret;
+	}
+
+	// The shards are made all at once, since their locks can't be moved.
+	RecordCache::RecordCache(size_t capacity)
+		: _shards(_shardCount(capacity))
+		, _hits(0)
+		, _misses(0)
+	{
+		size_t shards = _shards.size();
+		size_t shardCap = (capacity / shards > 2) ? capacity / shards : 2;
+		for (size_t ctr = 0; ctr < shards; ctr++)
+		{
+			SShard& shard = _shards[ctr];
+			shard.windowCap = shardCap * WINDOW_PERCENT / 100;
+			if (shard.windowCap == 0)
+			{
+				shard.windowCap = 1;
+			}
+			shard.mainCap = shardCap - shard.windowCap;
+			shard.sketchWidth = 16;
+			while (shard.sketchWidth < shardCap)
+			{
+				shard.sketchWidth *= 2;
+			}
+			shard.sketch.assign(SKETCH_ROWS * shard.sketchWidth, 0);
+			shard.samples = 0;
+		}
+	}
+
+	RecordCache::~RecordCache()
+	{
+	}
+
+	size_t RecordCache::_shardCount(size_t capacity)
+	{
+		return (capacity >= SHARDS * MIN_SHARD) ? SHARDS : 1;
+	}
+
+	// 64 bit FNV-1a, with the bits stirred at the end, since the shard
+	// and the sketch rows are taken from different parts of it.
+	unsigned long long RecordCache::_hash(const void* key, size_t size)
+	{
+		const unsigned char* p = (const unsigned char*)key;
+		unsigned long long h = 14695981039346656037ULL;
+		for (size_t ctr = 0; ctr < size; ctr++)
+		{
+			h ^= p[ctr];
+			h *= 1099511628211ULL;
+		}
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	// Count one use of a key in the sketch, halving every counter
+	// once there have been enough counts.
+	void RecordCache::_count(SShard& shard, unsigned long long hash)
+	{
+		for (size_t row = 0; row < SKETCH_ROWS; row++)
+		{
+			unsigned char& counter = shard.sketch[row * shard.sketchWidth + ((hash >> (row * 16)) & (shard.sketchWidth - 1))];
+			if (counter < MAX_COUNT)
+			{
+				++counter;
+			}
+		}
+		if (++shard.samples >= SAMPLE_FACTOR * (shard.windowCap + shard.mainCap))
+		{
+			for (size_t ctr = 0; ctr < shard.sketch.size(); ctr++)
+			{
+				shard.sketch[ctr] >>= 1;
+			}
+			shard.samples /= 2;
+		}
+	}
+
+	// The smallest of a key's counters is the best guess at how often
+	// it has been used.
+	size_t RecordCache::_frequency(const SShard& shard, unsigned long long hash)
+	{
+		size_t ret = MAX_COUNT;
+		for (size_t row = 0; row < SKETCH_ROWS; row++)
+		{
+			size_t counter = shard.sketch[row * shard.sketchWidth + ((hash >> (row * 16)) & (shard.sketchWidth - 1))];
+			if (counter < ret)
+			{
+				ret = counter;
+			}
+		}
+		return ret;
+	}
+
+	// Throw away the least recently used record of a list.
+	void RecordCache::_evict(SShard& shard, ENTRYLIST& list)
+	{
+		shard.index.erase(_entryKey(list.back()));
+		list.pop_back();
+	}
+
+	// Look a key up, giving back a copy of its record if it is cached.
+	bool RecordCache::find(const void* key, size_t size, DbObjPtr& rec)
+	{
+		SKey probe = { key, size, _hash(key, size) };
+		SShard& shard = _shardFor(probe.hash);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		_count(shard, probe.hash);
+		ENTRYMAP::iterator emit = shard.index.find(probe);
+		if (emit == shard.index.end())
+		{
+			++_misses;
+			return false;
+		}
+		ENTRYLIST& list = emit->second->inWindow ? shard.window : shard.main;
+		list.splice(list.begin(), list, emit->second);
+		rec = _copy(emit->second->rec);
+		++_hits;
+		return true;
+	}
+
+	// Add a record that has just been read from the tree. It goes into
+	// the window, and whatever that pushes out of the window has to be
+	// used more often than the main list's least recently used record
+	// to take its place.
+	void RecordCache::insert(const void* key, size_t size, const DbObjPtr& rec)
+	{
+		SKey probe = { key, size, _hash(key, size) };
+		SShard& shard = _shardFor(probe.hash);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		ENTRYMAP::iterator emit = shard.index.find(probe);
+		if (emit != shard.index.end())
+		{
+			emit->second->rec = _copy(rec);
+			return;
+		}
+
+		SEntry entry;
+		entry.key.assign((const char*)key, size);
+		entry.hash = probe.hash;
+		entry.rec = _copy(rec);
+		entry.inWindow = true;
+		shard.window.push_front(entry);
+		shard.index[_entryKey(shard.window.front())] = shard.window.begin();
+		if (shard.window.size() <= shard.windowCap)
+		{
+			return;
+		}
+
+		ENTRYLIST::iterator candidate = --shard.window.end();
+		if (shard.main.size() >= shard.mainCap)
+		{
+			if (shard.mainCap == 0 || _frequency(shard, candidate->hash) <= _frequency(shard, shard.main.back().hash))
+			{
+				_evict(shard, shard.window);
+				return;
+			}
+			_evict(shard, shard.main);
+		}
+		candidate->inWindow = false;
+		shard.main.splice(shard.main.begin(), shard.window, candidate);
+	}
+
+	// Forget a key, because its record has changed or gone.
+	void RecordCache::erase(const void* key, size_t size)
+	{
+		SKey probe = { key, size, _hash(key, size) };
+		SShard& shard = _shardFor(probe.hash);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		ENTRYMAP::iterator emit = shard.index.find(probe);
+		if (emit != shard.index.end())
+		{
+			(emit->second->inWindow ? shard.window : shard.main).erase(emit->second);
+			shard.index.erase(emit);
+		}
+	}
+
+	void RecordCache::clear()
+	{
+		for (size_t ctr = 0; ctr < _shards.size(); ctr++)
+		{
+			std::lock_guard<std::mutex> guard(_shards[ctr].lock);
+			_shards[ctr].index.clear();
+			_shards[ctr].window.clear();
+			_shards[ctr].main.clear();
+		}
+	}
+}
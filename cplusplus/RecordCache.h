@@ -0,0 +1,95 @@
+
+
+#if !defined(__recordcache_h)
+#define __recordcache_h
+
+#include "DbObj.h"
+
+namespace Database
+{
+	// A cache of whole records, by key, in front of the tree, so that a get
+	// for a key that is asked for often doesn't have to search the tree.
+	// The cache is split into shards by the hash of the key, each with a
+	// hash table and a lock of its own, so that it can be used from many
+	// threads without any lock of the tree's, and gets for keys in
+	// different shards don't wait for each other. Each shard is a
+	// W-TinyLFU cache: new records go into a small LRU window, and a
+	// record pushed out of the window only takes a place in the main LRU
+	// list if it has been asked for more often than the record it would
+	// push out of there. How often keys are asked for is counted, roughly,
+	// in a count-min sketch that is halved every so often, so that keys
+	// that were hot a long time ago are forgotten.
+	// The cache holds copies, so records given out can be changed freely.
+	class RecordCache : public Database::RefCount
+	{
+	public:
+		RecordCache(size_t capacity);
+		~RecordCache();
+
+	private:
+		struct SEntry
+		{
+			std::string key;
+			unsigned long long hash;
+			DbObjPtr rec;
+			bool inWindow;
+		};
+		typedef std::list<SEntry> ENTRYLIST;
+
+		// The index is keyed by the bytes of the key where they already
+		// are: in the entry for keys in the cache, and in the caller's
+		// record for keys being looked up, so a lookup copies nothing.
+		struct SKey
+		{
+			const void* data;
+			size_t size;
+			unsigned long long hash;
+		};
+		struct SKeyHash
+		{
+			size_t operator()(const SKey& key) const { return (size_t)key.hash; }
+		};
+		struct SKeyEqual
+		{
+			bool operator()(const SKey& a, const SKey& b) const { return a.size == b.size && memcmp(a.data, b.data, a.size) == 0; }
+		};
+		typedef std::unordered_map<SKey, ENTRYLIST::iterator, SKeyHash, SKeyEqual> ENTRYMAP;
+
+		struct SShard
+		{
+			std::mutex lock;	// held for everything done to the shard
+			ENTRYMAP index;
+			ENTRYLIST window;	// most recently used first
+			ENTRYLIST main;
+			size_t windowCap;
+			size_t mainCap;
+			std::vector<unsigned char> sketch;	// SKETCH_ROWS rows of counters
+			size_t sketchWidth;
+			size_t samples;		// counts since the sketch was last halved
+		};
+
+		std::vector<SShard> _shards;
+		std::atomic<size_t> _hits;
+		std::atomic<size_t> _misses;
+
+		static size_t _shardCount(size_t capacity);
+		static unsigned long long _hash(const void* key, size_t size);
+		static SKey _entryKey(const SEntry& entry) { SKey ret = { entry.key.data(), entry.key.size(), entry.hash }; return ret; }
+		SShard& _shardFor(unsigned long long hash) { return _shards[(size_t)(hash >> 32) % _shards.size()]; }
+		static void _count(SShard& shard, unsigned long long hash);
+		static size_t _frequency(const SShard& shard, unsigned long long hash);
+		static void _evict(SShard& shard, ENTRYLIST& list);
+
+	public:
+		bool find(const void* key, size_t size, DbObjPtr& rec);
+		void insert(const void* key, size_t size, const DbObjPtr& rec);
+		void erase(const void* key, size_t size);
+		void clear();
+
+		size_t getHits() const { return _hits; }
+		size_t getMisses() const { return _misses; }
+	};
+	typedef Database::Ptr<RecordCache> RecordCachePtr;
+}
+
+#endif
@@ -0,0 +1,153 @@
+
+
+#include "stdafx.h"
+#include "skiplist.h"
+
+namespace Database
+{
+	// Each node is on the level above with a chance of one in BRANCHING.
+	static const unsigned int BRANCHING = 4;
+
+	SkipList::SkipList(compareFn cfn)
+		: _compFunc(cfn)
+		, _head(_makeNode(MAX_HEIGHT))
+		, _height(1)
+		, _bytes(0)
+		, _count(0)
+		, _random(0x2545F491)
+	{
+	}
+
+	SkipList::~SkipList()
+	{
+		SSkipNode* node = _head;
+		while (node != 0)
+		{
+			SSkipNode* next = node->next[0].load(std::memory_order_relaxed);
+			size_t height = node->height;
+			node->~SSkipNode();
+			SlabPool::release(node, _nodeSize(height));
+			node = next;
+		}
+	}
+
+	// Make a node with room for the links of each of its levels. The
+	// nodes come from the slab pool, as records do.
+	SkipList::SSkipNode* SkipList::_makeNode(size_t height)
+	{
+		SSkipNode* node = new(SlabPool::allocate(_nodeSize(height))) SSkipNode;
+		node->keySize = 0;
+		node->deleted = false;
+		node->height = height;
+		for (size_t ctr = 0; ctr < height; ctr++)
+		{
+			new(&node->next[ctr]) std::atomic<SSkipNode*>((SSkipNode*)0);
+		}
+		return node;
+	}
+
+	// How many levels a new node is on (xorshift, as only the writer
+	// calls this).
+	size_t SkipList::_randomHeight()
+	{
+		size_t height = 1;
+		while (height < MAX_HEIGHT)
+		{
+			_random ^= _random << 13;
+			_random ^= _random >> 17;
+			_random ^= _random << 5;
+			if (_random % BRANCHING != 0)
+			{
+				break;
+			}
+			++height;
+		}
+		return height;
+	}
+
+	// Whether a node comes before the key given.
+	bool SkipList::_before(const SSkipNode* node, const void* key, size_t size) const
+	{
+		return node != 0 && compare(node, key, size) < 0;
+	}
+
+	// Find the first node that isn't before the key, which is the newest
+	// one for the key if it is there. If prev is given, it is filled in
+	// with the last node before the key on each level.
+	SkipList::SSkipNode* SkipList::_lowerBound(const void* key, size_t size, SSkipNode** prev) const
+	{
+		SSkipNode* node = _head;
+		size_t level = _height.load(std::memory_order_acquire) - 1;
+		while (true)
+		{
+			SSkipNode* next = node->next[level].load(std::memory_order_acquire);
+			if (_before(next, key, size))
+			{
+				node = next;
+			}
+			else
+			{
+				if (prev != 0)
+				{
+					prev[level] = node;
+				}
+				if (level == 0)
+				{
+					return next;
+				}
+				--level;
+			}
+		}
+	}
+
+	// Add a record, or a del if deleted is set (when rec need only hold
+	// the key). It goes in front of anything already there for the key.
+	void SkipList::insert(const DbObjPtr& rec, size_t keySize, bool deleted)
+	{
+		SSkipNode* prev[MAX_HEIGHT];
+		_lowerBound(rec->getData(), keySize, prev);
+		size_t height = _randomHeight();
+		size_t oldHeight = _height.load(std::memory_order_relaxed);
+		for (size_t level = oldHeight; level < height; level++)
+		{
+			prev[level] = _head;
+		}
+
+		// Readers that see the new height before the node is linked in
+		// just find the head's links on those levels empty for now.
+		if (height > oldHeight)
+		{
+			_height.store(height, std::memory_order_release);
+		}
+		SSkipNode* node = _makeNode(height);
+		node->rec = rec;
+		node->keySize = keySize;
+		node->deleted = deleted;
+		for (size_t level = 0; level < height; level++)
+		{
+			node->next[level].store(prev[level]->next[level].load(std::memory_order_relaxed), std::memory_order_relaxed);
+			prev[level]->next[level].store(node, std::memory_order_release);
+		}
+		_bytes.fetch_add(_nodeSize(height) + rec->getSize(), std::memory_order_relaxed);
+		++_count;
+	}
+
+	// The newest node for a key, or 0 if the list has nothing for it.
+	const SkipList::SSkipNode* SkipList::find(const void* key, size_t size) const
+	{
+		const SSkipNode* node = _lowerBound(key, size, 0);
+		return (node != 0 && compare(node, key, size) == 0) ? node : 0;
+	}
+
+	// The first node for the next key after a node's, skipping the older
+	// nodes for the same key.
+	const SkipList::SSkipNode* SkipList::nextKey(const SSkipNode* node) const
+	{
+		const SSkipNode* next = node->next[0].load(std::memory_order_acquire);
+		while (next != 0 && compare(next, node->rec->getData(), node->keySize) == 0)
+		{
+			next = next->next[0].load(std::memory_order_acquire);
+		}
+		return next;
+	}
+}
@@ -0,0 +1,64 @@
+
+
+#if !defined(__skiplist_h)
+#define __skiplist_h
+
+#include "DbObj.h"
+#include "TreeNode.h"
+
+namespace Database
+{
+	// A sorted list of records, for a MemTable. One thread adds to it at
+	// a time, and any number of threads can read it as it is added to,
+	// without a lock: a node is filled in before it is linked in, and it
+	// is linked in from the bottom level up, so a reader either sees it
+	// whole or doesn't see it at all. Nothing is ever taken out; a record
+	// put again goes in front of the old one, and a del is a node that
+	// says so (a tombstone), so the first node for a key is the newest.
+	// The nodes are let go of with the list.
+	class SkipList : public Database::RefCount
+	{
+	public:
+		SkipList(compareFn cfn);
+		~SkipList();
+
+		static const size_t MAX_HEIGHT = 12;
+
+		struct SSkipNode
+		{
+			DbObjPtr rec;		// the record, or just the key for a del
+			size_t keySize;
+			bool deleted;
+			size_t height;
+			std::atomic<SSkipNode*> next[1];	// one for each level the node is on
+		};
+
+	private:
+		compareFn _compFunc;
+		SSkipNode* _head;
+		std::atomic<size_t> _height;	// levels in use
+		std::atomic<size_t> _bytes;
+		size_t _count;
+		unsigned int _random;
+
+		static SSkipNode* _makeNode(size_t height);
+		static size_t _nodeSize(size_t height) { return sizeof(SSkipNode) + (height - 1) * sizeof(std::atomic<SSkipNode*>); }
+		size_t _randomHeight();
+		bool _before(const SSkipNode* node, const void* key, size_t size) const;
+		SSkipNode* _lowerBound(const void* key, size_t size, SSkipNode** prev) const;
+
+	public:
+		void insert(const DbObjPtr& rec, size_t keySize, bool deleted);
+		const SSkipNode* find(const void* key, size_t size) const;
+		const SSkipNode* lowerBound(const void* key, size_t size) const { return _lowerBound(key, size, 0); }
+		const SSkipNode* first() const { return _head->next[0].load(std::memory_order_acquire); }
+		const SSkipNode* nextKey(const SSkipNode* node) const;
+		int compare(const SSkipNode* node, const void* key, size_t size) const { return _compFunc(node->rec->getData(), node->keySize, key, size); }
+
+		size_t getBytes() const { return _bytes.load(std::memory_order_relaxed); }
+		size_t getCount() const { return _count; }
+	};
+	typedef Database::Ptr<SkipList> SkipListPtr;
+}
+
+#endif
@@ -0,0 +1,342 @@
+
+
+#include "stdafx.h"
+#include "slabpool.h"
+
+namespace Database
+{
+	// Sizes up to SMALL_MAX go up in steps of SMALL_STEP, and then double
+	// up to MEDIUM_MAX. Above that they go up a page unit at a time, so
+	// that each page size has blocks of its own.
+	static const size_t SMALL_STEP = 16;
+	static const size_t SMALL_MAX = 256;
+	static const size_t MEDIUM_MAX = 4096;
+	static const size_t LARGE_STEP = 4096;
+	static const size_t LARGE_MAX = 32768;
+	static const size_t MEDIUM_CLASSES = 4;
+	static const size_t CLASSES = SMALL_MAX / SMALL_STEP + MEDIUM_CLASSES + (LARGE_MAX - MEDIUM_MAX) / LARGE_STEP;
+
+	// Slabs start on a cache line, so blocks that are a whole number of
+	// cache lines (pages) are aligned too. A slab holds at least this many
+	// bytes, and at least a few blocks.
+	static const size_t SLAB_ALIGN = 64;
+	static const size_t SLAB_BYTES = 256 * 1024;
+	static const size_t SLAB_MIN_BLOCKS = 8;
+
+	// How many bytes' worth of blocks move between a thread's list and the
+	// shared one at a time, and the most blocks that can move at once.
+	static const size_t BATCH_BYTES = 64 * 1024;
+	static const size_t BATCH_MAX = 64;
+
+	// A free block holds the link to the next one.
+	struct SFreeBlock
+	{
+		SFreeBlock* next;
+	};
+
+	// A slab, and how many of its blocks are out of the shared list (in
+	// use, or on a thread's own list).
+	struct SSlab
+	{
+		char* raw;
+		size_t out;
+	};
+	typedef std::map<char*, SSlab> SLABMAP;
+
+	// The shared state for one block size.
+	struct SSizeClass
+	{
+		size_t blockSize;
+		size_t batch;
+		size_t slabBlocks;
+		std::mutex lock;
+		SFreeBlock* free;
+		size_t freeCount;
+		SLABMAP slabs;		// by the first block
+		size_t emptySlabs;	// slabs with no blocks out
+	};
+
+	struct SSizeClasses
+	{
+		SSizeClass classes[CLASSES];
+
+		SSizeClasses()
+		{
+			for (size_t ctr = 0; ctr < CLASSES; ctr++)
+			{
+				SSizeClass& sc = classes[ctr];
+				if (ctr < SMALL_MAX / SMALL_STEP)
+				{
+					sc.blockSize = (ctr + 1) * SMALL_STEP;
+				}
+				else if (ctr < SMALL_MAX / SMALL_STEP + MEDIUM_CLASSES)
+				{
+					sc.blockSize = SMALL_MAX << (ctr - SMALL_MAX / SMALL_STEP + 1);
+				}
+				else
+				{
+					sc.blockSize = MEDIUM_MAX + (ctr - SMALL_MAX / SMALL_STEP - MEDIUM_CLASSES + 1) * LARGE_STEP;
+				}
+				sc.batch = BATCH_BYTES / sc.blockSize;
+				if (sc.batch > BATCH_MAX)
+				{
+					sc.batch = BATCH_MAX;
+				}
+				if (sc.batch < 2)
+				{
+					sc.batch = 2;
+				}
+				sc.slabBlocks = SLAB_BYTES / sc.blockSize;
+				if (sc.slabBlocks < SLAB_MIN_BLOCKS)
+				{
+					sc.slabBlocks = SLAB_MIN_BLOCKS;
+				}
+				sc.free = 0;
+				sc.freeCount = 0;
+				sc.emptySlabs = 0;
+			}
+		}
+	};
+
+	// The size classes are made the first time they are wanted, and never
+	// destroyed, so that blocks can be given back at any time, even as the
+	// program ends.
+	static SSizeClasses* _sizeClasses()
+	{
+		static SSizeClasses* classes = new SSizeClasses();
+		return classes;
+	}
+
+	// A thread's own free lists. When the thread ends they are handed
+	// back to the shared lists, and any blocks given back after that go
+	// straight to the shared lists.
+	struct SThreadLists
+	{
+		SFreeBlock* heads[CLASSES];
+		size_t counts[CLASSES];
+		bool alive;
+
+		SThreadLists()
+			: alive(true)
+		{
+			memset(heads, 0, sizeof(heads));
+			memset(counts, 0, sizeof(counts));
+		}
+
+		~SThreadLists();
+	};
+
+	static thread_local SThreadLists _threadLists;
+
+	// Find the size class for a size, or (size_t)-1 if it is too big.
+	static size_t _classOf(size_t size)
+	{
+		if (size <= SMALL_MAX)
+		{
+			return (size + SMALL_STEP - 1) / SMALL_STEP - 1;
+		}
+		if (size <= MEDIUM_MAX)
+		{
+			size_t cls = SMALL_MAX / SMALL_STEP;
+			for (size_t bs = SMALL_MAX * 2; bs < size; bs *= 2)
+			{
+				cls++;
+			}
+			return cls;
+		}
+		if (size <= LARGE_MAX)
+		{
+			return SMALL_MAX / SMALL_STEP + MEDIUM_CLASSES + (size - MEDIUM_MAX + LARGE_STEP - 1) / LARGE_STEP - 1;
+		}
+		return (size_t)-1;
+	}
+
+	// Cut a new slab into blocks and put them on the shared list. The
+	// caller holds the class's lock.
+	static void _newSlab(SSizeClass& sc)
+	{
+		char* raw = new char[sc.slabBlocks * sc.blockSize + SLAB_ALIGN];
+		char* block = (char*)(((size_t)raw + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1));
+		SSlab slab = { raw, 0 };
+		sc.slabs.insert(std::make_pair(block, slab));
+		++sc.emptySlabs;
+		for (size_t ctr = 0; ctr < sc.slabBlocks; ctr++, block += sc.blockSize)
+		{
+			((SFreeBlock*)block)->next = sc.free;
+			sc.free = (SFreeBlock*)block;
+		}
+		sc.freeCount += sc.slabBlocks;
+	}
+
+	// The slab that a block was cut from.
+	static SSlab& _slabOf(SSizeClass& sc, void* block)
+	{
+		SLABMAP::iterator sit = sc.slabs.upper_bound((char*)block);
+		return (--sit)->second;
+	}
+
+	// Take a block off the shared list, making a slab first if it is
+	// empty. The caller holds the class's lock.
+	static SFreeBlock* _take(SSizeClass& sc)
+	{
+		if (sc.free == 0)
+		{
+			_newSlab(sc);
+		}
+		SFreeBlock* block = sc.free;
+		sc.free = block->next;
+		--sc.freeCount;
+		if (_slabOf(sc, block).out++ == 0)
+		{
+			--sc.emptySlabs;
+		}
+		return block;
+	}
+
+	// Free the slabs that have no blocks out, but one, taking their
+	// blocks off the shared list. The caller holds the class's lock.
+	static void _trim(SSizeClass& sc)
+	{
+		bool kept = false;
+		std::set<char*> dropping;
+		for (SLABMAP::iterator sit = sc.slabs.begin(); sit != sc.slabs.end(); ++sit)
+		{
+			if (sit->second.out == 0 && kept)
+			{
+				dropping.insert(sit->first);
+			}
+			kept = kept || sit->second.out == 0;
+		}
+		for (SFreeBlock** link = &sc.free; *link != 0; )
+		{
+			SLABMAP::iterator sit = --sc.slabs.upper_bound((char*)*link);
+			if (dropping.count(sit->first) != 0)
+			{
+				*link = (*link)->next;
+				--sc.freeCount;
+			}
+			else
+			{
+				link = &(*link)->next;
+			}
+		}
+		for (std::set<char*>::iterator dit = dropping.begin(); dit != dropping.end(); ++dit)
+		{
+			SLABMAP::iterator sit = sc.slabs.find(*dit);
+			delete[] sit->second.raw;
+			sc.slabs.erase(sit);
+			--sc.emptySlabs;
+		}
+	}
+
+	// Put a block back on the shared list, and give slabs back to the
+	// heap once the empty ones hold half the list. Sweeping the list
+	// then costs no more than twice the blocks that go with the slabs.
+	// The caller holds the class's lock.
+	static void _put(SSizeClass& sc, SFreeBlock* block)
+	{
+		block->next = sc.free;
+		sc.free = block;
+		++sc.freeCount;
+		if (--_slabOf(sc, block).out == 0 && ++sc.emptySlabs >= 2 && 2 * (sc.emptySlabs - 1) * sc.slabBlocks >= sc.freeCount)
+		{
+			_trim(sc);
+		}
+	}
+
+	// Move up to count blocks from a thread's list to the shared one.
+	static void _giveBack(SThreadLists& lists, size_t cls, size_t count)
+	{
+		SSizeClass& sc = _sizeClasses()->classes[cls];
+		std::lock_guard<std::mutex> guard(sc.lock);
+		while (count-- > 0 && lists.heads[cls] != 0)
+		{
+			SFreeBlock* block = lists.heads[cls];
+			lists.heads[cls] = block->next;
+			--lists.counts[cls];
+			_put(sc, block);
+		}
+	}
+
+	SThreadLists::~SThreadLists()
+	{
+		for (size_t cls = 0; cls < CLASSES; cls++)
+		{
+			_giveBack(*this, cls, counts[cls]);
+		}
+		alive = false;
+	}
+
+	// Take a block, from the thread's own list if it has one, or else
+	// fill the thread's list with a batch from the shared one.
+	void* SlabPool::allocate(size_t size)
+	{
+		if (size == 0)
+		{
+			return 0;
+		}
+		size_t cls = _classOf(size);
+		if (cls == (size_t)-1)
+		{
+			return new char[size];
+		}
+		SSizeClass& sc = _sizeClasses()->classes[cls];
+		SThreadLists& lists = _threadLists;
+		if (!lists.alive || lists.heads[cls] == 0)
+		{
+			std::lock_guard<std::mutex> guard(sc.lock);
+			if (!lists.alive)
+			{
+				return _take(sc);
+			}
+			while (lists.counts[cls] < sc.batch && (sc.free != 0 || lists.counts[cls] == 0))
+			{
+				SFreeBlock* block = _take(sc);
+				block->next = lists.heads[cls];
+				lists.heads[cls] = block;
+				++lists.counts[cls];
+			}
+		}
+		SFreeBlock* block = lists.heads[cls];
+		lists.heads[cls] = block->next;
+		--lists.counts[cls];
+		return block;
+	}
+
+	// Put a block on the thread's own list. Once that holds two batches,
+	// one of them goes back to the shared list for other threads to use.
+	void SlabPool::release(void* block, size_t size)
+	{
+		if (block == 0)
+		{
+			return;
+		}
+		size_t cls = _classOf(size);
+		if (cls == (size_t)-1)
+		{
+			delete[] (char*)block;
+			return;
+		}
+		SSizeClass& sc = _sizeClasses()->classes[cls];
+		SThreadLists& lists = _threadLists;
+		SFreeBlock* freed = (SFreeBlock*)block;
+		if (!lists.alive)
+		{
+			std::lock_guard<std::mutex> guard(sc.lock);
+			_put(sc, freed);
+			return;
+		}
+		freed->next = lists.heads[cls];
+		lists.heads[cls] = freed;
+		if (++lists.counts[cls] >= 2 * sc.batch)
+		{
+			_giveBack(lists, cls, sc.batch);
+		}
+	}
+
+	size_t SlabPool::blockSize(size_t size)
+	{
+		size_t cls = _classOf(size);
+		return (cls == (size_t)-1) ? size : _sizeClasses()->classes[cls].blockSize;
+	}
+}
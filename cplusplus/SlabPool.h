@@ -0,0 +1,34 @@
+
+
+#if !defined(__slabpool_h)
+#define __slabpool_h
+
+#include "stdafx.h"
+
+namespace Database
+{
+	// Blocks of memory in a few fixed sizes, cut out of big slabs, for the
+	// nodes, pages and records that the tree makes and lets go of all the
+	// time. A block that is given back goes on a free list for its size and
+	// is used again, so most of them never reach the heap. Each thread
+	// keeps a short free list of each size of its own, and only takes the
+	// pool's lock to hand a batch of blocks over to, or take a batch from,
+	// the list that all the threads share. A slab whose blocks are all
+	// back on the shared list is given back to the heap, once slabs like
+	// that hold at least half of the shared list's blocks (one of them is
+	// kept, so that a size in steady use doesn't make and free a slab over
+	// and over). Blocks sitting on a thread's own list keep their slab, so
+	// a thread can hold on to up to two batches of each size. Sizes above
+	// the largest page are just new'd.
+	class SlabPool
+	{
+	public:
+		static void* allocate(size_t size);
+		static void release(void* block, size_t size);
+
+		// The size of block that a request is rounded up to.
+		static size_t blockSize(size_t size);
+	};
+}
+
+#endif
@@ -0,0 +1,169 @@
+
+
+#include "stdafx.h"
+#include "snapshot.h"
+#include "btreedb.h"
+
+namespace Database
+{
+	// Read the root of the commit. If it can't be read, the snapshot
+	// is left without one, and BTreeDB::beginSnapshot() gives up.
+	Snapshot::Snapshot(BTreeDB* db, unsigned long long txnId, long rootPos)
+		: _db(db)
+		, _txnId(txnId)
+		, _reader(db->_store)
+		, _root(new TreeNode(&db->_layout))
+	{
+		_root->fpos = rootPos;
+		if (!_reader.isOpen() || !_root->read(&_reader))
+		{
+			_root = (TreeNode*)0;
+		}
+	}
+
+	// Let go of the nodes (children and parents point at each other),
+	// and tell the tree that the commit's pages can be used again.
+	Snapshot::~Snapshot()
+	{
+		if ((TreeNode*)_root != 0)
+		{
+			_root->unload();
+		}
+		_db->_endSnapshot(_txnId);
+	}
+
+	// Load a child of a node through our own reader.
+	TreeNodePtr Snapshot::_loadChild(const TreeNodePtr& node, size_t childNo)
+	{
+		TreeNodePtr child = node->children[childNo].node();
+		if ((TreeNode*)child == 0)
+		{
+			child = new TreeNode(node->layout);
+			child->fpos = node->childPageId(childNo);
+			child->childNo = childNo;
+			node->children[childNo] = child;
+		}
+		if (!child->loaded)
+		{
+			if (!child->read(&_reader))
+			{
+				return (TreeNode*)0;
+			}
+			child->parent = node;
+		}
+		return child;
+	}
+
+	// Find a record given its key.
+	bool Snapshot::get(const DbObjPtr& key, DbObjPtr& rec)
+	{
+		TreeNodePtr node = _root;
+		while ((TreeNode*)node != 0)
+		{
+			OBJECTPOS op = node->findPos(key, _db->_compFunc);
+			switch (op.second)
+			{
+			case ECP_INTHIS:
+				rec = _db->_getRecord(node, op.first);
+				return true;
+
+			case ECP_INLEFT:
+				node = _loadChild(node, op.first);
+				break;
+
+			case ECP_INRIGHT:
+				node = _loadChild(node, op.first + 1);
+				break;
+
+			default:
+				return false;
+			}
+		}
+		return false;
+	}
+
+	// Step forwards through the records, as BTreeDB::seq() does. Start
+	// with a null node in locn to get the first record.
+	bool Snapshot::seq(NodeKeyLocn& locn, DbObjPtr& rec)
+	{
+		TreeNodePtr node = locn.first;
+		size_t lastPos = locn.second;
+
+		// From the start, or from a record in an internal node, go down
+		// to the leftmost leaf of the subtree.
+		if ((TreeNode*)node == 0 || !node->isLeaf)
+		{
+			node = ((TreeNode*)node == 0) ? _root : _loadChild(node, lastPos + 1);
+			while ((TreeNode*)node != 0 && !node->isLeaf)
+			{
+				node = _loadChild(node, 0);
+			}
+			if ((TreeNode*)node == 0 || node->objCount == 0)
+			{
+				return false;
+			}
+			rec = _db->_getRecord(node, 0);
+			locn.first = node;
+			locn.second = 0;
+			return true;
+		}
+
+		if (lastPos + 1 < node->objCount)
+		{
+			rec = _db->_getRecord(node, lastPos + 1);
+			locn.second = lastPos + 1;
+			return true;
+		}
+
+		// Finished off a leaf, so go up to the first parent that
+		// has a record to the right of where we came from.
+		size_t childNo = node->childNo;
+		node = node->parent;
+		while ((TreeNode*)node != 0 && childNo >= node->objCount)
+		{
+			childNo = node->childNo;
+			node = node->parent;
+		}
+		if ((TreeNode*)node == 0)
+		{
+			return false;
+		}
+		rec = _db->_getRecord(node, childNo);
+		locn.first = node;
+		locn.second = childNo;
+		return true;
+	}
+
+	// Hand every record to the callback, in key order, until it
+	// returns false. Returns false if a page couldn't be read.
+	bool Snapshot::scan(scanCallback cbfn, void* context)
+	{
+		bool stop = false;
+		return (TreeNode*)_root != 0 && _scan(_root->fpos, cbfn, context, stop);
+	}
+
+	// Scan a subtree. Its nodes are read apart from the ones that seq()
+	// and get() keep, and let go of as soon as they have been scanned, so
+	// a scan of the whole tree doesn't fill the memory.
+	bool Snapshot::_scan(long pageId, scanCallback cbfn, void* context, bool& stop)
+	{
+		TreeNodePtr node = new TreeNode(&_db->_layout);
+		node->fpos = pageId;
+		if (!node->read(&_reader))
+		{
+			return false;
+		}
+		for (size_t ctr = 0; !stop && ctr <= node->objCount; ctr++)
+		{
+			if (!node->isLeaf && !_scan(node->childPos()[ctr], cbfn, context, stop))
+			{
+				return false;
+			}
+			if (!stop && ctr < node->objCount)
+			{
+				stop = !cbfn(_db->_getRecord(node, ctr), context);
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,53 @@
+
+
+#if !defined(__snapshot_h)
+#define __snapshot_h
+
+#include "DbObj.h"
+#include "TreeNode.h"
+#include "PageStore.h"
+
+namespace Database
+{
+	class BTreeDB;
+
+	// A read-only view of a copy-on-write tree as it was at one commit.
+	// The pages of a commit are never written over while a snapshot of it
+	// is open (see BTreeDB::_reclaimPages), so a snapshot reads them
+	// through a file handle of its own, without taking the tree's lock,
+	// and puts and deletes carry on as it reads. A snapshot keeps the
+	// nodes it has read in memory, as the tree does. It should be used by
+	// one thread at a time, and let go of before the tree is closed.
+	class Snapshot : public Database::RefCount
+	{
+		friend class BTreeDB;
+
+	public:
+		typedef bool (*scanCallback)(const DbObjPtr& rec, void* context);
+
+	private:
+		Snapshot(BTreeDB* db, unsigned long long txnId, long rootPos);
+
+	public:
+		~Snapshot();
+
+	private:
+		BTreeDB* _db;
+		unsigned long long _txnId;	// the commit that is being read
+		PageReader _reader;
+		TreeNodePtr _root;
+
+		TreeNodePtr _loadChild(const TreeNodePtr& node, size_t childNo);
+		bool _scan(long pageId, scanCallback cbfn, void* context, bool& stop);
+
+	public:
+		bool get(const DbObjPtr& key, DbObjPtr& rec);
+		bool seq(NodeKeyLocn& locn, DbObjPtr& rec);
+		bool scan(scanCallback cbfn, void* context = 0);
+
+		unsigned long long getTxnId() const { return _txnId; }
+	};
+	typedef Database::Ptr<Snapshot> SnapshotPtr;
+}
+
+#endif
@@ -0,0 +1,136 @@
+
+
+#include "stdafx.h"
+#include "threadpool.h"
+
+namespace Database
+{
+	// Start the workers. With no count given, there is one per core.
+	ThreadPool::ThreadPool(size_t threads)
+		: _queued(0)
+		, _pending(0)
+		, _nextQueue(0)
+		, _stopping(false)
+	{
+		if (threads == 0)
+		{
+			threads = std::thread::hardware_concurrency();
+			if (threads == 0)
+			{
+				threads = 2;
+			}
+		}
+		for (size_t ctr = 0; ctr < threads; ctr++)
+		{
+			_queues.push_back(new SQueue);
+		}
+		for (size_t ctr = 0; ctr < threads; ctr++)
+		{
+			_threads.push_back(std::thread(&ThreadPool::_run, this, ctr));
+		}
+	}
+
+	// Let the workers finish what they have been given, then stop them.
+	ThreadPool::~ThreadPool()
+	{
+		wait();
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			_stopping = true;
+		}
+		_wake.notify_all();
+		for (size_t ctr = 0; ctr < _threads.size(); ctr++)
+		{
+			_threads[ctr].join();
+		}
+		for (size_t ctr = 0; ctr < _queues.size(); ctr++)
+		{
+			delete _queues[ctr];
+		}
+	}
+
+	void ThreadPool::submit(taskFn fn, void* arg)
+	{
+		STask task = { fn, arg };
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			SQueue* queue = _queues[_nextQueue++ % _queues.size()];
+			std::lock_guard<std::mutex> queueGuard(queue->lock);
+			queue->tasks.push_back(task);
+			++_queued;
+			++_pending;
+		}
+		_wake.notify_one();
+	}
+
+	// Wait until every task given so far has finished.
+	void ThreadPool::wait()
+	{
+		std::unique_lock<std::mutex> guard(_lock);
+		while (_pending != 0)
+		{
+			_idle.wait(guard);
+		}
+	}
+
+	// Take a task from the front of our own queue, or else from the back
+	// of someone else's.
+	bool ThreadPool::_take(size_t self, STask& task)
+	{
+		for (size_t ctr = 0; ctr < _queues.size(); ctr++)
+		{
+			SQueue* queue = _queues[(self + ctr) % _queues.size()];
+			std::lock_guard<std::mutex> queueGuard(queue->lock);
+			if (!queue->tasks.empty())
+			{
+				if (ctr == 0)
+				{
+					task = queue->tasks.front();
+					queue->tasks.pop_front();
+				}
+				else
+				{
+					task = queue->tasks.back();
+					queue->tasks.pop_back();
+				}
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void ThreadPool::_run(size_t self)
+	{
+		std::unique_lock<std::mutex> guard(_lock);
+		while (true)
+		{
+			while (_queued == 0 && !_stopping)
+			{
+				_wake.wait(guard);
+			}
+			if (_queued == 0 && _stopping)
+			{
+				return;
+			}
+
+			// Someone else may have got there first, in which case
+			// we just go round again.
+			guard.unlock();
+			STask task;
+			bool got = _take(self, task);
+			guard.lock();
+			if (!got)
+			{
+				continue;
+			}
+			--_queued;
+			guard.unlock();
+			task.fn(task.arg);
+			guard.lock();
+			if (--_pending == 0)
+			{
+				_idle.notify_all();
+			}
+		}
+	}
+}
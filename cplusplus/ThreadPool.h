@@ -0,0 +1,58 @@
+
+
+#if !defined(__threadpool_h)
+#define __threadpool_h
+
+#include "smartptrs.h"
+#include "stdafx.h"
+
+namespace Database
+{
+	// A fixed set of worker threads that run tasks. Each worker has a
+	// queue of its own, and tasks are handed to the queues in turn. A
+	// worker runs the tasks in its own queue from the front, in the order
+	// they were given, and once that is empty it steals from the back of
+	// the other queues, so that a worker with long tasks doesn't hold up
+	// the tasks behind them.
+	class ThreadPool : public Database::RefCount
+	{
+	public:
+		typedef void (*taskFn)(void* arg);
+
+		ThreadPool(size_t threads = 0);
+		~ThreadPool();
+
+	private:
+		struct STask
+		{
+			taskFn fn;
+			void* arg;
+		};
+		struct SQueue
+		{
+			std::mutex lock;
+			std::deque<STask> tasks;
+		};
+
+		std::vector<std::thread> _threads;
+		std::vector<SQueue*> _queues;
+		std::mutex _lock;
+		std::condition_variable _wake;		// there are tasks, or we're stopping
+		std::condition_variable _idle;		// every task has finished
+		size_t _queued;		// tasks waiting in the queues
+		size_t _pending;	// tasks given and not yet finished
+		size_t _nextQueue;
+		bool _stopping;
+
+		void _run(size_t self);
+		bool _take(size_t self, STask& task);
+
+	public:
+		void submit(taskFn fn, void* arg);
+		void wait();
+		size_t getThreadCount() const { return _threads.size(); }
+	};
+	typedef Database::Ptr<ThreadPool> ThreadPoolPtr;
+}
+
+#endif
@@ -5,15 +5,113 @@
 
 namespace Database
 {
+	// Allocate a zeroed page. Pages come from the slab pool, whose blocks
+	// for page sizes start on cache lines, and a page that is let go of
+	// is used again by the next node that is read.
+	static byte* _allocPage(size_t size)
+	{
+		byte* page = (byte*)SlabPool::allocate(size);
+		memset(page, 0, size);
+		return page;
+	}
+
+	static void _freePage(byte* page, size_t size)
+	{
+		SlabPool::release(page, size);
+	}
+
+	// Pages are a whole number of these, and no bigger than the
+	// largest offset that a slot can hold.
+	static const size_t PAGE_UNIT = 4096;
+	static const size_t MAX_PAGE = 32768;
+
+	// Work out the page size for a tree. A page has to hold 2t - 1 of the
+	// largest records, so that the minimum degree still means what it did,
+	// and at least eight of them, so that a node that has been split, topped
+	// up or merged always has room for a couple more. Returns 0 if the
+	// records are too big for any page.
+	size_t NodeLayout::pageSizeFor(size_t recSize, size_t minDegree, bool countRecords)
+	{
+		size_t childSize = countRecords ? 2 * sizeof(long) : sizeof(long);
+		size_t records = minDegree * 2 - 1;
+		if (records < 8)
+		{
+			records = 8;
+		}
+		size_t needed = TreeNode::HEADER_SIZE + records * (sizeof(SSlot) + childSize + recSize) + childSize;
+		size_t pageSz = (needed + PAGE_UNIT - 1) / PAGE_UNIT * PAGE_UNIT;
+		return (pageSz > MAX_PAGE) ? 0 : pageSz;
+	}
+
+	// Set up the sizes that the split and merge decisions are made on.
+	void NodeLayout::init(size_t recSize, size_t keySz, size_t pageSz, bool countRecords)
+	{
+		counted = countRecords;
+		childSize = countRecords ? 2 * sizeof(long) : sizeof(long);
+		keySize = keySz;
+		maxRecSize = recSize;
+		pageSize = pageSz;
+		usable = pageSz - TreeNode::HEADER_SIZE;
+		maxEntry = entrySize(recSize);
+		lowWater = usable / 4;
+		prefixCompare = 0;
+	}
+
+	// How much of an object is key. Records built from a key and a payload
+	// say so themselves; otherwise the tree's key size is used, and a key
+	// that is shorter than that is used whole.
+	size_t NodeLayout::probeSize(const DbObjPtr& key) const
+	{
+		if (key->getKeySize() != 0)
+		{
+			return key->getKeySize();
+		}
+		size_t size = key->getSize();
+		return (keySize != 0 && size > keySize) ? keySize : size;
+	}
+
+	// The first eight bytes of a key, big endian and padded with zeros,
+	// so that comparing two heads orders them the same way as memcmp.
+	static unsigned long long _makeHead(const byte* key, size_t len)
+	{
+		unsigned long long head = 0;
+		for (size_t ctr = 0; ctr < sizeof(head); ctr++)
+		{
+			head <<= 8;
+			if (ctr < len)
+			{
+				head |= (unsigned char)key[ctr];
+			}
+		}
+		return head;
+	}
+
+	// Length of the common prefix of two byte strings.
+	static size_t _commonPrefix(const byte* s1, const byte* s2, size_t len)
+	{
+		size_t ctr = 0;
+		while (ctr < len && s1[ctr] == s2[ctr])
+		{
+			++ctr;
+		}
+		return ctr;
+	}
+
 	// Constructor initialises everything to its default value.
 	// Not that we assume to start with that the node is a leaf,
-	// and it is not loaded from the disk.
-	TreeNode::TreeNode()
+	// and it is not loaded from the disk. The page itself is only
+	// allocated once the node is loaded or allocated.
+	TreeNode::TreeNode(const NodeLayout* nodeLayout)
 		: childNo((size_t)-1)
 		, objCount(0)
 		, isLeaf(true)
 		, loaded(false)
 		, fpos(-1)
+		, layout(nodeLayout)
+		, page(0)
+		, messages(0)
+		, messageBytes(0)
+		, version(0)
 	{
 	}
 
@@ -22,7 +120,7 @@ namespace Database
 	// the loaded children, thus introducing memory leaks.
 	TreeNode::~TreeNode()
 	{
-		TREENODEVECTOR::iterator tnvit = children.begin();
+		CHILDREFVECTOR::iterator tnvit = children.begin();
 		while (tnvit != children.end())
 		{
 			if ((TreeNode*)(*tnvit) != 0)
@@ -31,216 +129,720 @@ namespace Database
 			}
 			++tnvit;
 		}
+		_freePage(page, layout->pageSize);
+		delete messages;
 	}
 
-	// Read a node from the disk
-	bool TreeNode::read(FILE* f, size_t recSize)
+	// Give a brand new node an empty page. This is used for nodes
+	// that are being added to the file rather than read from it.
+	bool TreeNode::allocate()
 	{
-		// Bug out if we don't have a good file.
-		if (!f)
+		if (!page)
 		{
-			return false;
+			page = _allocPage(layout->pageSize);
+			SPageHeader* hdr = (SPageHeader*)page;
+			hdr->heapStart = (unsigned short)layout->pageSize;
+			hdr->prefixOffset = hdr->heapStart;
 		}
+		loaded = true;
+		return true;
+	}
 
-		// get to the right location
-		if (0 != fseek(f, fpos, SEEK_SET))
+	// Read a node from the disk. The page is read as a whole, straight
+	// into memory, and only the header needs to be looked at.
+	bool TreeNode::read(PageStore* store)
+	{
+		// Bug out if we don't have a good store.
+		if (!store)
 		{
 			return false;
 		}
 
-		// read the leaf flag and the object count
-		byte leafFlag = 0;
-		if (1 != fread(&leafFlag, sizeof(byte), 1, f))
+		// read the page
+		if (!page)
+		{
+			page = _allocPage(layout->pageSize);
+		}
+		if (!store->read(fpos, page))
 		{
 			return false;
 		}
-		if (1 != fread(&objCount, sizeof(size_t), 1, f))
+		return _loadPage();
+	}
+
+	// Read a node through a reader of its own, outside of the tree.
+	bool TreeNode::read(PageReader* reader)
+	{
+		if (!page)
+		{
+			page = _allocPage(layout->pageSize);
+		}
+		if (!reader->read(fpos, page))
 		{
 			return false;
 		}
-		isLeaf = (leafFlag == 1);
+		return _loadPage();
+	}
 
-		// read the contents
-		objects.resize(objCount);
-		byte* pBuf = new byte[recSize];
-		for (size_t ctr = 0; ctr < objCount; ctr++)
+	// Read a node from a copy of its page.
+	bool TreeNode::read(const std::vector<byte>& image)
+	{
+		if (!page)
 		{
-			if (1 != fread(pBuf, recSize, 1, f))
-			{
-				delete[] pBuf;	
-				return false;
-			}
-			DbObjPtr pObj = new DbObj(pBuf, recSize);
-			objects[ctr] = pObj;
+			page = _allocPage(layout->pageSize);
 		}
-		delete[] pBuf;	
+		memcpy(page, &image[0], layout->pageSize);
+		return _loadPage();
+	}
+
+	// Pick up what we need from the header of a page that has just
+	// been read.
+	bool TreeNode::_loadPage()
+	{
+		SPageHeader* hdr = (SPageHeader*)page;
+		objCount = hdr->objCount;
+		isLeaf = (hdr->leafFlag == 1);
 
-		// read the addresses of the child pages
-		if (objCount > 0)
+		// The children aren't swizzled until they are visited (see
+		// loadChild), so there are no nodes for them yet.
+		if (!isLeaf)
 		{
-			long* childAddresses = new long[objCount + 1];
-			long* thisChild = childAddresses;
-			memset(childAddresses, 0xff, sizeof(long) * (objCount + 1));
-			if (objCount + 1 != fread(childAddresses, sizeof(long), objCount + 1, f))
-			{
-				delete[] childAddresses;	
-				return false;
-			}
+			long* thisChild = childPos();
+			_reserveChildren();
+			children.clear();
 			children.resize(objCount + 1);
 			for (size_t ctr = 0; ctr <= objCount; ctr++)
 			{
-				TreeNodePtr newNode = new TreeNode;
-				newNode->fpos = *thisChild++;
-				children[ctr] = newNode;
-				newNode->childNo = ctr;
+				children[ctr].unswizzle(*thisChild++);
 			}
-			delete[] childAddresses;	
 		}
 		loaded = true;
 		return true;
 	}
 
 	// Write a node to the disk
-	bool TreeNode::write(FILE* f)
+	bool TreeNode::write(PageStore* store)
 	{
 		// If we're not loaded, we haven't been changed,
 		// so we can say that the flush was successful.
 		if (!loaded)
 		{
-			printf("not load");
 			return true;
-
-
-
 		}
-	    
-		// Can't read without a good file ...
-		if (!f)
+
+		// Can't write without a good store ...
+		if (!store)
 		{
 			return false;
 		}
-
-		// get to the right location
-		if (0 != fseek(f, fpos, SEEK_SET))
+		bool held = isLatched();
+		if (!held)
 		{
-			return false;
+			latch();
+		}
+		_preparePage(store->isCompressed());
+		if (!held)
+		{
+			unlatch();
 		}
 
-		// write the leaf flag and the object count
-		byte leafFlag = isLeaf ? 1 : 0;
-		if (1 != fwrite(&leafFlag, sizeof(byte), 1, f))
+		// write the page
+		return store->write(fpos, page);
+	}
+
+	// Take a copy of the page as write() would write it, so that it can
+	// be written later without the node.
+	bool TreeNode::copyPage(PageStore* store, std::vector<byte>& image)
+	{
+		if (!loaded || !store)
 		{
 			return false;
 		}
-		if (1 != fwrite(&objCount, sizeof(size_t), 1, f))
+		bool held = isLatched();
+		if (!held)
 		{
-			return false;
+			latch();
 		}
-
-		// write the contents
-		DBOBJVECTOR::iterator dovit = objects.begin();
-		while (dovit != objects.end())
+		_preparePage(store->isCompressed());
+		if (!held)
 		{
-			DbObj* pObj = (DbObj*)(*dovit);
-			if (1 != fwrite(pObj->getData(), pObj->getSize(), 1, f))
-			{
-				return false;
-			}
-			++dovit;
+			unlatch();
 		}
+		image.assign(page, page + layout->pageSize);
+		return true;
+	}
 
-		// write the addresses of the child pages
-		if (objCount > 0 && !isLeaf)
+	void TreeNode::_preparePage(bool compressed)
+	{
+		// Bring the header and the addresses of the child pages up
+		// to date, and take the chance to lengthen the shared prefix
+		// if records have gone. Everything else in the page is
+		// already current.
+		compactPrefix();
+		SPageHeader* hdr = (SPageHeader*)page;
+		hdr->objCount = (unsigned short)objCount;
+		hdr->leafFlag = isLeaf ? 1 : 0;
+		if (!isLeaf)
 		{
-			long* childAddresses = new long[objCount + 1];
-			long* thisChild = childAddresses;
-			memset(childAddresses, 0xff, sizeof(long) * (objCount + 1));
-			TREENODEVECTOR::iterator tnvit = children.begin();
-			while (tnvit != children.end())
+			long* thisChild = childPos();
+			for (size_t ctr = 0; ctr <= objCount && ctr < children.size(); ctr++, thisChild++)
 			{
-				if ((TreeNode*)(*tnvit) != 0)
+				TreeNode* child = children[ctr].node();
+				if (child != 0)
 				{
-					*thisChild = (*tnvit)->fpos;
+					*thisChild = child->fpos;
+				}
+				else if (children[ctr].isTagged())
+				{
+					*thisChild = children[ctr].pageId();
 				}
-				++thisChild;
-				++tnvit;
-			}
-			size_t longsWritten = fwrite(childAddresses, sizeof(long), objCount + 1, f);
-			delete[] childAddresses;
-			if (objCount + 1 != longsWritten)
-			{
-				return false;
 			}
 		}
-		return true;
+
+		// Clear the free space in the middle of the page, which
+		// otherwise holds whatever was there before, so that a
+		// compressed page is as small as it can be.
+		if (compressed)
+		{
+			memset((byte*)slot(objCount) + _childBytes(objCount), 0, _freeSpace());
+		}
 	}
 
-	// Load a child node from the disk. This requires that we
-	// have the filepos already in place.
-	TreeNodePtr TreeNode::loadChild(size_t childNo, FILE* f, size_t recSize)
+	// Load a child node from the disk. A child that hasn't been
+	// visited yet has no node, only its page id, so one is made for it
+	// and the reference to it is swizzled.
+	TreeNodePtr TreeNode::loadChild(size_t childNo, PageStore* store)
 	{
-		TreeNodePtr child = children[childNo];
+		TreeNodePtr child = children[childNo].node();
 		if ((TreeNode*)child == 0)
 		{
-			child = new TreeNode;
+			child = new TreeNode(layout);
+			child->fpos = childPageId(childNo);
+			child->childNo = childNo;
 			children[childNo] = child;
 		}
 		if (!child->loaded)
 		{
-			child->read(f, recSize);
+			child->latch();
+			child->read(store);
 			child->parent = this;
+			child->unlatch();
 		}
 		return child;
 	}
 
+	// The page id of a child: the node's own if the child is swizzled,
+	// the one in the tag if it isn't, or else the one in our page.
+	long TreeNode::childPageId(size_t childNo) const
+	{
+		const ChildRef& ref = children[childNo];
+		TreeNode* child = ref.node();
+		if (child != 0)
+		{
+			return child->fpos;
+		}
+		return ref.isTagged() ? ref.pageId() : childPos()[childNo];
+	}
+
 	// Unload a child. This means that we get rid of all
 	// children in the children vector.
 	void TreeNode::unload()
 	{
 		if (loaded)
 		{
-			// Clear out all of the objects
-			DBOBJVECTOR::iterator dovit = objects.begin();
-			while (dovit != objects.end())
-			{
-				*dovit = (DbObj*)0;
-				++dovit;
-			}
-			objects.resize(0);
-
 			// Clear out all of the children
-			TREENODEVECTOR::iterator tnvit = children.begin();
+			CHILDREFVECTOR::iterator tnvit = children.begin();
 			while (!isLeaf && tnvit != children.end())
 			{
-				(*tnvit)->unload();
+				if ((TreeNode*)(*tnvit) != 0)
+				{
+					(*tnvit)->unload();
+				}
 				*tnvit = (TreeNode*)0;
 				++tnvit;
 			}
 			children.resize(0);
 
-			// Empty the parent node and indicate that the
-			// node is no longer loaded.
+			// Let go of the page, empty the parent node and
+			// indicate that the node is no longer loaded.
+			_freePage(page, layout->pageSize);
+			page = 0;
 			parent = (TreeNode*)0;
+			delete messages;
+			messages = 0;
+			messageBytes = 0;
 			loaded = false;
 		}
 	}
 
+	// Change the number of records, moving the child offsets (which
+	// follow the slots) to suit. If the slot array has to grow into space
+	// that is taken up by the cells of records that have gone, the page
+	// is tidied up first.
+	void TreeNode::setCount(size_t newSize)
+	{
+		if (page && newSize != objCount)
+		{
+			size_t oldCount = objCount;
+			if (newSize > oldCount && _freeSpace() < _childBytes(newSize) - _childBytes(oldCount) + (newSize - oldCount) * sizeof(SSlot))
+			{
+				_rebuild(prefix(), prefixLen());
+			}
+			long* oldChildren = childPos();
+			size_t kept = ((newSize < oldCount) ? newSize : oldCount) + 1;
+			std::vector<long> counts;
+			if (!isLeaf && layout->counted)
+			{
+				counts.assign(oldChildren + oldCount + 1, oldChildren + oldCount + 1 + kept);
+				counts.resize(newSize + 1, 0);
+			}
+			objCount = newSize;
+			if (!isLeaf)
+			{
+				memmove(childPos(), oldChildren, kept * sizeof(long));
+				if (layout->counted)
+				{
+					memcpy(childCounts(), &counts[0], counts.size() * sizeof(long));
+				}
+			}
+			if (newSize > oldCount)
+			{
+				memset(slot(oldCount), 0, (newSize - oldCount) * sizeof(SSlot));
+			}
+		}
+		objCount = newSize;
+		if (!isLeaf)
+		{
+			_reserveChildren();
+		}
+		children.resize(newSize + 1);
+	}
+
+	// Make room for as many children as an internal node can have, so
+	// that the vector never moves while an optimistic reader may be
+	// looking at it.
+	void TreeNode::_reserveChildren()
+	{
+		children.reserve(layout->usable / (sizeof(SSlot) + layout->childSize) + 1);
+	}
+
+	// Bytes between the end of the child offsets and the first cell.
+	size_t TreeNode::_freeSpace() const
+	{
+		size_t used = HEADER_SIZE + objCount * sizeof(SSlot) + _childBytes(objCount);
+		size_t heapStart = ((SPageHeader*)page)->heapStart;
+		return (heapStart > used) ? heapStart - used : 0;
+	}
+
+	// Take a cell from the free space in the middle of the page, tidying
+	// the page up first if the free space is in bits. The split and merge
+	// rules make sure that a node never holds more than a page, so there
+	// is always room in the end.
+	unsigned short TreeNode::_allocCell(size_t size)
+	{
+		if (_freeSpace() < size)
+		{
+			_rebuild(prefix(), prefixLen());
+			if (_freeSpace() < size)
+			{
+				return 0;
+			}
+		}
+		SPageHeader* hdr = (SPageHeader*)page;
+		hdr->heapStart = (unsigned short)(hdr->heapStart - size);
+		return hdr->heapStart;
+	}
+
+	// Give a record a new cell, made up of the part of the key that follows
+	// the prefix (given in two pieces) and the payload. The slot is emptied
+	// first so that its old cell isn't kept if the page has to be tidied.
+	void TreeNode::_setCell(size_t objNo, const byte* extra, size_t extraLen, const byte* key, size_t keyLen, const byte* val, size_t valLen, unsigned short flags)
+	{
+		slot(objNo)->offset = 0;
+		unsigned short offset = _allocCell(extraLen + keyLen + valLen);
+		if (offset == 0)
+		{
+			return;
+		}
+		byte* cell = page + offset;
+		if (extraLen != 0)
+		{
+			memcpy(cell, extra, extraLen);
+		}
+		memcpy(cell + extraLen, key, keyLen);
+		memcpy(cell + extraLen + keyLen, val, valLen);
+		SSlot* s = slot(objNo);
+		s->offset = offset;
+		s->keyLen = (unsigned short)(extraLen + keyLen);
+		s->valLen = (unsigned short)valLen;
+		s->flags = flags;
+		s->head = _makeHead(cell, extraLen + keyLen);
+	}
+
+	// Lay the cells out again, packed against the end of the page, with the
+	// prefix given. A shorter prefix puts the bytes that it loses in front of
+	// each suffix; a longer one takes them off. Slots that share a cell (as
+	// they can while records are being shuffled) still share it afterwards.
+	void TreeNode::_rebuild(const byte* newPrefix, size_t newLen)
+	{
+		byte* oldPage = (byte*)SlabPool::allocate(layout->pageSize);
+		memcpy(oldPage, page, layout->pageSize);
+		std::map<unsigned short, SSlot> done;
+		SPageHeader* hdr = (SPageHeader*)page;
+		const byte* oldPrefix = oldPage + hdr->prefixOffset;
+		size_t oldLen = hdr->prefixLen;
+		size_t heap = layout->pageSize - newLen;
+		memmove(page + heap, newPrefix, newLen);
+		hdr->prefixOffset = (unsigned short)heap;
+		hdr->prefixLen = (unsigned short)newLen;
+		for (size_t ctr = 0; ctr < objCount; ctr++)
+		{
+			SSlot* s = slot(ctr);
+			if (s->offset == 0)
+			{
+				continue;
+			}
+			std::map<unsigned short, SSlot>::iterator it = done.find(s->offset);
+			if (it != done.end())
+			{
+				*s = it->second;
+				continue;
+			}
+			const byte* oldCell = oldPage + s->offset;
+			size_t keyLen = (newLen <= oldLen) ? oldLen - newLen + s->keyLen : s->keyLen - (newLen - oldLen);
+			heap -= keyLen + s->valLen;
+			byte* cell = page + heap;
+			if (newLen <= oldLen)
+			{
+				memcpy(cell, oldPrefix + newLen, oldLen - newLen);
+				memcpy(cell + oldLen - newLen, oldCell, s->keyLen + s->valLen);
+			}
+			else
+			{
+				memcpy(cell, oldCell + newLen - oldLen, keyLen + s->valLen);
+			}
+			unsigned short oldOffset = s->offset;
+			s->offset = (unsigned short)heap;
+			s->keyLen = (unsigned short)keyLen;
+			s->head = _makeHead(cell, keyLen);
+			done[oldOffset] = *s;
+		}
+		hdr->heapStart = (unsigned short)heap;
+		SlabPool::release(oldPage, layout->pageSize);
+	}
+
+	// Put the whole key (prefix and suffix) into the buffer given.
+	void TreeNode::getKey(size_t objNo, void* out) const
+	{
+		size_t plen = prefixLen();
+		memcpy(out, prefix(), plen);
+		memcpy((byte*)out + plen, suffix(objNo), suffixSize(objNo));
+	}
+
+	// Build a record (key followed by payload) from its cell.
+	DbObjPtr TreeNode::getRecord(size_t objNo) const
+	{
+		// The suffix and the payload are next to each other in the cell,
+		// so the record is just the prefix followed by the cell.
+		DbObjPtr rec = new DbObj(prefix(), prefixLen(), suffix(objNo), suffixSize(objNo) + valueSize(objNo));
+		rec->setKeySize(keySize(objNo));
+		return rec;
+	}
+
+	// Copy a record out for a reader that doesn't hold the tree's lock.
+	// The slot is checked against the version before the cell it points
+	// to is read, so a node that is changing is never read out of bounds,
+	// and false comes back if the node moved on at any point.
+	bool TreeNode::readRecord(size_t objNo, unsigned long long v, std::vector<byte>& key, std::vector<byte>& value, unsigned short& flags) const
+	{
+		SSlot s = *slot(objNo);
+		size_t plen = prefixLen();
+		const byte* pre = prefix();
+		if (!validate(v))
+		{
+			return false;
+		}
+		key.resize(plen + s.keyLen + 1);
+		memcpy(&key[0], pre, plen);
+		memcpy(&key[plen], page + s.offset, s.keyLen);
+		value.assign(page + s.offset + s.keyLen, page + s.offset + s.keyLen + s.valLen);
+		flags = s.flags;
+		return validate(v);
+	}
+
+	// Store a record in a new cell.
+	void TreeNode::setRecord(size_t objNo, const DbObjPtr& rec, unsigned short flags)
+	{
+		const byte* data = (const byte*)rec->getData();
+		size_t klen = layout->probeSize(rec);
+		slot(objNo)->offset = 0;
+		_fitPrefix(data, klen);
+		size_t plen = prefixLen();
+		_setCell(objNo, 0, 0, data + plen, klen - plen, data + klen, rec->getSize() - klen, flags);
+	}
+
+	// Copy one record from another node (or this one).
+	void TreeNode::copyRecord(size_t objNo, const TreeNode* src, size_t srcNo)
+	{
+		copyRecords(objNo, src, srcNo, 1);
+	}
+
+	// Copy a run of records from another node (or this one). Within a node
+	// only the slots move, and the runs are allowed to overlap. From another
+	// node, our prefix is cut back to what the two nodes share and each
+	// record gets a new cell, with the part of the other node's prefix that
+	// we don't have in front of its suffix.
+	void TreeNode::copyRecords(size_t objNo, const TreeNode* src, size_t srcNo, size_t count)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+		if (src == this)
+		{
+			memmove(slot(objNo), slot(srcNo), count * sizeof(SSlot));
+			return;
+		}
+		for (size_t ctr = 0; ctr < count; ctr++)
+		{
+			slot(objNo + ctr)->offset = 0;
+		}
+		_fitPrefix(src->prefix(), src->prefixLen());
+		size_t plen = prefixLen();
+		size_t extra = src->prefixLen() - plen;
+		for (size_t ctr = 0; ctr < count; ctr++)
+		{
+			size_t from = srcNo + ctr;
+			_setCell(objNo + ctr, src->prefix() + plen, extra, src->suffix(from), src->suffixSize(from),
+				src->value(from), src->valueSize(from), src->slot(from)->flags);
+		}
+	}
+
+	// Make sure that the key (or key prefix) given starts with our
+	// prefix, cutting the prefix back if it doesn't.
+	void TreeNode::_fitPrefix(const void* fullKey, size_t len)
+	{
+		size_t plen = prefixLen();
+		size_t common = _commonPrefix(prefix(), (const byte*)fullKey, (len < plen) ? len : plen);
+		if (common < plen)
+		{
+			_rebuild(prefix(), common);
+		}
+	}
+
+	// Make the prefix as long as it can be. Because the keys are in
+	// byte order, what the first and last keys share is shared by all
+	// of them. This is only done when the tree's comparator is the
+	// byte order one.
+	void TreeNode::compactPrefix()
+	{
+		if (!layout->prefixCompare || !page)
+		{
+			return;
+		}
+		size_t plen = prefixLen();
+		if (objCount == 0)
+		{
+			if (plen != 0)
+			{
+				_rebuild(prefix(), 0);
+			}
+			return;
+		}
+		size_t last = objCount - 1;
+		size_t len = (suffixSize(0) < suffixSize(last)) ? suffixSize(0) : suffixSize(last);
+		size_t common = plen + _commonPrefix(suffix(0), suffix(last), len);
+		if (common > plen)
+		{
+			std::vector<byte> newPrefix(keySize(0) + 1);
+			getKey(0, &newPrefix[0]);
+			_rebuild(&newPrefix[0], common);
+		}
+	}
+
+	// Bytes the node would take up if every key were stored whole.
+	size_t TreeNode::logicalSize() const
+	{
+		size_t total = layout->childSize;
+		for (size_t ctr = 0; ctr < objCount; ctr++)
+		{
+			total += entrySize(ctr);
+		}
+		return total;
+	}
+
+	// A node is full when it might not have room for two more of the
+	// largest records: one that is inserted or moved up from a child,
+	// and one that replaces a record that is deleted.
+	bool TreeNode::isFull() const
+	{
+		return logicalSize() + 2 * layout->maxEntry > layout->usable;
+	}
+
+	// A node is safe to delete from (or under) when it won't end up empty,
+	// and is at least a quarter full.
+	bool TreeNode::isSafe() const
+	{
+		return objCount >= 2 && logicalSize() >= layout->lowWater;
+	}
+
+	// A node can lend a record to a sibling if it is still safe afterwards.
+	bool TreeNode::canLend() const
+	{
+		return objCount >= 2 && logicalSize() >= layout->lowWater + layout->maxEntry;
+	}
+
+	// Choose the record that moves up when the node is split. The two halves
+	// are kept within a record's size of each other, and inside that range
+	// the shortest record is picked, which keeps the upper levels small.
+	size_t TreeNode::splitPoint() const
+	{
+		size_t total = 0;
+		for (size_t ctr = 0; ctr < objCount; ctr++)
+		{
+			total += entrySize(ctr);
+		}
+		size_t best = 1;
+		size_t bestSize = (size_t)-1;
+		size_t left = 0;
+		for (size_t ctr = 0; ctr < objCount; ctr++)
+		{
+			size_t size = entrySize(ctr);
+			size_t right = total - left - size;
+			size_t diff = (left > right) ? left - right : right - left;
+			if (ctr >= 1 && ctr + 2 <= objCount && diff <= layout->maxEntry && size < bestSize)
+			{
+				best = ctr;
+				bestSize = size;
+			}
+			left += size;
+		}
+		return best;
+	}
+
+	// Move a child reference (whether or not the child is loaded)
+	// from one slot to another, possibly in another node.
+	void TreeNode::moveChild(size_t childNo, TreeNode* src, size_t srcNo)
+	{
+		children[childNo] = src->children[srcNo];
+		childPos()[childNo] = src->childPos()[srcNo];
+		TreeNode* mover = children[childNo].node();
+		if (layout->counted)
+		{
+			childCounts()[childNo] = src->childCounts()[srcNo];
+		}
+		if ((TreeNode*)mover != 0)
+		{
+			mover->childNo = childNo;
+			if (src != this && mover->loaded)
+			{
+				mover->parent = this;
+			}
+		}
+	}
+
+	// The number of records in the subtree under this node. Only
+	// kept up to date if the tree counts records.
+	size_t TreeNode::subtreeCount() const
+	{
+		size_t ret = objCount;
+		for (size_t ctr = 0; !isLeaf && ctr <= objCount; ctr++)
+		{
+			ret += childCounts()[ctr];
+		}
+		return ret;
+	}
+
 	// Delete a child from a given node.
 	bool TreeNode::delFromLeaf(size_t objNo)
 	{
 		bool ret = isLeaf;
 		if (ret)
 		{
-			objects[objNo] = (DbObj*)0;
-			for (size_t ctr = objNo + 1; ctr < objCount; ctr++)
-			{
-				objects[ctr - 1] = objects[ctr];
-			}
+			copyRecords(objNo, this, objNo + 1, objCount - objNo - 1);
 			setCount(objCount - 1);
 		}
 		return ret;
 	}
-	
+
+	// Compare a probe with the whole key (prefix and suffix) of a record.
+	int TreeNode::compareKey(size_t objNo, const void* probe, size_t probeSize, compareFn cfn) const
+	{
+		size_t klen = keySize(objNo);
+		if (prefixLen() == 0)
+		{
+			return cfn(probe, probeSize, suffix(objNo), klen);
+		}
+		std::vector<byte> fullKey(klen + 1);
+		getKey(objNo, &fullKey[0]);
+		return cfn(probe, probeSize, &fullKey[0], klen);
+	}
+
+	// Binary search for the first key that is not less than the probe,
+	// leaving the result of comparing the probe with that key in compVal.
+	// With the byte order comparator the probe is checked against the
+	// prefix once, and after that it is compared with the heads in the
+	// slots, only going to a cell when the heads are the same. Any other
+	// comparator has to see whole keys.
+	// Given a version to check (only with the byte order comparator), the
+	// node is validated before each cell is read, and the search gives up
+	// early if it has moved on; the caller finds that out by validating.
+	size_t TreeNode::lowerBound(const void* probe, size_t probeSize, compareFn cfn, int& compVal, const unsigned long long* checkVersion) const
+	{
+		size_t plen = prefixLen();
+		bool byBytes = (cfn == layout->prefixCompare);
+		size_t lo = 0;
+		size_t hi = objCount;
+		compVal = 1;
+		if (plen > 0 && byBytes && objCount > 0)
+		{
+			size_t len = (probeSize < plen) ? probeSize : plen;
+			const byte* pre = prefix();
+			if (checkVersion != 0 && !validate(*checkVersion))
+			{
+				return 0;
+			}
+			int prefixVal = cfn(probe, len, pre, len);
+			if (prefixVal != 0 || probeSize < plen)
+			{
+				compVal = (prefixVal != 0) ? prefixVal : -1;
+				return (prefixVal > 0) ? objCount : 0;
+			}
+			probe = (const byte*)probe + plen;
+			probeSize -= plen;
+		}
+		unsigned long long head = byBytes ? _makeHead((const byte*)probe, probeSize) : 0;
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			int midVal = 0;
+			if (byBytes)
+			{
+				SSlot s = *slot(mid);
+				if (head == s.head && checkVersion != 0 && !validate(*checkVersion))
+				{
+					compVal = 1;
+					return 0;
+				}
+				midVal = (head < s.head) ? -1 : (head > s.head) ? 1 : cfn(probe, probeSize, page + s.offset, s.keyLen);
+			}
+			else
+			{
+				midVal = compareKey(mid, probe, probeSize, cfn);
+			}
+			if (midVal > 0)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+				compVal = midVal;
+			}
+		}
+		return lo;
+	}
+
 	// Find the position of the object in a node. If the key is at pos
 	// the function returns (pos, ECP_INTHIS). If the key is in a child to
 	// the left of pos, the function returns (pos, ECP_INLEFT). If the node
@@ -249,35 +851,24 @@ namespace Database
 	// The main assumption here is that we won't be searching for a key
 	// in this node unless it (a) is not in the tree, or (b) it is in the
 	// subtree rooted at this node.
-	OBJECTPOS TreeNode::findPos(const DbObjPtr& key, compareFn cfn)
+	OBJECTPOS TreeNode::findPos(const DbObjPtr& key, compareFn cfn, const unsigned long long* checkVersion)
 	{
 		OBJECTPOS ret((size_t)-1, ECP_NONE);
-		DBOBJVECTOR::iterator dovit = objects.begin();
-		size_t ctr = 0;
-		while (dovit < objects.end())
+		size_t probeSize = layout->probeSize(key);
+		int compVal = 1;
+		size_t lo = lowerBound(key->getData(), probeSize, cfn, compVal, checkVersion);
+		if (lo < objCount && compVal == 0)
 		{
-			int compVal = cfn(key, *dovit);
-			if (compVal == 0)
-			{
-				return OBJECTPOS(ctr, ECP_INTHIS);
-			}
-			else if (compVal < 0)
-			{
-				if (isLeaf)
-				{
-					return ret;
-				}
-				else
-				{
-					return OBJECTPOS(ctr, ECP_INLEFT);
-				}
-			}
-			++dovit, ++ctr;
+			return OBJECTPOS(lo, ECP_INTHIS);
 		}
 		if (!isLeaf)
 		{
-			return OBJECTPOS(ctr - 1, ECP_INRIGHT);
+			if (lo < objCount)
+			{
+				return OBJECTPOS(lo, ECP_INLEFT);
+			}
+			return OBJECTPOS(lo - 1, ECP_INRIGHT);
 		}
 		return ret;
 	}
-}
\ No newline at end of file
+}
@@ -4,11 +4,14 @@
 #define __treenode_h
 
 #include "DbObj.h"
+#include "PageStore.h"
 
 namespace Database
 {
-	// Function type used for object comparison callbacks.
-	typedef int (*compareFn)(const DbObjPtr&, const DbObjPtr&);
+	// Function type used for key comparison callbacks. Keys are compared
+	// as raw bytes, straight out of a node's page, so that searching
+	// a node never has to build a DbObj per record.
+	typedef int (*compareFn)(const void* key1, size_t size1, const void* key2, size_t size2);
 
 	// Where (from a given child) does the key lay?
 	enum EChildPos
@@ -20,35 +23,203 @@ namespace Database
 	};
 	typedef std::pair<size_t, EChildPos> OBJECTPOS;
 
+	// Nodes are kept in memory exactly as they are stored on the disk,
+	// in a single aligned page, so reading a node is one read of the page
+	// with no decoding. Pages are slotted: after the header comes an array
+	// of small fixed size slots, one per record in key order, and then (in
+	// internal nodes) the child offsets in an array parallel to the slots.
+	// The keys and payloads themselves are kept in cells allocated from the
+	// end of the page downwards, so both can be of any length. Each slot
+	// holds the first few bytes of its key, so that searching a node mostly
+	// stays inside the slot array.
+	// The bytes that all of the keys in a node share are stored once, as
+	// the node's prefix, and each cell only holds what follows it.
+	struct SPageHeader
+	{
+		unsigned short objCount;
+		unsigned short prefixLen;
+		unsigned short prefixOffset;
+		unsigned short heapStart;	// lowest byte used by a cell
+		byte leafFlag;
+	};
+
+	struct SSlot
+	{
+		unsigned short offset;	// where the cell is, or 0 for an empty slot
+		unsigned short keyLen;	// bytes of key after the prefix
+		unsigned short valLen;	// bytes of payload
+		unsigned short flags;
+		unsigned long long head;	// first bytes of key after the prefix, big endian
+	};
+
+	// Bits in a slot's flags.
+	enum ESlotFlag
+	{
+		ESF_VALUEPTR = 0x0001	// the payload is an SValuePtr into the value log
+	};
+
+	// Describes the pages of a tree. Splits and merges are decided on the
+	// number of bytes in a node rather than the number of records. The sizes
+	// used are those of the records with their whole keys, which is never less
+	// than what the page really holds, so re-encoding a node's prefix can't
+	// overflow the page.
+	struct NodeLayout
+	{
+		size_t keySize;		// key size of records that don't carry one, or 0
+		size_t maxRecSize;	// largest record (key and payload) that can be stored
+		size_t pageSize;	// total number of bytes in a page
+		size_t usable;		// bytes in a page after the header
+		size_t maxEntry;	// most bytes one record takes, with its slot and child
+		size_t lowWater;	// nodes with fewer bytes are topped up on delete
+		compareFn prefixCompare;	// byte order comparator, or 0 if prefixes aren't grown
+		bool counted;		// whether internal nodes keep the record count of each child
+		size_t childSize;	// bytes per child in an internal node
+
+		void init(size_t recSize, size_t keySz, size_t pageSz, bool countRecords = false);
+		static size_t pageSizeFor(size_t recSize, size_t minDegree, bool countRecords = false);
+		size_t entrySize(size_t recSize) const { return sizeof(SSlot) + childSize + recSize; }
+		size_t probeSize(const DbObjPtr& key) const;
+	};
+
+	class TreeNode;
+
+	// A reference from a node to one of its children. Until the child is
+	// visited it holds the child's page id, tagged by setting the low bit;
+	// once the child is in memory it is swizzled, and holds a (counted)
+	// pointer to the node instead, so that a search that has everything
+	// in memory just follows pointers. Evicting the child unswizzles the
+	// reference again. The word is atomic, so readers that don't lock the
+	// tree can follow it too. An empty reference (as setCount leaves)
+	// means that the child's page id is only in the node's page.
+	class ChildRef
+	{
+	public:
+		ChildRef() : _ref(0) {}
+		ChildRef(const ChildRef& other);
+		~ChildRef() { _set(0); }
+		ChildRef& operator=(const ChildRef& other);
+		ChildRef& operator=(TreeNode* node);
+		operator TreeNode*() const { return node(); }
+		TreeNode* operator->() const { return node(); }
+
+		// The node, or 0 if the child isn't swizzled.
+		TreeNode* node() const
+		{
+			size_t ref = _ref.load(std::memory_order_acquire);
+			return (ref & TAG) ? 0 : (TreeNode*)ref;
+		}
+		bool isTagged() const { return (_ref.load(std::memory_order_relaxed) & TAG) != 0; }
+		long pageId() const { return (long)((ptrdiff_t)_ref.load(std::memory_order_relaxed) >> 1); }
+		void unswizzle(long pageId) { _set(((size_t)pageId << 1) | TAG); }
+
+	private:
+		static const size_t TAG = 1;
+		std::atomic<size_t> _ref;
+
+		void _set(size_t ref);
+	};
+	typedef std::vector<ChildRef> CHILDREFVECTOR;
+
+	// Puts and dels waiting in a node's buffer to go further down the
+	// tree (see BTreeDB::setMessageBuffers), by key. A put keeps the whole
+	// record; a del is a null record.
+	typedef std::map<std::string, DbObjPtr> MESSAGEMAP;
+
 	// A BTreeDB is made up of a collection of nodes. A node
 	// contains information about which of its parent's children
 	// is, how many objects it has, whether or not it's a leaf,
 	// where it lives on the disk, whether or not it's actually
-	// been loaded from the disk, a collection of records,
-	// and (if it's not a leaf) a collection of children.
+	// been loaded from the disk, the page holding its records,
+	// and (if it's not a leaf) a collection of children, which
+	// are null until they are first visited.
 	// It also contains a ptr to its parent.
 	class TreeNode : public Database::RefCount
 	{
 	public:
-		TreeNode();
+		TreeNode(const NodeLayout* nodeLayout);
 		~TreeNode();
-		Database::Ptr<TreeNode> loadChild(size_t childNo, FILE* f, size_t recSize);
+
+		// Nodes come from the slab pool, as one is made for every child
+		// of every node that is read.
+		static void* operator new(size_t size) { return SlabPool::allocate(size); }
+		static void operator delete(void* p, size_t size) { SlabPool::release(p, size); }
+
+		Database::Ptr<TreeNode> loadChild(size_t childNo, PageStore* store);
 		void unload();
 		void unloadChildren();
-		bool read(FILE* datafile, size_t recSize);  
-		bool write(FILE* f);
+		bool allocate();
+		bool read(PageStore* store);
+		bool read(PageReader* reader);
+		bool read(const std::vector<byte>& image);
+		bool write(PageStore* store);
+		bool copyPage(PageStore* store, std::vector<byte>& image);
 		bool delFromLeaf(size_t objNo);
-		OBJECTPOS findPos(const DbObjPtr& key, compareFn cfn);
+		OBJECTPOS findPos(const DbObjPtr& key, compareFn cfn, const unsigned long long* checkVersion = 0);
+		size_t lowerBound(const void* probe, size_t probeSize, compareFn cfn, int& compVal, const unsigned long long* checkVersion = 0) const;
+		int compareKey(size_t objNo, const void* probe, size_t probeSize, compareFn cfn) const;
+		void compactPrefix();
+
+		// Readers that don't lock the tree (see BTreeDB::setOptimisticReads)
+		// take a node's version before they read it, and check afterwards
+		// that it hasn't moved on. The version is odd while the node is
+		// latched for a change. Only one thread changes the tree at a time.
+		bool readVersion(unsigned long long& v) const { v = version.load(std::memory_order_acquire); return (v & 1) == 0; }
+		bool validate(unsigned long long v) const { std::atomic_thread_fence(std::memory_order_acquire); return version.load(std::memory_order_relaxed) == v; }
+		bool isLatched() const { return (version.load(std::memory_order_relaxed) & 1) != 0; }
+		void latch() { version.fetch_add(1); }
+		void unlatch() { version.fetch_add(1, std::memory_order_release); }
+		bool readRecord(size_t objNo, unsigned long long v, std::vector<byte>& key, std::vector<byte>& value, unsigned short& flags) const;
 
 		// This count is the number of objects in the node, rather than the
 		// number of children in the node. It should only be used when splitting
-		// or joining nodes.
-		void setCount(size_t newSize)
-		{
-			objCount = newSize;
-			objects.resize(newSize);
-			children.resize(newSize + 1);
-		}
+		// or joining nodes. New slots are empty until a record is put in them.
+		void setCount(size_t newSize);
+
+		// Accessors for the page. The cell of each record holds the part of
+		// its key that follows the prefix, and then the payload. If the tree
+		// counts records, the child offsets are followed by the number of
+		// records under each child.
+		SSlot* slot(size_t objNo) const { return (SSlot*)(page + HEADER_SIZE) + objNo; }
+		size_t prefixLen() const { return ((SPageHeader*)page)->prefixLen; }
+		byte* prefix() const { return page + ((SPageHeader*)page)->prefixOffset; }
+		size_t suffixSize(size_t objNo) const { return slot(objNo)->keyLen; }
+		byte* suffix(size_t objNo) const { return page + slot(objNo)->offset; }
+		size_t keySize(size_t objNo) const { return prefixLen() + slot(objNo)->keyLen; }
+		size_t valueSize(size_t objNo) const { return slot(objNo)->valLen; }
+		byte* value(size_t objNo) const { return suffix(objNo) + slot(objNo)->keyLen; }
+		long* childPos() const { return (long*)slot(objCount); }
+		long childPageId(size_t childNo) const;
+		long* childCounts() const { return childPos() + objCount + 1; }
+		size_t subtreeCount() const;
+		void getKey(size_t objNo, void* out) const;
+
+		// Sizes used to decide when nodes are split, topped up or merged.
+		size_t entrySize(size_t objNo) const { return layout->entrySize(keySize(objNo) + valueSize(objNo)); }
+		size_t logicalSize() const;
+		bool isFull() const;
+		bool isSafe() const;
+		bool canLend() const;
+		size_t splitPoint() const;
+
+		// Record level helpers. A record is the key followed by the payload.
+		DbObjPtr getRecord(size_t objNo) const;
+		void setRecord(size_t objNo, const DbObjPtr& rec, unsigned short flags = 0);
+		void copyRecord(size_t objNo, const TreeNode* src, size_t srcNo);
+		void copyRecords(size_t objNo, const TreeNode* src, size_t srcNo, size_t count);
+		void moveChild(size_t childNo, TreeNode* src, size_t srcNo);
+
+		static const size_t HEADER_SIZE = 16;
+
+	private:
+		size_t _childBytes(size_t count) const { return isLeaf ? 0 : (count + 1) * layout->childSize; }
+		size_t _freeSpace() const;
+		unsigned short _allocCell(size_t size);
+		void _setCell(size_t objNo, const byte* extra, size_t extraLen, const byte* key, size_t keyLen, const byte* val, size_t valLen, unsigned short flags);
+		void _rebuild(const byte* newPrefix, size_t newLen);
+		void _fitPrefix(const void* fullKey, size_t len);
+		bool _loadPage();
+		void _preparePage(bool compressed);
+		void _reserveChildren();
 
 	public:
 		size_t childNo;
@@ -56,14 +227,50 @@ namespace Database
 		bool isLeaf;
 		bool loaded;
 		long fpos;
-		DBOBJVECTOR objects;
-		std::vector<Database::Ptr<TreeNode> > children;
+		const NodeLayout* layout;
+		byte* page;
+		CHILDREFVECTOR children;
 		Database::Ptr<TreeNode> parent;
+		MESSAGEMAP* messages;	// the node's buffer, or 0 if it is empty
+		size_t messageBytes;
+		std::atomic<unsigned long long> version;
 	};
 
 	typedef Database::Ptr<TreeNode> TreeNodePtr;
 	typedef std::vector<TreeNodePtr> TREENODEVECTOR;
 	typedef std::pair<TreeNodePtr, size_t> NodeKeyLocn;
+
+	// The reference counts the node while it is swizzled.
+	inline void ChildRef::_set(size_t ref)
+	{
+		if ((ref & TAG) == 0 && ref != 0)
+		{
+			((TreeNode*)ref)->upcount();
+		}
+		size_t old = _ref.exchange(ref, std::memory_order_acq_rel);
+		if ((old & TAG) == 0 && old != 0)
+		{
+			((TreeNode*)old)->downcount();
+		}
+	}
+
+	inline ChildRef::ChildRef(const ChildRef& other)
+		: _ref(0)
+	{
+		_set(other._ref.load(std::memory_order_relaxed));
+	}
+
+	inline ChildRef& ChildRef::operator=(const ChildRef& other)
+	{
+		_set(other._ref.load(std::memory_order_relaxed));
+		return *this;
+	}
+
+	inline ChildRef& ChildRef::operator=(TreeNode* node)
+	{
+		_set((size_t)node);
+		return *this;
+	}
 }
 
 #endif
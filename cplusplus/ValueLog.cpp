@@ -0,0 +1,138 @@
+
+
+#include "stdafx.h"
+#include "valuelog.h"
+
+namespace Database
+{
+	// The log isn't collected until it has at least this much garbage,
+	// so that small logs aren't copied over and over.
+	static const size_t MIN_GARBAGE = 1 << 20;
+
+	ValueLog::ValueLog(const std::string& fileName)
+		: _fileName(fileName)
+		, _file(0)
+		, _garbage(0)
+		, _generation(0)
+		, _length(0)
+	{
+	}
+
+	ValueLog::~ValueLog()
+	{
+		close();
+	}
+
+	// Open the log, creating it (with an empty header, and the
+	// generation given) if asked to.
+	bool ValueLog::open(bool creating, unsigned long long generation)
+	{
+		SLogHeader slh;
+		_file = fopen(_fileName.c_str(), creating ? "w+b" : "r+b");
+		if (0 == _file)
+		{
+			return false;
+		}
+		if (creating)
+		{
+			slh.garbage = 0;
+			slh.generation = generation;
+			if (1 != fwrite(&slh, sizeof(slh), 1, _file))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			if (1 != fread(&slh, sizeof(slh), 1, _file))
+			{
+				return false;
+			}
+		}
+		_garbage = slh.garbage;
+		_generation = slh.generation;
+		fseek(_file, 0, SEEK_END);
+		_length = ftell(_file);
+		return true;
+	}
+
+	// Write the garbage count back and close the file.
+	void ValueLog::close()
+	{
+		if (_file != 0)
+		{
+			flush();
+			std::lock_guard<std::mutex> guard(_lock);
+			fclose(_file);
+			_file = 0;
+		}
+	}
+
+	// Bring the header up to date and push everything to the disk.
+	bool ValueLog::flush()
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (0 == _file)
+		{
+			return false;
+		}
+		SLogHeader slh;
+		slh.garbage = _garbage;
+		slh.generation = _generation;
+		fseek(_file, 0, SEEK_SET);
+		bool ret = (1 == fwrite(&slh, sizeof(slh), 1, _file));
+		return (0 == fflush(_file)) && ret;
+	}
+
+	// Flush, and then push the file all the way to the disk, so that a
+	// commit that points at the payloads can't get there before them.
+	bool ValueLog::sync()
+	{
+		bool ret = flush();
+		std::lock_guard<std::mutex> guard(_lock);
+		return ret && (0 == _commit(_fileno(_file)));
+	}
+
+	// Add a payload to the end of the log, and say where it went.
+	bool ValueLog::append(const void* data, size_t size, SValuePtr& ptr)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (0 == _file || 0 != fseek(_file, _length, SEEK_SET))
+		{
+			return false;
+		}
+		if (size != 0 && 1 != fwrite(data, size, 1, _file))
+		{
+			return false;
+		}
+		ptr.offset = _length;
+		ptr.size = size;
+		_length += (long)size;
+		return true;
+	}
+
+	// Read a payload back.
+	bool ValueLog::read(const SValuePtr& ptr, std::vector<byte>& data)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (0 == _file || 0 != fseek(_file, ptr.offset, SEEK_SET))
+		{
+			return false;
+		}
+		data.resize(ptr.size);
+		return (ptr.size == 0 || 1 == fread(&data[0], ptr.size, 1, _file));
+	}
+
+	// A payload is no longer in use (its record has been deleted or
+	// given a new payload).
+	void ValueLog::release(const SValuePtr& ptr)
+	{
+		_garbage += ptr.size;
+	}
+
+	// The log is worth collecting when most of it is garbage.
+	bool ValueLog::needsCollect() const
+	{
+		return _garbage >= MIN_GARBAGE && _garbage * 2 > (size_t)_length;
+	}
+}
@@ -0,0 +1,62 @@
+
+
+#if !defined(__valuelog_h)
+#define __valuelog_h
+
+#include "DbObj.h"
+
+namespace Database
+{
+	// Where a payload lives in the value log. Records with large
+	// payloads keep one of these in the tree in place of the payload.
+	struct SValuePtr
+	{
+		long offset;
+		size_t size;
+	};
+
+	// An append-only file of payloads that are too big to keep in the
+	// tree's nodes. Payloads are never changed in place: a new one is
+	// appended and the old one becomes garbage. The log keeps count of
+	// how much of it is garbage, and once that is most of the file the
+	// tree copies the payloads that are still in use to a new log. Each
+	// new log has the next generation number, and the tree keeps the
+	// number of the log it points into, so that a copy cut short by a
+	// crash can be told from one that was finished.
+	class ValueLog : public Database::RefCount
+	{
+	public:
+		ValueLog(const std::string& fileName);
+		~ValueLog();
+
+	private:
+		struct SLogHeader
+		{
+			size_t garbage;		// bytes of payloads no longer in use
+			unsigned long long generation;
+		};
+
+		std::string _fileName;
+		FILE* _file;
+		size_t _garbage;
+		unsigned long long _generation;
+		long _length;
+		std::mutex _lock;		// reads can come from more than one thread, and from snapshots as the tree writes
+
+	public:
+		bool open(bool creating, unsigned long long generation = 0);
+		void close();
+		bool flush();
+		bool sync();
+		bool append(const void* data, size_t size, SValuePtr& ptr);
+		bool read(const SValuePtr& ptr, std::vector<byte>& data);
+		void release(const SValuePtr& ptr);
+		bool needsCollect() const;
+
+		std::string getFileName() const { return _fileName; }
+		unsigned long long getGeneration() const { return _generation; }
+	};
+	typedef Database::Ptr<ValueLog> ValueLogPtr;
+}
+
+#endif
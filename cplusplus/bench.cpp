@@ -0,0 +1,206 @@
+
+
+// Times lookups in a tree against lookups in a frozen copy of it, with
+// and without a learned index, for a few sets of keys:
+//   bench [keys] [records] [maxError]
+// where keys is one of
+//   seq	8 byte ids that go up by one
+//   gaps	8 byte ids that go up by a random step of 1 to 100
+//   text	ids written out as ten digit strings after "user"
+//   random	random 8 byte keys
+// The keys come from a generator with a fixed seed, so each set is the
+// same on every run and every platform. Then it times putting the same
+// records into a tree with and without page compression, and getting
+// them back once the tree has been opened again, to set the time spent
+// compressing against the bytes that it saves.
+#include "stdafx.h"
+#include "btreedb.h"
+#include "frozentable.h"
+
+using namespace Database;
+
+static const char* BENCH_DB = "bench.db";
+static const char* BENCH_FROZEN = "bench.frz";
+static const char* BENCH_COMPRESSED = "bench_lz.db";
+
+static const unsigned long long BENCH_SEED = 20261018;
+static std::mt19937_64 _random(BENCH_SEED);
+
+// Make the keys, in no particular order.
+static void _makeKeys(const std::string& keySet, size_t count, std::vector<std::string>& keys)
+{
+	unsigned long long id = 0;
+	for (size_t ctr = 0; ctr < count; ctr++)
+	{
+		char buf[32];
+		size_t len = 8;
+		if (keySet == "text")
+		{
+			len = sprintf(buf, "user%010llu", (unsigned long long)ctr);
+		}
+		else
+		{
+			id = (keySet == "random") ? _random() : (keySet == "gaps") ? id + 1 + _random() % 100 : id + 1;
+			for (size_t byteNo = 0; byteNo < 8; byteNo++)
+			{
+				buf[byteNo] = (char)(id >> (56 - 8 * byteNo));
+			}
+		}
+		keys.push_back(std::string(buf, len));
+	}
+	std::shuffle(keys.begin(), keys.end(), _random);
+}
+
+static double _elapsed(std::chrono::steady_clock::time_point start, size_t count)
+{
+	std::chrono::duration<double, std::nano> taken = std::chrono::steady_clock::now() - start;
+	return taken.count() / count;
+}
+
+// Put the records into a new tree, flush it, open it again and get them
+// all back, timing each half and counting what went to and from the
+// disk. The nodes are only read on first use, so the gets are mostly
+// the cost of reading (and maybe decompressing) every page once.
+static bool _benchStore(bool compress, const std::vector<std::string>& keys, size_t keySize)
+{
+	std::string mapName = std::string(BENCH_COMPRESSED) + ".pmap";
+	remove(BENCH_COMPRESSED);
+	remove(mapName.c_str());
+	size_t count = keys.size();
+
+	BTreeDBPtr db = new BTreeDB(BENCH_COMPRESSED, keySize + 8, keySize, 64);
+	db->setCompression(compress);
+	if (!db->open())
+	{
+		printf("can't create %s\n", BENCH_COMPRESSED);
+		return false;
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t ctr = 0; ctr < count; ctr++)
+	{
+		unsigned long long value = ctr;
+		db->put(new DbObj(keys[ctr].data(), keySize, &value, sizeof(value)));
+	}
+	db->flush();
+	double putTime = _elapsed(start, count);
+	SPageStats written = db->getPageStats();
+	db = (BTreeDB*)0;
+
+	db = new BTreeDB(BENCH_COMPRESSED, keySize + 8, keySize, 64);
+	db->setCompression(compress);
+	if (!db->open())
+	{
+		printf("can't open %s\n", BENCH_COMPRESSED);
+		return false;
+	}
+	std::vector<DbObjPtr> probes;
+	for (size_t ctr = 0; ctr < count; ctr++)
+	{
+		probes.push_back(new DbObj(keys[count - ctr - 1].data(), keySize));
+	}
+	size_t found = 0;
+	start = std::chrono::steady_clock::now();
+	for (size_t ctr = 0; ctr < count; ctr++)
+	{
+		DbObjPtr rec;
+		found += db->get(probes[ctr], rec) ? 1 : 0;
+	}
+	double getTime = _elapsed(start, count);
+	SPageStats read = db->getPageStats();
+	db = (BTreeDB*)0;
+	remove(BENCH_COMPRESSED);
+	remove(mapName.c_str());
+
+	printf("  %-15s %8.0f ns/put %8.0f ns/get, %u pages (%u bytes) written, %u pages (%u bytes) read, %u found\n",
+		compress ? "compressed" : "uncompressed", putTime, getTime,
+		(unsigned int)written.pagesWritten, (unsigned int)written.bytesWritten,
+		(unsigned int)read.pagesRead, (unsigned int)read.bytesRead, (unsigned int)found);
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	std::string keySet = (argc > 1) ? argv[1] : "seq";
+	size_t count = (argc > 2) ? atoi(argv[2]) : 1000000;
+	size_t maxError = (argc > 3) ? atoi(argv[3]) : 32;
+
+	std::vector<std::string> keys;
+	_makeKeys(keySet, count, keys);
+	size_t keySize = keys[0].size();
+
+	remove(BENCH_DB);
+	BTreeDBPtr db = new BTreeDB(BENCH_DB, keySize + 8, keySize, 64);
+	if (!db->open())
+	{
+		printf("can't create %s\n", BENCH_DB);
+		return 1;
+	}
+	for (size_t ctr = 0; ctr < count; ctr++)
+	{
+		unsigned long long value = ctr;
+		db->put(new DbObj(keys[ctr].data(), keySize, &value, sizeof(value)));
+	}
+	db->flush();
+
+	FrozenTablePtr frozen = new FrozenTable();
+	if (!FrozenTable::build(db, BENCH_FROZEN, maxError) || !frozen->open(BENCH_FROZEN))
+	{
+		printf("can't build %s\n", BENCH_FROZEN);
+		return 1;
+	}
+
+	// Look the keys up in a different order from the one they went in.
+	std::shuffle(keys.begin(), keys.end(), _random);
+	std::vector<DbObjPtr> probes;
+	for (size_t ctr = 0; ctr < count; ctr++)
+	{
+		probes.push_back(new DbObj(keys[ctr].data(), keySize));
+	}
+
+	size_t found = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t ctr = 0; ctr < count; ctr++)
+	{
+		DbObjPtr rec;
+		found += db->get(probes[ctr], rec) ? 1 : 0;
+	}
+	double treeTime = _elapsed(start, count);
+
+	frozen->setLearnedIndex(false);
+	start = std::chrono::steady_clock::now();
+	for (size_t ctr = 0; ctr < count; ctr++)
+	{
+		DbObjPtr rec;
+		found += frozen->get(probes[ctr], rec) ? 1 : 0;
+	}
+	double frozenTime = _elapsed(start, count);
+
+	frozen->setLearnedIndex(true);
+	start = std::chrono::steady_clock::now();
+	for (size_t ctr = 0; ctr < count; ctr++)
+	{
+		DbObjPtr rec;
+		found += frozen->get(probes[ctr], rec) ? 1 : 0;
+	}
+	double learnedTime = _elapsed(start, count);
+
+	printf("%s: %u records, %u found of %u\n", keySet.c_str(), (unsigned int)count, (unsigned int)found, (unsigned int)(3 * count));
+	printf("  tree            %8.0f ns/get\n", treeTime);
+	printf("  frozen          %8.0f ns/get\n", frozenTime);
+	if (frozen->getSegmentCount() != 0)
+	{
+		printf("  frozen, learned %8.0f ns/get (%u segments, error %u)\n", learnedTime, (unsigned int)frozen->getSegmentCount(), (unsigned int)maxError);
+	}
+	else
+	{
+		printf("  frozen, learned (not built: the heads of the keys aren't all different)\n");
+	}
+	frozen->close();
+	db = (BTreeDB*)0;
+
+	if (!_benchStore(false, keys, keySize) || !_benchStore(true, keys, keySize))
+	{
+		return 1;
+	}
+	return 0;
+}
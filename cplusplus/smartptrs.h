@@ -3,23 +3,30 @@
 #if !defined(__smartptrs_h)
 #define __smartptrs_h
 
+#include <atomic>
+
 namespace Database
 {
 	/*!
-	Base class of smart pointer classes.
+	Base class of smart pointer classes. The count is atomic, so that
+	objects can be shared between threads, and the calls that change it
+	aren't virtual, so that they can be inlined. Copying an object
+	doesn't copy its count.
 	*/
 	class RefCount
 	{
 	private:
-		int _crefs;
+		std::atomic<int> _crefs;
 
 	public:
 		RefCount() : _crefs(0) {}
+		RefCount(const RefCount&) : _crefs(0) {}
+		RefCount& operator=(const RefCount&) { return *this; }
 		virtual ~RefCount() {}
-		virtual void upcount() { ++_crefs; }
-		virtual void downcount(void)
+		void upcount() { _crefs.fetch_add(1, std::memory_order_relaxed); }
+		void downcount(void)
 		{
-			if (--_crefs == 0)
+			if (_crefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
 			{
 				delete this;
 			}
@@ -31,7 +38,9 @@ namespace Database
 	};
 
 	/*!
-	Smart pointer template.
+	Smart pointer template. Moving a pointer (out of a temporary, or a
+	value being returned) hands the reference over without touching the
+	count.
 	*/
 	template <class T> class Ptr
 	{
@@ -40,18 +49,32 @@ namespace Database
 
 	public:
 		Ptr(const Ptr<T>& ptr) : _p(ptr._p) { if (_p) _p->upcount(); }
+		Ptr(Ptr<T>&& ptr) noexcept : _p(ptr._p) { ptr._p = 0; }
 		Ptr() : _p(0) {}
 		Ptr(T* p) : _p(p) { if (_p) _p->upcount(); }
 		~Ptr(void) { if (_p) _p->downcount(); }
 		operator T*(void) const { return _p; }
 		T& operator*(void) const { return *_p; }
 		T* operator->(void) const { return _p; }
-		Ptr& operator=(const Ptr<T> &p) { return operator=((T*)(Ptr<T>)p); }
+		Ptr& operator=(const Ptr<T> &p) { return operator=(p._p); }
+		Ptr& operator=(Ptr<T>&& p) noexcept
+		{
+			if (this != &p)
+			{
+				T* old = _p;
+				_p = p._p;
+				p._p = 0;
+				if (old) old->downcount();
+			}
+			return *this;
+		}
 		Ptr& operator=(T* p)
 		{
-			if (_p) _p->downcount();
+			// Count the new one first, in case it's the one we have.
+			if (p) p->upcount();
+			T* old = _p;
 			_p = p;
-			if (_p) _p->upcount();
+			if (old) old->downcount();
 			return *this;
 		}
 		Ptr& operator=(const T* p)
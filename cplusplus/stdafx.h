@@ -8,5 +8,17 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <deque>
+#include <queue>
+#include <algorithm>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 
 #endif
@@ -1,17 +1,105 @@
 
 
+// Checks the conversions in Function.h, and then checks the tree against
+// a std::map: random puts, dels, range deletes and gets over a small set
+// of keys (so that records are overwritten often), and a truncate now and
+// then (the last stretch before each truncate is mostly dels, to leave
+// leaves short), with each of the tree's options on by
+// itself and with several of them together. Each run also reopens the
+// tree after a flush (a commit, if it is copy-on-write), checks count()
+// and rank() when the tree counts records, scans it in parallel, and
+// builds a FrozenTable from the tree to check its gets and scans. Then
+// it puts back the files a crash could leave: a Bloom filter and hash
+// index saved at an older commit, and a value log collect cut short on
+// either side of its commit. Then it checks that snapshots keep seeing
+// their commits, runs a MemTable small enough to be merged often, and
+// replays its logs as an unclean exit would leave them, has threads
+// get records while another changes them, and bulk loads a file with
+// keys repeated across its chunks. Returns 0 if every check passes.
+#include "stdafx.h"
 #include<iostream>
 #include<string>
 #include"Function.h"
+#include "btreedb.h"
+#include "frozentable.h"
+#include "bulkloader.h"
+#include "memtable.h"
 
 using namespace std;
+using namespace Database;
 
-int main()
+static const char* TEST_DB = "test.db";
+static const char* TEST_FROZEN = "test.frz";
+static const char* TEST_TSV = "test.tsv";
+static const size_t TEST_KEYS = 2000;
+static const size_t TEST_OPS = 40000;
+static const size_t CHECK_EVERY = 5000;
+static const size_t TRUNCATE_EVERY = 15000;
+static const size_t MAX_RANGE = 100;
+static const size_t KEY_SIZE = 16;
+static const size_t MAX_VALUE = 180;
+static const size_t SCAN_THREADS = 4;
+static const size_t READER_THREADS = 3;
+static const unsigned long long TEST_SEED = 20261018;
+
+typedef std::map<std::string, std::string> MODELMAP;
+
+// The options a run turns on.
+enum ETestOption
+{
+	ETO_COUNTS = 0x0001,
+	ETO_VALUELOG = 0x0002,
+	ETO_COMPRESS = 0x0004,
+	ETO_BLOOM = 0x0008,
+	ETO_HASH = 0x0010,
+	ETO_CACHE = 0x0020,
+	ETO_SHADOW = 0x0040,
+	ETO_OPTIMISTIC = 0x0080,
+	ETO_BUFFERS = 0x0100,
+	ETO_FLUSHER = 0x0200,
+	ETO_LAZY = 0x0400
+};
+
+struct STestRun
+{
+	const char* name;
+	unsigned options;
+};
+
+static const STestRun TEST_RUNS[] =
+{
+	{ "plain", 0 },
+	{ "record counts", ETO_COUNTS },
+	{ "value log", ETO_VALUELOG },
+	{ "compression", ETO_COMPRESS },
+	{ "bloom filter", ETO_BLOOM },
+	{ "hash index", ETO_HASH },
+	{ "record cache", ETO_CACHE },
+	{ "copy-on-write", ETO_SHADOW },
+	{ "optimistic reads", ETO_OPTIMISTIC },
+	{ "message buffers", ETO_BUFFERS },
+	{ "background flush", ETO_FLUSHER },
+	{ "buffers, value log", ETO_BUFFERS | ETO_VALUELOG },
+	{ "copy-on-write, counts, value log", ETO_SHADOW | ETO_COUNTS | ETO_VALUELOG },
+	{ "compression, counts, bloom, hash, cache", ETO_COMPRESS | ETO_COUNTS | ETO_BLOOM | ETO_HASH | ETO_CACHE },
+	{ "buffers, counts, bloom, cache", ETO_BUFFERS | ETO_COUNTS | ETO_BLOOM | ETO_CACHE },
+	{ "flusher, optimistic, value log, hash", ETO_FLUSHER | ETO_OPTIMISTIC | ETO_VALUELOG | ETO_HASH },
+	{ "lazy deletes", ETO_LAZY },
+	{ "lazy deletes, counts, value log, hash", ETO_LAZY | ETO_COUNTS | ETO_VALUELOG | ETO_HASH },
+	{ "lazy deletes, buffers, bloom", ETO_LAZY | ETO_BUFFERS | ETO_BLOOM },
+	{ "lazy deletes, flusher, optimistic", ETO_LAZY | ETO_FLUSHER | ETO_OPTIMISTIC },
+	{ "lazy deletes, copy-on-write, counts", ETO_LAZY | ETO_SHADOW | ETO_COUNTS },
+	{ "everything", ETO_COUNTS | ETO_VALUELOG | ETO_BLOOM | ETO_HASH | ETO_CACHE | ETO_SHADOW | ETO_BUFFERS | ETO_FLUSHER | ETO_LAZY }
+};
+
+static std::mt19937_64 _random(TEST_SEED);
+
+static void _testConversions()
 {
 	int a=10;
 	double b=10;
 	string c="10";
-	char d='10';
+	char d='1';
 	char* a1=new char[5];
 	int_to_charArr(a,a1);
 	int a2;charArr_to_int(a1,a2);
@@ -24,7 +112,1007 @@ int main()
 	cout<<str<<endl;
 	char_to_charArr(d,a1);
 	char d1;charArr_to_char(a1,d1);
-	cout<<d1;
+	cout<<d1<<endl;
+	delete [] a1;
+}
+
+static std::string _makeKey(size_t keyNo)
+{
+	char buf[KEY_SIZE + 1];
+	sprintf(buf, "k%015u", (unsigned int)keyNo);
+	return std::string(buf, KEY_SIZE);
+}
 
-	
-}
\ No newline at end of file
+static std::string _makeValue(size_t opNo)
+{
+	std::string value((size_t)(_random() % (MAX_VALUE + 1)), 'a');
+	for (size_t ctr = 0; ctr < value.size(); ctr++)
+	{
+		value[ctr] = (char)('a' + (opNo + ctr) % 26);
+	}
+	return value;
+}
+
+static DbObjPtr _keyObj(const std::string& key)
+{
+	return new DbObj(key.data(), key.size());
+}
+
+static std::string _valueOf(const DbObjPtr& rec)
+{
+	return std::string((const char*)rec->getData() + KEY_SIZE, rec->getSize() - KEY_SIZE);
+}
+
+static bool _fail(const STestRun& run, size_t opNo, const std::string& what)
+{
+	printf("FAILED %s, op %u: %s\n", run.name, (unsigned int)opNo, what.c_str());
+	return false;
+}
+
+// Make a tree with the run's options, and open it. Options that are
+// kept in the file only matter when it is created, but setting them
+// again on a reopen does no harm.
+static BTreeDBPtr _openTree(const STestRun& run)
+{
+	BTreeDBPtr db = new BTreeDB(TEST_DB, KEY_SIZE + MAX_VALUE, KEY_SIZE, 3);
+	db->setRecordCounts((run.options & ETO_COUNTS) != 0);
+	db->setValueThreshold((run.options & ETO_VALUELOG) ? 16 : 0);
+	db->setCompression((run.options & ETO_COMPRESS) != 0);
+	db->setBloomFilter((run.options & ETO_BLOOM) ? TEST_KEYS : 0);
+	db->setHashIndex((run.options & ETO_HASH) != 0);
+	db->setRecordCache((run.options & ETO_CACHE) ? 256 : 0);
+	db->setCopyOnWrite((run.options & ETO_SHADOW) != 0);
+	db->setOptimisticReads((run.options & ETO_OPTIMISTIC) != 0);
+	db->setMessageBuffers((run.options & ETO_BUFFERS) ? 8192 : 0);
+	db->setBackgroundFlush((run.options & ETO_FLUSHER) ? 10 : 0, 20, 200);
+	db->setLazyDeletes((run.options & ETO_LAZY) ? 64 : 0, 5);
+	db->setScanThreads(SCAN_THREADS);
+	if (!db->open())
+	{
+		return (BTreeDB*)0;
+	}
+	return db;
+}
+
+static void _removeFiles()
+{
+	const char* suffixes[] = { "", ".vlog", ".bloom", ".hidx", ".pmap", ".wal", ".wal.old" };
+	for (size_t ctr = 0; ctr < sizeof(suffixes) / sizeof(suffixes[0]); ctr++)
+	{
+		remove((std::string(TEST_DB) + suffixes[ctr]).c_str());
+	}
+	remove(TEST_FROZEN);
+}
+
+// Check the whole tree against the model: the records in order, then
+// (if the tree counts them) count(), and rank() and select() for a few
+// keys and places.
+static bool _checkTree(const STestRun& run, size_t opNo, BTreeDBPtr& db, const MODELMAP& model)
+{
+	NodeKeyLocn locn(TreeNodePtr(), (size_t)-1);
+	DbObjPtr rec;
+	MODELMAP::const_iterator mit = model.begin();
+	while (db->seq(locn, rec))
+	{
+		std::string key((const char*)rec->getData(), KEY_SIZE);
+		if (mit == model.end() || mit->first != key || mit->second != _valueOf(rec))
+		{
+			return _fail(run, opNo, "seq has " + key + ", which the model doesn't");
+		}
+		++mit;
+	}
+	if (mit != model.end())
+	{
+		return _fail(run, opNo, "seq is missing " + mit->first);
+	}
+	if ((run.options & ETO_COUNTS) == 0)
+	{
+		return true;
+	}
+	if (db->count() != model.size())
+	{
+		return _fail(run, opNo, "count() is wrong");
+	}
+	for (size_t ctr = 0; ctr < 20; ctr++)
+	{
+		std::string key = _makeKey((size_t)(_random() % TEST_KEYS));
+		size_t expected = (size_t)std::distance(model.begin(), model.lower_bound(key));
+		if (db->rank(_keyObj(key)) != expected)
+		{
+			return _fail(run, opNo, "rank() of " + key + " is wrong");
+		}
+		if (model.empty())
+		{
+			continue;
+		}
+		size_t index = (size_t)(_random() % model.size());
+		MODELMAP::const_iterator nth = model.begin();
+		std::advance(nth, index);
+		NodeKeyLocn locn = db->select(index);
+		if ((TreeNode*)locn.first == 0 || !db->get(locn, rec) || std::string((const char*)rec->getData(), KEY_SIZE) != nth->first)
+		{
+			return _fail(run, opNo, "select() didn't find " + nth->first);
+		}
+	}
+	if ((TreeNode*)db->select(model.size()).first != 0)
+	{
+		return _fail(run, opNo, "select() past the end found a record");
+	}
+	return true;
+}
+
+// Delete a range of keys, either end of which may be open, and check
+// that count() agreed beforehand on how many records were in it.
+static bool _deleteRange(const STestRun& run, size_t opNo, BTreeDBPtr& db, MODELMAP& model)
+{
+	size_t loNo = (size_t)(_random() % TEST_KEYS);
+	size_t hiNo = loNo + (size_t)(_random() % MAX_RANGE);
+	unsigned ends = (unsigned)(_random() % 10);
+	DbObjPtr lo = (ends == 0) ? DbObjPtr() : _keyObj(_makeKey(loNo));
+	DbObjPtr hi = (ends == 1) ? DbObjPtr() : _keyObj(_makeKey(hiNo));
+	MODELMAP::iterator first = (ends == 0) ? model.begin() : model.lower_bound(_makeKey(loNo));
+	MODELMAP::iterator last = (ends == 1) ? model.end() : model.lower_bound(_makeKey(hiNo));
+	size_t expected = (size_t)std::distance(first, last);
+	if ((run.options & ETO_COUNTS) && db->count(lo, hi) != expected)
+	{
+		return _fail(run, opNo, "count() of a range is wrong");
+	}
+	model.erase(first, last);
+	if (!db->deleteRange(lo, hi))
+	{
+		return _fail(run, opNo, "deleteRange failed");
+	}
+	return true;
+}
+
+static bool _checkGet(const STestRun& run, size_t opNo, BTreeDBPtr& db, const MODELMAP& model, const std::string& key)
+{
+	DbObjPtr rec;
+	bool found = db->get(_keyObj(key), rec);
+	MODELMAP::const_iterator mit = model.find(key);
+	if (found != (mit != model.end()))
+	{
+		return _fail(run, opNo, "get of " + key + (found ? " found it" : " didn't find it"));
+	}
+	if (found && _valueOf(rec) != mit->second)
+	{
+		return _fail(run, opNo, "get of " + key + " has the wrong payload");
+	}
+	return true;
+}
+
+struct SScanCheck
+{
+	MODELMAP::const_iterator next;
+	MODELMAP::const_iterator end;
+	size_t left;
+	bool ok;
+};
+
+static bool _scanCallback(const DbObjPtr& rec, void* context)
+{
+	SScanCheck* check = (SScanCheck*)context;
+	std::string key((const char*)rec->getData(), KEY_SIZE);
+	check->ok = check->ok && check->next != check->end && check->next->first == key && check->next->second == _valueOf(rec);
+	if (check->next != check->end)
+	{
+		++check->next;
+	}
+	return check->ok && --check->left != 0;
+}
+
+// An unordered parallel scan calls back from several threads at once,
+// so this one takes a lock, and counts the calls so that it can stop.
+struct SParallelCheck
+{
+	const MODELMAP* model;
+	std::mutex lock;
+	std::set<std::string> seen;
+	size_t stopAt;
+	size_t calls;
+	bool ok;
+};
+
+static bool _parallelCallback(const DbObjPtr& rec, void* context)
+{
+	SParallelCheck* check = (SParallelCheck*)context;
+	std::lock_guard<std::mutex> guard(check->lock);
+	std::string key((const char*)rec->getData(), KEY_SIZE);
+	MODELMAP::const_iterator mit = check->model->find(key);
+	check->ok = check->ok && mit != check->model->end() && mit->second == _valueOf(rec) && check->seen.insert(key).second;
+	return check->ok && ++check->calls != check->stopAt;
+}
+
+// Scan the tree in parallel, in order and not, all the way through and
+// stopping part way. In order, the callback must see the model's records
+// up to where it stopped, and no more. Out of order, it must see each
+// record once, and once it stops, the threads that were already part way
+// through a record may finish it, but nothing else may be handed out.
+static bool _checkParallelScan(const STestRun& run, size_t opNo, BTreeDBPtr& db, const MODELMAP& model)
+{
+	SScanCheck check = { model.begin(), model.end(), model.size() + 1, true };
+	if (!db->parallelScan(_scanCallback, &check, true) || !check.ok || check.next != model.end() || check.left != 1)
+	{
+		return _fail(run, opNo, "ordered parallel scan is wrong");
+	}
+	size_t stopAt = model.size() / 3 + 1;
+	MODELMAP::const_iterator stop = model.begin();
+	std::advance(stop, std::min(stopAt, model.size()));
+	SScanCheck part = { model.begin(), model.end(), stopAt, true };
+	if (!db->parallelScan(_scanCallback, &part, true) || !part.ok || part.next != stop || part.left != (stopAt > model.size() ? 1 : 0))
+	{
+		return _fail(run, opNo, "ordered parallel scan didn't stop where it was told");
+	}
+	SParallelCheck all;
+	all.model = &model;
+	all.stopAt = (size_t)-1;
+	all.calls = 0;
+	all.ok = true;
+	if (!db->parallelScan(_parallelCallback, &all) || !all.ok || all.seen.size() != model.size())
+	{
+		return _fail(run, opNo, "unordered parallel scan is wrong");
+	}
+	SParallelCheck some;
+	some.model = &model;
+	some.stopAt = stopAt;
+	some.calls = 0;
+	some.ok = true;
+	if (!db->parallelScan(_parallelCallback, &some) || !some.ok ||
+		some.calls < std::min(stopAt, model.size()) || some.calls > stopAt + SCAN_THREADS)
+	{
+		return _fail(run, opNo, "unordered parallel scan didn't stop where it was told");
+	}
+	return true;
+}
+
+// Build a frozen copy of the tree, and check its gets (of every key,
+// there or not) and a few scans against the model.
+static bool _checkFrozen(const STestRun& run, BTreeDBPtr& db, const MODELMAP& model)
+{
+	FrozenTablePtr frozen = new FrozenTable();
+	if (!FrozenTable::build(db, TEST_FROZEN, 16) || !frozen->open(TEST_FROZEN))
+	{
+		return _fail(run, TEST_OPS, "can't build the frozen table");
+	}
+	if (frozen->getCount() != model.size())
+	{
+		return _fail(run, TEST_OPS, "the frozen table has the wrong number of records");
+	}
+	for (size_t keyNo = 0; keyNo < TEST_KEYS; keyNo++)
+	{
+		std::string key = _makeKey(keyNo);
+		DbObjPtr rec;
+		bool found = frozen->get(_keyObj(key), rec);
+		MODELMAP::const_iterator mit = model.find(key);
+		if (found != (mit != model.end()) || (found && _valueOf(rec) != mit->second))
+		{
+			return _fail(run, TEST_OPS, "frozen get of " + key + " is wrong");
+		}
+	}
+	for (size_t ctr = 0; ctr < 20; ctr++)
+	{
+		std::string from = _makeKey((size_t)(_random() % TEST_KEYS));
+		SScanCheck check = { model.lower_bound(from), model.end(), 50, true };
+		if (!frozen->scan(_keyObj(from), _scanCallback, &check) || !check.ok)
+		{
+			return _fail(run, TEST_OPS, "frozen scan from " + from + " is wrong");
+		}
+	}
+	frozen->close();
+	return true;
+}
+
+// Flush (or commit) the tree, close it and open it again.
+static bool _reopen(const STestRun& run, size_t opNo, BTreeDBPtr& db)
+{
+	if (!db->flush())
+	{
+		return _fail(run, opNo, "flush failed");
+	}
+	db->close();
+	db = (BTreeDB*)0;
+	db = _openTree(run);
+	if ((BTreeDB*)db == 0)
+	{
+		return _fail(run, opNo, "can't open the tree again");
+	}
+	return true;
+}
+
+static bool _testRun(const STestRun& run)
+{
+	_removeFiles();
+	BTreeDBPtr db = _openTree(run);
+	if ((BTreeDB*)db == 0)
+	{
+		return _fail(run, 0, "can't create the tree");
+	}
+	MODELMAP model;
+	bool ret = true;
+	for (size_t opNo = 1; ret && opNo <= TEST_OPS; opNo++)
+	{
+		std::string key = _makeKey((size_t)(_random() % TEST_KEYS));
+		unsigned op = (unsigned)(_random() % 100);
+		bool deleting = (opNo % TRUNCATE_EVERY > TRUNCATE_EVERY - TRUNCATE_EVERY / 3);
+		if (op < (deleting ? 5u : 60u))
+		{
+			std::string value = _makeValue(opNo);
+			if (!db->put(new DbObj(key.data(), key.size(), value.data(), value.size())))
+			{
+				ret = _fail(run, opNo, "put of " + key + " failed");
+			}
+			model[key] = value;
+		}
+		else if (op < (deleting ? 95u : 84u))
+		{
+			db->del(_keyObj(key));
+			model.erase(key);
+		}
+		else if (op < 85 && !deleting)
+		{
+			ret = _deleteRange(run, opNo, db, model);
+		}
+		else
+		{
+			ret = _checkGet(run, opNo, db, model, key);
+		}
+		if (ret && opNo % TRUNCATE_EVERY == 0)
+		{
+			model.clear();
+			ret = db->truncate() && _checkTree(run, opNo, db, model);
+		}
+		if (ret && opNo % CHECK_EVERY == 0)
+		{
+			ret = _checkTree(run, opNo, db, model) && _checkParallelScan(run, opNo, db, model);
+		}
+
+		// With lazy deletes, top up the short leaves now and then, and
+		// check that nothing moved.
+		if (ret && (run.options & ETO_LAZY) && opNo % (CHECK_EVERY / 2) == 0)
+		{
+			ret = (db->rebalance() || _fail(run, opNo, "rebalance failed")) && _checkTree(run, opNo, db, model);
+		}
+		if (ret && opNo == TEST_OPS / 2)
+		{
+			ret = _reopen(run, opNo, db) && _checkTree(run, opNo, db, model);
+		}
+	}
+	ret = ret && _reopen(run, TEST_OPS, db) && _checkTree(run, TEST_OPS, db, model);
+	ret = ret && _checkFrozen(run, db, model);
+	if ((BTreeDB*)db != 0)
+	{
+		db->close();
+	}
+	db = (BTreeDB*)0;
+	_removeFiles();
+	printf("%s %s\n", ret ? "passed" : "failed", run.name);
+	return ret;
+}
+
+static bool _copyFile(const std::string& from, const std::string& to)
+{
+	FILE* in = fopen(from.c_str(), "rb");
+	FILE* out = (in != 0) ? fopen(to.c_str(), "wb") : 0;
+	bool ret = (out != 0);
+	char buf[4096];
+	for (size_t size = 0; ret && (size = fread(buf, 1, sizeof(buf), in)) != 0; )
+	{
+		ret = (size == fwrite(buf, 1, size, out));
+	}
+	if (in != 0)
+	{
+		fclose(in);
+	}
+	return (out != 0) && (0 == fclose(out)) && ret;
+}
+
+// A crash after a commit leaves the Bloom filter and hash index as they
+// were saved at some earlier commit. Put that back by hand, with files
+// saved when the tree was closed with half the keys in it, and check
+// that the tree builds them again instead of trusting them.
+static bool _testStaleSidecars()
+{
+	STestRun run = { "stale sidecars", ETO_SHADOW | ETO_BLOOM | ETO_HASH | ETO_VALUELOG };
+	_removeFiles();
+	BTreeDBPtr db = _openTree(run);
+	MODELMAP model;
+	bool ret = ((BTreeDB*)db != 0) || _fail(run, 0, "can't create the tree");
+	for (size_t keyNo = 0; ret && keyNo < TEST_KEYS; keyNo++)
+	{
+		if (keyNo == TEST_KEYS / 2)
+		{
+			db->close();
+			ret = _copyFile(std::string(TEST_DB) + ".bloom", std::string(TEST_DB) + ".bloom.old") &&
+				_copyFile(std::string(TEST_DB) + ".hidx", std::string(TEST_DB) + ".hidx.old");
+			db = _openTree(run);
+			ret = (ret && (BTreeDB*)db != 0) || _fail(run, keyNo, "can't keep the sidecars");
+		}
+		std::string key = _makeKey(keyNo);
+		std::string value = _makeValue(keyNo);
+		ret = ret && (db->put(new DbObj(key.data(), key.size(), value.data(), value.size())) || _fail(run, keyNo, "put failed"));
+		model[key] = value;
+	}
+	ret = ret && (db->commit() || _fail(run, TEST_KEYS, "commit failed"));
+	if ((BTreeDB*)db != 0)
+	{
+		db->close();
+	}
+	db = (BTreeDB*)0;
+	ret = ret && _copyFile(std::string(TEST_DB) + ".bloom.old", std::string(TEST_DB) + ".bloom") &&
+		_copyFile(std::string(TEST_DB) + ".hidx.old", std::string(TEST_DB) + ".hidx");
+	if (ret)
+	{
+		db = _openTree(run);
+		ret = ((BTreeDB*)db != 0) || _fail(run, TEST_KEYS, "can't open the tree again");
+	}
+	for (size_t keyNo = 0; ret && keyNo < TEST_KEYS; keyNo++)
+	{
+		ret = _checkGet(run, TEST_KEYS, db, model, _makeKey(keyNo));
+	}
+	ret = ret && _checkTree(run, TEST_KEYS, db, model);
+	db = (BTreeDB*)0;
+	_removeFiles();
+	remove((std::string(TEST_DB) + ".bloom.old").c_str());
+	remove((std::string(TEST_DB) + ".hidx.old").c_str());
+	printf("%s %s\n", ret ? "passed" : "failed", run.name);
+	return ret;
+}
+
+// Check one of the states a crash in collectValues() can leave: the
+// data file and the old log as they were before the collect, or after
+// it, with the new log not yet moved into place. Either way, open()
+// should settle on the log that the tree points into.
+static bool _checkCollectCrash(const STestRun& run, const MODELMAP& model, bool committed)
+{
+	std::string logName = std::string(TEST_DB) + ".vlog";
+	bool ret = (0 == rename(logName.c_str(), (logName + ".new").c_str())) &&
+		_copyFile(logName + ".before", logName) &&
+		(committed || _copyFile(std::string(TEST_DB) + ".before", TEST_DB));
+	if (!ret)
+	{
+		return _fail(run, 0, "can't set up the crash");
+	}
+	BTreeDBPtr db = _openTree(run);
+	if ((BTreeDB*)db == 0)
+	{
+		return _fail(run, 0, committed ? "can't open after the commit" : "can't open before the commit");
+	}
+	ret = (0 != _access((logName + ".new").c_str(), 0)) || _fail(run, 0, "the new log is still there");
+	for (MODELMAP::const_iterator mit = model.begin(); ret && mit != model.end(); ++mit)
+	{
+		ret = _checkGet(run, 0, db, model, mit->first);
+	}
+	ret = ret && _checkTree(run, 0, db, model);
+	db->close();
+	return ret;
+}
+
+// Collect the value log, and then check the states a crash part way
+// through could have left behind.
+static bool _testCollectCrash(const STestRun& run)
+{
+	_removeFiles();
+	BTreeDBPtr db = _openTree(run);
+	MODELMAP model;
+	bool ret = ((BTreeDB*)db != 0) || _fail(run, 0, "can't create the tree");
+	for (size_t opNo = 0; ret && opNo < 3 * TEST_KEYS; opNo++)
+	{
+		std::string key = _makeKey(opNo % TEST_KEYS);
+		std::string value = _makeValue(opNo) + std::string(20, 'v');
+		ret = db->put(new DbObj(key.data(), key.size(), value.data(), value.size())) || _fail(run, opNo, "put failed");
+		model[key] = value;
+	}
+	std::string logName = std::string(TEST_DB) + ".vlog";
+	if (ret)
+	{
+		db->close();
+		ret = _copyFile(TEST_DB, std::string(TEST_DB) + ".before") && _copyFile(logName, logName + ".before");
+		db = _openTree(run);
+		ret = (ret && (BTreeDB*)db != 0 && db->collectValues()) || _fail(run, 0, "collectValues failed");
+	}
+	if ((BTreeDB*)db != 0)
+	{
+		db->close();
+	}
+	db = (BTreeDB*)0;
+	ret = ret && _checkCollectCrash(run, model, true);
+	ret = ret && _checkCollectCrash(run, model, false);
+	_removeFiles();
+	remove((std::string(TEST_DB) + ".before").c_str());
+	remove((logName + ".before").c_str());
+	remove((logName + ".new").c_str());
+	printf("%s %s, collect cut short\n", ret ? "passed" : "failed", run.name);
+	return ret;
+}
+
+static long _fileSize(const char* name)
+{
+	FILE* file = fopen(name, "rb");
+	long size = -1;
+	if (file != 0)
+	{
+		fseek(file, 0, SEEK_END);
+		size = ftell(file);
+		fclose(file);
+	}
+	return size;
+}
+
+// Random puts and dels, with a commit every so often.
+static bool _churn(const STestRun& run, size_t opNo, size_t ops, BTreeDBPtr& db, MODELMAP& model)
+{
+	bool ret = true;
+	for (size_t ctr = 1; ret && ctr <= ops; ctr++)
+	{
+		std::string key = _makeKey((size_t)(_random() % TEST_KEYS));
+		if (_random() % 3 == 0)
+		{
+			db->del(_keyObj(key));
+			model.erase(key);
+		}
+		else
+		{
+			std::string value = _makeValue(opNo + ctr);
+			ret = db->put(new DbObj(key.data(), key.size(), value.data(), value.size())) || _fail(run, opNo + ctr, "put of " + key + " failed");
+			model[key] = value;
+		}
+		ret = ret && (ctr % 50 != 0 || db->commit() || _fail(run, opNo + ctr, "commit failed"));
+	}
+	return ret;
+}
+
+// Check a snapshot against the model of its commit: all of it (gets of
+// every key, seq and scan), or just a few gets.
+static bool _checkSnapshot(const STestRun& run, size_t opNo, SnapshotPtr& snapshot, const MODELMAP& model, bool whole)
+{
+	for (size_t ctr = 0; ctr < (whole ? TEST_KEYS : 20); ctr++)
+	{
+		std::string key = _makeKey(whole ? ctr : (size_t)(_random() % TEST_KEYS));
+		DbObjPtr rec;
+		bool found = snapshot->get(_keyObj(key), rec);
+		MODELMAP::const_iterator mit = model.find(key);
+		if (found != (mit != model.end()) || (found && _valueOf(rec) != mit->second))
+		{
+			return _fail(run, opNo, "snapshot get of " + key + " is wrong");
+		}
+	}
+	if (!whole)
+	{
+		return true;
+	}
+	NodeKeyLocn locn(TreeNodePtr(), (size_t)-1);
+	DbObjPtr rec;
+	MODELMAP::const_iterator mit = model.begin();
+	while (snapshot->seq(locn, rec))
+	{
+		if (mit == model.end() || mit->first != std::string((const char*)rec->getData(), KEY_SIZE) || mit->second != _valueOf(rec))
+		{
+			return _fail(run, opNo, "snapshot seq is wrong");
+		}
+		++mit;
+	}
+	SScanCheck check = { model.begin(), model.end(), model.size() + 1, true };
+	if (mit != model.end() || !snapshot->scan(_scanCallback, &check) || !check.ok || check.next != model.end())
+	{
+		return _fail(run, opNo, "snapshot seq or scan is short");
+	}
+	return true;
+}
+
+// Take a snapshot, churn the tree, take another, and churn it again, and
+// check that both still see their commits. A snapshot keeps the nodes it
+// has read, so most of the reading is left until after the churn, when
+// the pages would have been written over if they had been reclaimed.
+// Then let go of the newer one, churn again and check the older one,
+// and let go of that too: the file should grow while it is held, but
+// not afterwards, once its pages come back.
+static bool _testSnapshots(const STestRun& run)
+{
+	_removeFiles();
+	BTreeDBPtr db = _openTree(run);
+	MODELMAP model;
+	bool ret = ((BTreeDB*)db != 0) || _fail(run, 0, "can't create the tree");
+	ret = ret && _churn(run, 0, TEST_KEYS, db, model);
+	SnapshotPtr older = ret ? db->beginSnapshot() : SnapshotPtr();
+	ret = ret && (((Snapshot*)older != 0) || _fail(run, TEST_KEYS, "can't begin a snapshot"));
+	MODELMAP olderModel(model);
+	ret = ret && _churn(run, TEST_KEYS, TEST_KEYS, db, model);
+	SnapshotPtr newer = ret ? db->beginSnapshot() : SnapshotPtr();
+	ret = ret && (((Snapshot*)newer != 0) || _fail(run, 2 * TEST_KEYS, "can't begin a snapshot"));
+	MODELMAP newerModel(model);
+	for (size_t opNo = 2 * TEST_KEYS; ret && opNo < 4 * TEST_KEYS; opNo += TEST_KEYS / 2)
+	{
+		ret = _checkSnapshot(run, opNo, older, olderModel, false) && _churn(run, opNo, TEST_KEYS / 2, db, model);
+	}
+	ret = ret && _checkSnapshot(run, 4 * TEST_KEYS, newer, newerModel, true) && _checkTree(run, 4 * TEST_KEYS, db, model);
+	newer = (Snapshot*)0;
+	ret = ret && _churn(run, 4 * TEST_KEYS, 2 * TEST_KEYS, db, model);
+	ret = ret && _checkSnapshot(run, 6 * TEST_KEYS, older, olderModel, true);
+	long held = _fileSize(TEST_DB);
+	older = (Snapshot*)0;
+	ret = ret && _churn(run, 6 * TEST_KEYS, 2 * TEST_KEYS, db, model) && _checkTree(run, 8 * TEST_KEYS, db, model);
+	ret = ret && (_fileSize(TEST_DB) <= held || _fail(run, 8 * TEST_KEYS, "the snapshots' pages weren't reclaimed"));
+	older = newer = (Snapshot*)0;
+	if ((BTreeDB*)db != 0)
+	{
+		db->close();
+	}
+	db = (BTreeDB*)0;
+	_removeFiles();
+	printf("%s %s, snapshots\n", ret ? "passed" : "failed", run.name);
+	return ret;
+}
+
+// Get every key, there or not, and then check the whole tree.
+static bool _checkAll(const STestRun& run, size_t opNo, BTreeDBPtr& db, const MODELMAP& model)
+{
+	bool ret = true;
+	for (size_t keyNo = 0; ret && keyNo < TEST_KEYS; keyNo++)
+	{
+		ret = _checkGet(run, opNo, db, model, _makeKey(keyNo));
+	}
+	return ret && _checkTree(run, opNo, db, model);
+}
+
+static bool _checkTableGet(const STestRun& run, size_t opNo, MemTablePtr& table, const MODELMAP& model, const std::string& key)
+{
+	DbObjPtr rec;
+	bool found = table->get(_keyObj(key), rec);
+	MODELMAP::const_iterator mit = model.find(key);
+	if (found != (mit != model.end()) || (found && _valueOf(rec) != mit->second))
+	{
+		return _fail(run, opNo, "table get of " + key + " is wrong");
+	}
+	return true;
+}
+
+// Random puts, dels, gets and short scans through a table.
+static bool _tableOps(const STestRun& run, size_t opNo, size_t ops, MemTablePtr& table, MODELMAP& model)
+{
+	bool ret = true;
+	for (size_t ctr = 1; ret && ctr <= ops; ctr++)
+	{
+		std::string key = _makeKey((size_t)(_random() % TEST_KEYS));
+		unsigned op = (unsigned)(_random() % 100);
+		if (op < 50)
+		{
+			std::string value = _makeValue(opNo + ctr);
+			ret = table->put(new DbObj(key.data(), key.size(), value.data(), value.size())) || _fail(run, opNo + ctr, "table put of " + key + " failed");
+			model[key] = value;
+		}
+		else if (op < 80)
+		{
+			ret = table->del(_keyObj(key)) || _fail(run, opNo + ctr, "table del of " + key + " failed");
+			model.erase(key);
+		}
+		else if (op < 97)
+		{
+			ret = _checkTableGet(run, opNo + ctr, table, model, key);
+		}
+		else
+		{
+			SScanCheck check = { model.lower_bound(key), model.end(), 50, true };
+			ret = (table->scan(_keyObj(key), _scanCallback, &check) && check.ok && (check.left == 0 || check.next == model.end())) ||
+				_fail(run, opNo + ctr, "table scan from " + key + " is wrong");
+		}
+	}
+	return ret;
+}
+
+// Put and del through a table of a few KB, so that lists are frozen and
+// merged into the tree all the way through, with gets and scans looking
+// at the lists and the tree as the merges go on. Then close the table,
+// check the tree, and do the same again with the table reopened.
+static bool _testMemTable(const STestRun& run)
+{
+	_removeFiles();
+	BTreeDBPtr db = _openTree(run);
+	MODELMAP model;
+	bool ret = ((BTreeDB*)db != 0) || _fail(run, 0, "can't create the tree");
+	for (size_t pass = 0; ret && pass < 2; pass++)
+	{
+		MemTablePtr table = new MemTable(db, 4096);
+		ret = table->open() || _fail(run, pass * TEST_OPS / 4, "can't open the table");
+		ret = ret && _tableOps(run, pass * TEST_OPS / 4, TEST_OPS / 4, table, model);
+		ret = ret && (table->close() || _fail(run, (pass + 1) * TEST_OPS / 4, "can't close the table"));
+		ret = ret && _checkAll(run, (pass + 1) * TEST_OPS / 4, db, model);
+	}
+	if ((BTreeDB*)db != 0)
+	{
+		db->close();
+	}
+	db = (BTreeDB*)0;
+	_removeFiles();
+	printf("%s %s, memtable\n", ret ? "passed" : "failed", run.name);
+	return ret;
+}
+
+// Copy the bytes of a file from one offset up to another.
+static bool _copyPart(const std::string& from, const std::string& to, long start, long end)
+{
+	FILE* in = fopen(from.c_str(), "rb");
+	FILE* out = (in != 0) ? fopen(to.c_str(), "wb") : 0;
+	bool ret = (out != 0) && (0 == fseek(in, start, SEEK_SET));
+	char buf[4096];
+	for (long left = end - start; ret && left > 0; )
+	{
+		size_t size = fread(buf, 1, (left < (long)sizeof(buf)) ? (size_t)left : sizeof(buf), in);
+		ret = (size != 0) && (size == fwrite(buf, 1, size, out));
+		left -= (long)size;
+	}
+	if (in != 0)
+	{
+		fclose(in);
+	}
+	return (out != 0) && (0 == fclose(out)) && ret;
+}
+
+// Put back the files a process that died with a table open would leave:
+// the tree as it was before the table was opened, the log of a frozen
+// list that didn't get into it, and a live log whose last entry was only
+// partly written. Opening the table again must merge the frozen log,
+// and replay the live one up to the torn entry and cut it off there.
+static bool _testTableReplay(const STestRun& run)
+{
+	_removeFiles();
+	std::string logName = std::string(TEST_DB) + ".wal";
+	BTreeDBPtr db = _openTree(run);
+	MODELMAP model;
+	bool ret = ((BTreeDB*)db != 0) || _fail(run, 0, "can't create the tree");
+	ret = ret && _churn(run, 0, TEST_KEYS, db, model) && _reopen(run, TEST_KEYS, db);
+	if (ret)
+	{
+		db->close();
+		ret = _copyFile(TEST_DB, std::string(TEST_DB) + ".before");
+		db = _openTree(run);
+		ret = (ret && (BTreeDB*)db != 0) || _fail(run, TEST_KEYS, "can't keep the tree");
+	}
+
+	// The table is too big to freeze, so its log has everything. The
+	// first half of it stands for the frozen list's log, and the rest,
+	// with the last entry cut short, for the live one's.
+	MemTablePtr table = new MemTable(db, 64 * 1024 * 1024);
+	ret = ret && (table->open() || _fail(run, TEST_KEYS, "can't open the table"));
+	ret = ret && _tableOps(run, TEST_KEYS, TEST_KEYS, table, model);
+	long frozenEnd = _fileSize(logName.c_str());
+	ret = ret && _tableOps(run, 2 * TEST_KEYS, TEST_KEYS, table, model);
+	long liveEnd = _fileSize(logName.c_str());
+	std::string key = _makeKey(0);
+	std::string value = _makeValue(0) + "torn";
+	ret = ret && (table->put(new DbObj(key.data(), key.size(), value.data(), value.size())) || _fail(run, 3 * TEST_KEYS, "table put failed"));
+	long tornEnd = _fileSize(logName.c_str()) - 3;
+	ret = ret && _copyFile(logName, logName + ".all");
+	ret = ret && (table->close() || _fail(run, 3 * TEST_KEYS, "can't close the table"));
+	table = (MemTable*)0;
+	if ((BTreeDB*)db != 0)
+	{
+		db->close();
+	}
+	db = (BTreeDB*)0;
+	ret = ret && ((_copyFile(std::string(TEST_DB) + ".before", TEST_DB) &&
+		_copyPart(logName + ".all", logName + ".old", 0, frozenEnd) &&
+		_copyPart(logName + ".all", logName, frozenEnd, tornEnd)) || _fail(run, 3 * TEST_KEYS, "can't set up the crash"));
+
+	// Replay, check through the table, close it and check the tree. Then
+	// put the live log back (the frozen one is in the tree by now), and
+	// replay it again onto the tree that already has it.
+	if (ret)
+	{
+		db = _openTree(run);
+		ret = ((BTreeDB*)db != 0) || _fail(run, 3 * TEST_KEYS, "can't open the tree again");
+	}
+	for (size_t pass = 0; ret && pass < 2; pass++)
+	{
+		table = new MemTable(db, 64 * 1024 * 1024);
+		ret = table->open() || _fail(run, 3 * TEST_KEYS, "can't replay the table");
+		ret = ret && ((0 != _access((logName + ".old").c_str(), 0) && _fileSize(logName.c_str()) == liveEnd - frozenEnd) ||
+			_fail(run, 3 * TEST_KEYS, "the logs weren't merged and cut back"));
+		for (size_t keyNo = 0; ret && keyNo < TEST_KEYS; keyNo++)
+		{
+			ret = _checkTableGet(run, 3 * TEST_KEYS, table, model, _makeKey(keyNo));
+		}
+		ret = ret && (table->close() || _fail(run, 3 * TEST_KEYS, "can't close the table"));
+		table = (MemTable*)0;
+		ret = ret && _checkAll(run, 3 * TEST_KEYS, db, model);
+		ret = ret && (pass == 1 || _copyPart(logName + ".all", logName, frozenEnd, tornEnd));
+	}
+	if ((BTreeDB*)db != 0)
+	{
+		db->close();
+	}
+	db = (BTreeDB*)0;
+	_removeFiles();
+	remove((std::string(TEST_DB) + ".before").c_str());
+	remove((logName + ".all").c_str());
+	printf("%s %s, memtable replayed\n", ret ? "passed" : "failed", run.name);
+	return ret;
+}
+
+// A payload that says which key and which version of it it is, so that
+// a reader can tell a whole record from one put together out of parts
+// of two.
+static std::string _versionValue(size_t keyNo, size_t version)
+{
+	char buf[16];
+	sprintf(buf, "%08u", (unsigned int)version);
+	std::string value(buf);
+	value.append(version * 13 % (MAX_VALUE - value.size()), (char)('a' + (keyNo * 7 + version) % 26));
+	return value;
+}
+
+// What the readers share with the thread that starts them.
+struct SReaderCheck
+{
+	BTreeDBPtr db;
+	std::atomic<bool> done;
+	std::atomic<bool> ok;
+	std::atomic<size_t> gets;
+	std::mutex lock;
+	std::string failure;
+};
+
+// Get random keys until the writer is done. Each record found has to be
+// one that was put whole, under the key asked for, and no older than the
+// last one this reader saw for that key, as the writer only goes forward.
+static void _readerTask(SReaderCheck* check, size_t readerNo)
+{
+	std::mt19937_64 random(TEST_SEED + readerNo);
+	std::vector<size_t> seen(TEST_KEYS, 0);
+	while (check->ok && !check->done)
+	{
+		size_t keyNo = (size_t)(random() % TEST_KEYS);
+		std::string key = _makeKey(keyNo);
+		DbObjPtr rec;
+		++check->gets;
+		if (!check->db->get(_keyObj(key), rec))
+		{
+			continue;
+		}
+		std::string value = _valueOf(rec);
+		size_t version = (size_t)atoi(value.substr(0, 8).c_str());
+		if (std::string((const char*)rec->getData(), KEY_SIZE) != key || value != _versionValue(keyNo, version) || version < seen[keyNo])
+		{
+			std::lock_guard<std::mutex> guard(check->lock);
+			check->failure = "get of " + key + " gave a record that was never put";
+			check->ok = false;
+		}
+		seen[keyNo] = version;
+	}
+}
+
+// One thread puts and dels, with a commit or flush now and then, while
+// others get the same keys. Records found through the record cache and
+// by optimistic reads are taken without the tree's lock, so this is where
+// a record read while it was being changed would show.
+static bool _testReaders(const STestRun& run)
+{
+	_removeFiles();
+	SReaderCheck check;
+	check.db = _openTree(run);
+	check.done = false;
+	check.ok = ((BTreeDB*)check.db != 0) || _fail(run, 0, "can't create the tree");
+	check.gets = 0;
+	MODELMAP model;
+	std::vector<std::thread> readers;
+	for (size_t readerNo = 0; check.ok && readerNo < READER_THREADS; readerNo++)
+	{
+		readers.push_back(std::thread(_readerTask, &check, readerNo));
+	}
+	for (size_t opNo = 1; check.ok && opNo <= TEST_OPS; opNo++)
+	{
+		size_t keyNo = (size_t)(_random() % TEST_KEYS);
+		std::string key = _makeKey(keyNo);
+		if (_random() % 4 == 0)
+		{
+			check.db->del(_keyObj(key));
+			model.erase(key);
+		}
+		else
+		{
+			std::string value = _versionValue(keyNo, opNo);
+			check.ok = check.db->put(new DbObj(key.data(), key.size(), value.data(), value.size())) || _fail(run, opNo, "put of " + key + " failed");
+			model[key] = value;
+		}
+		check.ok = check.ok && (opNo % 1000 != 0 || check.db->commit() || _fail(run, opNo, "commit failed"));
+	}
+	check.done = true;
+	for (size_t ctr = 0; ctr < readers.size(); ctr++)
+	{
+		readers[ctr].join();
+	}
+	bool ret = check.ok || _fail(run, TEST_OPS, check.failure);
+	ret = ret && (check.gets >= READER_THREADS || _fail(run, TEST_OPS, "the readers didn't get anything"));
+	ret = ret && _checkAll(run, TEST_OPS, check.db, model);
+	if ((BTreeDB*)check.db != 0)
+	{
+		check.db->close();
+	}
+	check.db = (BTreeDB*)0;
+	_removeFiles();
+	printf("%s %s, with readers\n", ret ? "passed" : "failed", run.name);
+	return ret;
+}
+
+// Bulk load a file cut into many small chunks, with each key on several
+// lines spread through it, so that the runs have keys in common and the
+// merge has to keep the last line's payload. Check the tree, reopen it
+// and check it again, and then check that puts and dels still work.
+static bool _testBulkLoad(const STestRun& run)
+{
+	_removeFiles();
+	MODELMAP model;
+	FILE* tsv = fopen(TEST_TSV, "wb");
+	bool ret = (tsv != 0);
+	for (size_t lineNo = 0; ret && lineNo < 3 * TEST_KEYS; lineNo++)
+	{
+		std::string key = _makeKey((size_t)(_random() % TEST_KEYS));
+		std::string value = _makeValue(lineNo);
+		ret = (0 <= fprintf(tsv, "%s\t%s\n", key.c_str(), value.c_str()));
+		model[key] = value;
+	}
+	ret = ((tsv != 0) && (0 == fclose(tsv)) && ret) || _fail(run, 0, "can't write the file");
+	BTreeDBPtr db = ret ? _openTree(run) : BTreeDBPtr();
+	ret = ret && (((BTreeDB*)db != 0) || _fail(run, 0, "can't create the tree"));
+	if (ret)
+	{
+		BulkLoader loader(db);
+		loader.setChunkSize(16384);
+		loader.setThreads(4);
+		ret = loader.load(TEST_TSV) || _fail(run, 0, "load failed");
+		ret = ret && ((loader.getLoaded() == model.size() && loader.getRejected() == 0) || _fail(run, 0, "load has the wrong number of records"));
+	}
+	ret = ret && _checkAll(run, 0, db, model);
+	ret = ret && _reopen(run, 0, db) && _checkAll(run, 0, db, model);
+	for (size_t opNo = 1; ret && opNo <= TEST_KEYS; opNo++)
+	{
+		std::string key = _makeKey((size_t)(_random() % TEST_KEYS));
+		if (_random() % 4 == 0)
+		{
+			db->del(_keyObj(key));
+			model.erase(key);
+			continue;
+		}
+		std::string value = _makeValue(opNo);
+		ret = db->put(new DbObj(key.data(), key.size(), value.data(), value.size())) || _fail(run, opNo, "put of " + key + " failed");
+		model[key] = value;
+	}
+	ret = ret && _checkAll(run, TEST_KEYS, db, model);
+	if ((BTreeDB*)db != 0)
+	{
+		db->close();
+	}
+	db = (BTreeDB*)0;
+	_removeFiles();
+	remove(TEST_TSV);
+	printf("%s %s, bulk loaded\n", ret ? "passed" : "failed", run.name);
+	return ret;
+}
+
+int main()
+{
+	_testConversions();
+	bool ret = true;
+	for (size_t ctr = 0; ctr < sizeof(TEST_RUNS) / sizeof(TEST_RUNS[0]); ctr++)
+	{
+		ret = _testRun(TEST_RUNS[ctr]) && ret;
+	}
+	ret = _testStaleSidecars() && ret;
+	ret = _testCollectCrash(TEST_RUNS[2]) && ret;
+	ret = _testCollectCrash(TEST_RUNS[12]) && ret;
+	ret = _testSnapshots(TEST_RUNS[7]) && ret;
+	ret = _testSnapshots(TEST_RUNS[12]) && ret;
+	ret = _testMemTable(TEST_RUNS[0]) && ret;
+	ret = _testMemTable(TEST_RUNS[12]) && ret;
+	ret = _testMemTable(TEST_RUNS[14]) && ret;
+	ret = _testTableReplay(TEST_RUNS[0]) && ret;
+	ret = _testTableReplay(TEST_RUNS[12]) && ret;
+	ret = _testReaders(TEST_RUNS[0]) && ret;
+	ret = _testReaders(TEST_RUNS[6]) && ret;
+	ret = _testReaders(TEST_RUNS[8]) && ret;
+	ret = _testReaders(TEST_RUNS[13]) && ret;
+	ret = _testReaders(TEST_RUNS[15]) && ret;
+	ret = _testBulkLoad(TEST_RUNS[1]) && ret;
+	ret = _testBulkLoad(TEST_RUNS[12]) && ret;
+	ret = _testBulkLoad(TEST_RUNS[13]) && ret;
+	return ret ? 0 : 1;
+}